@@ -0,0 +1,114 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+import {
+  addString,
+  copyProfile,
+  Frame,
+  getString,
+  locationFrames,
+} from './profile-utils';
+
+export const TYPE_LABEL = 'type';
+
+// Types of the objects allocated by functions of Node.js internals, by file
+// name without extension, such as "buffer" for "buffer.js" or
+// "node:buffer".
+const INTERNAL_TYPES: {[file: string]: string} = {
+  buffer: 'Buffer',
+  'internal/buffer': 'Buffer',
+};
+
+// Name of a class, or of a function called with new: an identifier starting
+// with an upper case letter.
+const CONSTRUCTOR_NAME = /^[A-Z][A-Za-z0-9_$]*$/;
+
+/**
+ * Live bytes of the objects of one type.
+ */
+export interface TypeTotal {
+  type: string;
+  bytes: number;
+}
+
+/**
+ * @return the type of the objects allocated at stack, leaf first, as
+ * indicated by its leaf, the function which allocated them: the type
+ * allocated by a function of Node.js internals known to allocate one type,
+ * such as Buffer, or the name of a constructor, or '' otherwise. Callers of
+ * the leaf are not considered, as a constructor calling a function which
+ * allocates does not indicate the type of what it allocates.
+ *
+ * Heap profiles only have JavaScript frames, so objects allocated by
+ * built-in constructors, such as Map or Array, have no type unless they are
+ * allocated directly by a constructor. They then have the type of that
+ * constructor rather than their own.
+ */
+export function allocationType(stack: Frame[]): string {
+  const leaf = stack[0];
+  if (!leaf) {
+    return '';
+  }
+  const file = leaf.filename.replace(/^node:/, '').replace(/\.js$/, '');
+  const internal = INTERNAL_TYPES[file];
+  if (internal) {
+    return internal;
+  }
+  return CONSTRUCTOR_NAME.test(leaf.name) ? leaf.name : '';
+}
+
+/**
+ * Labels each sample of p, a heap profile, with the type of the objects
+ * allocated at its stack, as inferred by allocationType(). Samples whose
+ * type cannot be inferred are not labeled.
+ *
+ * @return copy of p with "type" labels, and the live bytes of each type,
+ * including "(unknown)", sorted by bytes descending.
+ */
+export function addTypeLabels(
+  p: perftools.profiles.IProfile
+): {profile: perftools.profiles.IProfile; totals: TypeTotal[]} {
+  const out = copyProfile(p);
+  const frames = locationFrames(p);
+  const valueIdx = (p.sampleType || []).findIndex(
+    t => getString(p, t.type) === 'space'
+  );
+  const key = addString(out, TYPE_LABEL);
+  const totals = new Map<string, number>();
+  out.sample = out.sample!.map(s => {
+    const stack: Frame[] = [];
+    for (const id of s.locationId || []) {
+      stack.push(...(frames.get(Number(id)) || []));
+    }
+    const type = allocationType(stack);
+    const bytes = valueIdx < 0 ? 0 : Number((s.value || [])[valueIdx] || 0);
+    const total = type || '(unknown)';
+    totals.set(total, (totals.get(total) || 0) + bytes);
+    if (!type) {
+      return s;
+    }
+    return new perftools.profiles.Sample({
+      locationId: s.locationId,
+      value: s.value,
+      label: (s.label || []).concat([
+        new perftools.profiles.Label({key, str: addString(out, type)}),
+      ]),
+    });
+  });
+  const sorted = [...totals]
+    .map(([type, bytes]) => ({type, bytes}))
+    .sort((a, b) => b.bytes - a.bytes);
+  return {profile: out, totals: sorted};
+}
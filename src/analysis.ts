@@ -0,0 +1,627 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+import {Reader} from 'protobufjs/minimal';
+import {pipeline, Writable} from 'stream';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {isGzipped, uncompressProfile} from './merge';
+
+// Numbers of the fields of the pprof Profile message read by StackReader.
+const SAMPLE_TYPE_FIELD = 1;
+const SAMPLE_FIELD = 2;
+const LOCATION_FIELD = 4;
+const FUNCTION_FIELD = 5;
+const STRING_TABLE_FIELD = 6;
+
+// Wire type of length-delimited fields.
+const LENGTH_DELIMITED = 2;
+
+/**
+ * A stack of a profile and the values of the samples with that stack.
+ */
+export interface Stack {
+  // Names of the frames of the stack, root first.
+  frames: string[];
+  values: number[];
+}
+
+/**
+ * The samples of a profile, summed by stack.
+ */
+export interface StackProfile {
+  // Sample types, such as "space", and their units, such as "bytes".
+  sampleTypes: Array<{type: string; unit: string}>;
+  stacks: Stack[];
+}
+
+/**
+ * Reads a serialized pprof Profile message from the chunks of bytes passed
+ * to push(), one field at a time, summing the values of samples with the
+ * same stack as they are read. Only the bytes of a field which is not yet
+ * complete are kept between chunks, so the memory used is proportional to
+ * the number of distinct stacks, functions and locations rather than to the
+ * size of the profile.
+ */
+export class StackReader {
+  private sampleTypes: perftools.profiles.ValueType[] = [];
+  // Map from location IDs of a stack, leaf first, to the summed values.
+  private samples = new Map<string, number[]>();
+  // Map from location ID to function IDs of its lines, leaf first.
+  private locations = new Map<number, number[]>();
+  private functions = new Map<number, perftools.profiles.Function>();
+  private strings: string[] = [];
+  // Bytes of the field which was incomplete at the end of the last chunk.
+  private partial: Buffer = Buffer.alloc(0);
+
+  push(chunk: Buffer) {
+    const buffer =
+      this.partial.length > 0 ? Buffer.concat([this.partial, chunk]) : chunk;
+    const reader = Reader.create(buffer);
+    while (reader.pos < reader.len) {
+      const start = reader.pos;
+      if (!this.readField(reader, buffer)) {
+        reader.pos = start;
+        break;
+      }
+    }
+    this.partial = buffer.slice(reader.pos);
+  }
+
+  /**
+   * Reads the field starting at the position of reader.
+   *
+   * @return false when the field is not complete.
+   */
+  private readField(reader: Reader, buffer: Buffer): boolean {
+    let tag: number;
+    let length: number;
+    try {
+      tag = reader.uint32();
+      if ((tag & 7) !== LENGTH_DELIMITED) {
+        reader.skipType(tag & 7);
+        return true;
+      }
+      length = reader.uint32();
+    } catch (err) {
+      if (err instanceof RangeError) {
+        return false;
+      }
+      throw err;
+    }
+    if (reader.pos + length > reader.len) {
+      return false;
+    }
+    const field = buffer.slice(reader.pos, reader.pos + length);
+    reader.pos += length;
+    switch (tag >>> 3) {
+      case SAMPLE_TYPE_FIELD:
+        this.sampleTypes.push(perftools.profiles.ValueType.decode(field));
+        break;
+      case SAMPLE_FIELD: {
+        const s = perftools.profiles.Sample.decode(field);
+        const key = s.locationId.join(',');
+        const values = this.samples.get(key);
+        if (values) {
+          s.value.forEach((v, i) => (values[i] = (values[i] || 0) + Number(v)));
+        } else {
+          this.samples.set(key, s.value.map(Number));
+        }
+        break;
+      }
+      case LOCATION_FIELD: {
+        const loc = perftools.profiles.Location.decode(field);
+        this.locations.set(
+          Number(loc.id),
+          loc.line.map(l => Number(l.functionId))
+        );
+        break;
+      }
+      case FUNCTION_FIELD: {
+        const f = perftools.profiles.Function.decode(field);
+        this.functions.set(Number(f.id), f);
+        break;
+      }
+      case STRING_TABLE_FIELD:
+        this.strings.push(field.toString('utf8'));
+        break;
+    }
+    return true;
+  }
+
+  /**
+   * @return the stacks of the profile read.
+   * @throws error when the last field of the profile is incomplete.
+   */
+  profile(): StackProfile {
+    if (this.partial.length > 0) {
+      throw new Error('Profile is truncated.');
+    }
+    const strings = this.strings;
+    const frameName = (functionId: number) => {
+      const f = this.functions.get(functionId);
+      if (!f) {
+        return '(unknown)';
+      }
+      const name = strings[Number(f.name)] || '(anonymous)';
+      const filename = strings[Number(f.filename)];
+      return filename ? `${name} ${filename}` : name;
+    };
+    const stacks = new Map<string, Stack>();
+    for (const [key, values] of this.samples) {
+      const frames: string[] = [];
+      for (const id of key ? key.split(',') : []) {
+        frames.push(...(this.locations.get(Number(id)) || []).map(frameName));
+      }
+      frames.reverse();
+      const stackKey = frames.join('\n');
+      const stack = stacks.get(stackKey);
+      if (stack) {
+        values.forEach(
+          (v, i) => (stack.values[i] = (stack.values[i] || 0) + v)
+        );
+      } else {
+        stacks.set(stackKey, {frames, values: values.slice()});
+      }
+    }
+    return {
+      sampleTypes: this.sampleTypes.map(t => ({
+        type: strings[Number(t.type)] || '',
+        unit: strings[Number(t.unit)] || '',
+      })),
+      stacks: Array.from(stacks.values()),
+    };
+  }
+}
+
+/**
+ * @return the stacks of the serialized, optionally gzipped, profile in
+ * buffer. A gzipped profile is uncompressed in memory as a whole; use
+ * readStacksFile() to read a large profile from a file.
+ */
+export function readStacks(buffer: Buffer): StackProfile {
+  const reader = new StackReader();
+  reader.push(uncompressProfile(buffer));
+  return reader.profile();
+}
+
+/**
+ * @return the stacks of the serialized, optionally gzipped, profile in file,
+ * which is read and uncompressed as a stream, so that neither the file nor
+ * the uncompressed profile is held in memory as a whole.
+ */
+export async function readStacksFile(file: string): Promise<StackProfile> {
+  const header = Buffer.alloc(2);
+  const fd = await fs.promises.open(file, 'r');
+  try {
+    await fd.read(header, 0, header.length, 0);
+  } finally {
+    await fd.close();
+  }
+
+  const reader = new StackReader();
+  const sink = new Writable({
+    write(chunk: Buffer, encoding, callback) {
+      try {
+        reader.push(chunk);
+        callback();
+      } catch (err) {
+        callback(err);
+      }
+    },
+  });
+  await new Promise<void>((resolve, reject) => {
+    const done = (err: NodeJS.ErrnoException | null) =>
+      err ? reject(err) : resolve();
+    const input = fs.createReadStream(file);
+    if (isGzipped(header)) {
+      pipeline(input, zlib.createGunzip(), sink, done);
+    } else {
+      pipeline(input, sink, done);
+    }
+  });
+  return reader.profile();
+}
+
+/**
+ * @return index of the sample type named type, or of the last sample type
+ * when type is not specified.
+ * @throws error when the profile has no sample type named type.
+ */
+export function sampleTypeIndex(p: StackProfile, type?: string): number {
+  if (type === undefined) {
+    return p.sampleTypes.length - 1;
+  }
+  const idx = p.sampleTypes.findIndex(t => t.type === type);
+  if (idx < 0) {
+    throw new Error(
+      `Profile has no sample type ${type}; sample types are ` +
+        `${p.sampleTypes.map(t => t.type).join(', ')}.`
+    );
+  }
+  return idx;
+}
+
+/**
+ * The summed values of the samples in which a function appears.
+ */
+export interface FunctionValue {
+  name: string;
+  // Value of samples in which the function is the leaf frame.
+  flat: number;
+  // Value of samples in which the function appears in any frame.
+  cum: number;
+}
+
+/**
+ * @return the functions of p, by descending flat value and then by
+ * descending cumulative value.
+ */
+export function topFunctions(
+  p: StackProfile,
+  valueIndex: number
+): FunctionValue[] {
+  const byName = new Map<string, FunctionValue>();
+  const get = (name: string) => {
+    let fv = byName.get(name);
+    if (!fv) {
+      fv = {name, flat: 0, cum: 0};
+      byName.set(name, fv);
+    }
+    return fv;
+  };
+  for (const s of p.stacks) {
+    const value = s.values[valueIndex] || 0;
+    if (s.frames.length > 0) {
+      get(s.frames[s.frames.length - 1]).flat += value;
+    }
+    // Recursive functions are counted once for each stack.
+    for (const name of new Set(s.frames)) {
+      get(name).cum += value;
+    }
+  }
+  return Array.from(byName.values()).sort(
+    (a, b) => b.flat - a.flat || b.cum - a.cum
+  );
+}
+
+/**
+ * @return sum of the values at valueIndex of all stacks of p.
+ */
+export function totalValue(p: StackProfile, valueIndex: number): number {
+  return p.stacks.reduce((sum, s) => sum + (s.values[valueIndex] || 0), 0);
+}
+
+function percent(value: number, total: number): string {
+  return total ? `${((100 * value) / total).toFixed(2)}%` : '-';
+}
+
+/**
+ * @return table of the n functions of p with the highest flat value, in
+ * the style of "pprof -top".
+ */
+export function formatTop(
+  p: StackProfile,
+  valueIndex: number,
+  n: number
+): string {
+  const total = totalValue(p, valueIndex);
+  const {type, unit} = p.sampleTypes[valueIndex] || {type: '', unit: ''};
+  const rows = [['flat', 'flat%', 'sum%', 'cum', 'cum%', 'function']];
+  let sum = 0;
+  for (const f of topFunctions(p, valueIndex).slice(0, n)) {
+    sum += f.flat;
+    rows.push([
+      `${f.flat}`,
+      percent(f.flat, total),
+      percent(sum, total),
+      `${f.cum}`,
+      percent(f.cum, total),
+      f.name,
+    ]);
+  }
+  return `Total ${type}: ${total} ${unit}\n` + formatRows(rows);
+}
+
+/**
+ * @return rows as lines of columns, right-aligned except for the last.
+ */
+function formatRows(rows: string[][]): string {
+  const widths = rows[0].map((_, i) =>
+    Math.max(...rows.map(r => r[i].length))
+  );
+  return rows
+    .map(r =>
+      r
+        .map((c, i) => (i === r.length - 1 ? c : c.padStart(widths[i])))
+        .join(' ')
+    )
+    .join('\n')
+    .concat('\n');
+}
+
+/**
+ * @return the stacks of p in the collapsed format of FlameGraph's
+ * stackcollapse scripts: one line per stack, of the frames, root first,
+ * separated by semicolons, followed by the value of the stack.
+ */
+export function collapsedStacks(p: StackProfile, valueIndex: number): string {
+  return p.stacks
+    .filter(s => (s.values[valueIndex] || 0) !== 0)
+    .map(
+      s =>
+        s.frames.map(f => f.replace(/[;\n]/g, ':')).join(';') +
+        ` ${s.values[valueIndex]}`
+    )
+    .sort()
+    .join('\n')
+    .concat('\n');
+}
+
+// Units of weights understood by speedscope.
+const SPEEDSCOPE_UNITS = [
+  'bytes',
+  'nanoseconds',
+  'microseconds',
+  'milliseconds',
+  'seconds',
+];
+
+/**
+ * @return the stacks of p as a sampled profile in the file format of
+ * speedscope (https://www.speedscope.app).
+ */
+export function speedscopeProfile(
+  p: StackProfile,
+  valueIndex: number,
+  name: string
+): object {
+  const frames: Array<{name: string}> = [];
+  const frameIndex = new Map<string, number>();
+  const samples: number[][] = [];
+  const weights: number[] = [];
+  for (const s of p.stacks) {
+    const value = s.values[valueIndex] || 0;
+    if (value === 0) {
+      continue;
+    }
+    samples.push(
+      s.frames.map(f => {
+        let idx = frameIndex.get(f);
+        if (idx === undefined) {
+          idx = frames.length;
+          frames.push({name: f});
+          frameIndex.set(f, idx);
+        }
+        return idx;
+      })
+    );
+    weights.push(value);
+  }
+  const unit = (p.sampleTypes[valueIndex] || {unit: ''}).unit;
+  return {
+    $schema: 'https://www.speedscope.app/file-format-schema.json',
+    name,
+    exporter: 'cloud-profiler-analyze',
+    shared: {frames},
+    profiles: [
+      {
+        type: 'sampled',
+        name,
+        unit: SPEEDSCOPE_UNITS.indexOf(unit) >= 0 ? unit : 'none',
+        startValue: 0,
+        endValue: weights.reduce((sum, w) => sum + w, 0),
+        samples,
+        weights,
+      },
+    ],
+  };
+}
+
+interface FlameNode {
+  // Name of the frame.
+  n: string;
+  // Value of the samples whose stacks pass through the frame.
+  v: number;
+  // Callees of the frame.
+  c: FlameNode[];
+}
+
+/**
+ * @return tree of the stacks of p, merged by frame, with a root named root.
+ */
+function flameTree(
+  p: StackProfile,
+  valueIndex: number,
+  root: string
+): FlameNode {
+  const tree: FlameNode = {n: root, v: 0, c: []};
+  const children = new Map<FlameNode, Map<string, FlameNode>>();
+  for (const s of p.stacks) {
+    const value = s.values[valueIndex] || 0;
+    if (value <= 0) {
+      continue;
+    }
+    let node = tree;
+    node.v += value;
+    for (const f of s.frames) {
+      let byName = children.get(node);
+      if (!byName) {
+        byName = new Map();
+        children.set(node, byName);
+      }
+      let child = byName.get(f);
+      if (!child) {
+        child = {n: f, v: 0, c: []};
+        byName.set(f, child);
+        node.c.push(child);
+      }
+      child.v += value;
+      node = child;
+    }
+  }
+  return tree;
+}
+
+// Script of the flame graph page, which draws the tree in the variable
+// "data" and zooms into a frame when it is clicked.
+const FLAME_GRAPH_SCRIPT = `
+const graph = document.getElementById('graph');
+const details = document.getElementById('details');
+const ROW = 18;
+function depth(node) {
+  return 1 + Math.max(0, ...node.c.map(depth));
+}
+function draw(focus) {
+  graph.innerHTML = '';
+  graph.style.height = depth(focus) * ROW + 'px';
+  const add = (node, x, width, level) => {
+    if (width < 0.05) return;
+    const div = document.createElement('div');
+    div.className = 'frame';
+    div.style.left = x + '%';
+    div.style.width = width + '%';
+    div.style.top = level * ROW + 'px';
+    div.style.background = 'hsl(' + (20 + (node.n.length * 37) % 40) +
+      ', 90%, ' + (60 + (node.n.length * 13) % 20) + '%)';
+    div.textContent = node.n;
+    const pct = (100 * node.v / data.v).toFixed(2);
+    div.title = node.n + ' (' + node.v + ', ' + pct + '%)';
+    div.onmouseover = () => (details.textContent = div.title);
+    div.onclick = () => draw(node);
+    graph.appendChild(div);
+    let cx = x;
+    for (const c of node.c) {
+      const cw = width * c.v / node.v;
+      add(c, cx, cw, level + 1);
+      cx += cw;
+    }
+  };
+  add(focus, 0, 100, 0);
+}
+draw(data);
+`;
+
+/**
+ * @return a self-contained HTML page with an icicle-style flame graph of
+ * the stacks of p, in which clicking a frame zooms into it.
+ */
+export function flameGraphHtml(
+  p: StackProfile,
+  valueIndex: number,
+  title: string
+): string {
+  const {type, unit} = p.sampleTypes[valueIndex] || {type: '', unit: ''};
+  const data = JSON.stringify(flameTree(p, valueIndex, 'all')).replace(
+    /</g,
+    '\\u003c'
+  );
+  const escaped = title.replace(/[&<>"]/g, c => `&#${c.charCodeAt(0)};`);
+  return `<!DOCTYPE html>
+<html>
+<head>
+<meta charset="utf-8">
+<title>${escaped}</title>
+<style>
+body { font: 12px sans-serif; margin: 8px; }
+#graph { position: relative; width: 100%; }
+.frame { position: absolute; box-sizing: border-box; height: 17px;
+  overflow: hidden; white-space: nowrap; padding: 1px 3px;
+  border-right: 1px solid #fff; cursor: pointer; }
+</style>
+</head>
+<body>
+<h3>${escaped}: ${type} (${unit})</h3>
+<div id="details">&nbsp;</div>
+<div id="graph"></div>
+<script>
+const data = ${data};
+${FLAME_GRAPH_SCRIPT.trim()}
+</script>
+</body>
+</html>
+`;
+}
+
+/**
+ * Flat values of a function in two profiles.
+ */
+export interface FunctionDiff {
+  name: string;
+  base: number;
+  other: number;
+  delta: number;
+}
+
+/**
+ * @return the change in the flat value of each function from base to
+ * other, by descending magnitude of the change.
+ */
+export function diffFunctions(
+  base: StackProfile,
+  other: StackProfile,
+  valueIndex: number
+): FunctionDiff[] {
+  const diffs = new Map<string, FunctionDiff>();
+  const get = (name: string) => {
+    let d = diffs.get(name);
+    if (!d) {
+      d = {name, base: 0, other: 0, delta: 0};
+      diffs.set(name, d);
+    }
+    return d;
+  };
+  for (const f of topFunctions(base, valueIndex)) {
+    get(f.name).base = f.flat;
+  }
+  for (const f of topFunctions(other, valueIndex)) {
+    get(f.name).other = f.flat;
+  }
+  const result = Array.from(diffs.values()).filter(d => {
+    d.delta = d.other - d.base;
+    return d.delta !== 0;
+  });
+  return result.sort((a, b) => Math.abs(b.delta) - Math.abs(a.delta));
+}
+
+/**
+ * @return table of the n functions whose flat value changed most from base
+ * to other.
+ */
+export function formatDiff(
+  base: StackProfile,
+  other: StackProfile,
+  valueIndex: number,
+  n: number
+): string {
+  const baseTotal = totalValue(base, valueIndex);
+  const otherTotal = totalValue(other, valueIndex);
+  const {type, unit} = base.sampleTypes[valueIndex] || {type: '', unit: ''};
+  const rows = [['delta', 'delta%', 'base', 'other', 'function']];
+  for (const d of diffFunctions(base, other, valueIndex).slice(0, n)) {
+    rows.push([
+      `${d.delta > 0 ? '+' : ''}${d.delta}`,
+      percent(d.delta, baseTotal),
+      `${d.base}`,
+      `${d.other}`,
+      d.name,
+    ]);
+  }
+  return (
+    `Total ${type}: ${baseTotal} -> ${otherTotal} ${unit}\n` +
+    formatRows(rows)
+  );
+}
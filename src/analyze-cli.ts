@@ -0,0 +1,145 @@
+#!/usr/bin/env node
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+import * as path from 'path';
+
+import {
+  collapsedStacks,
+  flameGraphHtml,
+  formatDiff,
+  formatTop,
+  readStacksFile,
+  sampleTypeIndex,
+  speedscopeProfile,
+  StackProfile,
+} from './analysis';
+
+const USAGE = `
+Usage: cloud-profiler-analyze COMMAND [OPTIONS] PROFILE...
+
+Commands:
+  top PROFILE          functions with the highest flat value
+  collapsed PROFILE    stacks in collapsed (folded) format
+  speedscope PROFILE   speedscope JSON
+  flamegraph PROFILE   flame graph as a self-contained HTML page
+  diff BASE PROFILE    functions whose flat value changed most from BASE
+
+Options:
+  -n N                 number of functions listed by top and diff
+                       (default 20)
+  --sample-type TYPE   sample type to report, such as "space" (default:
+                       the last sample type of the profile)
+  -o OUTPUT            write to OUTPUT rather than standard output
+
+PROFILE is a pprof profile, which may be gzipped.
+`.trim();
+
+// Number of inputs of each command.
+const COMMAND_INPUTS: {[command: string]: number} = {
+  top: 1,
+  collapsed: 1,
+  speedscope: 1,
+  flamegraph: 1,
+  diff: 2,
+};
+
+/**
+ * Runs the command with command line arguments args.
+ *
+ * @param write - writes the output when -o is not specified.
+ * @return exit code of the command.
+ */
+export async function main(
+  args: string[],
+  write: (output: string) => void = s => process.stdout.write(s),
+  log: (message: string) => void = console.error
+): Promise<number> {
+  const command = args[0];
+  let output = '';
+  let sampleType: string | undefined;
+  let n = 20;
+  const inputs: string[] = [];
+  for (let i = 1; i < args.length; i++) {
+    switch (args[i]) {
+      case '-o':
+        output = args[++i] || '';
+        break;
+      case '-n':
+        n = Number(args[++i]);
+        break;
+      case '--sample-type':
+        sampleType = args[++i];
+        break;
+      default:
+        inputs.push(args[i]);
+    }
+  }
+  if (
+    COMMAND_INPUTS[command] !== inputs.length ||
+    !(n > 0) ||
+    (args.indexOf('-o') >= 0 && !output)
+  ) {
+    log(USAGE);
+    return 2;
+  }
+
+  let result: string;
+  try {
+    // Each profile is reduced to its distinct stacks as it is streamed from
+    // its file, so that only those stacks are held in memory.
+    const profiles: StackProfile[] = [];
+    for (const f of inputs) {
+      profiles.push(await readStacksFile(f));
+    }
+    const p = profiles[profiles.length - 1];
+    const valueIndex = sampleTypeIndex(p, sampleType);
+    const name = path.basename(inputs[inputs.length - 1]);
+    switch (command) {
+      case 'top':
+        result = formatTop(p, valueIndex, n);
+        break;
+      case 'collapsed':
+        result = collapsedStacks(p, valueIndex);
+        break;
+      case 'speedscope':
+        result = JSON.stringify(speedscopeProfile(p, valueIndex, name));
+        break;
+      case 'flamegraph':
+        result = flameGraphHtml(p, valueIndex, name);
+        break;
+      default:
+        result = formatDiff(
+          profiles[0],
+          p,
+          sampleTypeIndex(profiles[0], sampleType),
+          n
+        );
+    }
+  } catch (err) {
+    log(`Failed to analyze ${inputs.join(', ')}: ${err}`);
+    return 1;
+  }
+  if (output) {
+    fs.writeFileSync(output, result);
+  } else {
+    write(result);
+  }
+  return 0;
+}
+
+if (require.main === module) {
+  main(process.argv.slice(2)).then(code => (process.exitCode = code));
+}
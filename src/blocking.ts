@@ -0,0 +1,146 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as childProcess from 'child_process';
+import * as fs from 'fs';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {captureStack, nowNanos, StackDurations} from './stack-capture';
+
+type Module = {[name: string]: unknown};
+
+// Modules whose synchronous functions, those with names ending in "Sync",
+// are intercepted.
+const MODULES: Array<[string, Module]> = [
+  ['fs', fs as unknown as Module],
+  ['child_process', childProcess as unknown as Module],
+  ['zlib', zlib as unknown as Module],
+];
+
+// Profiler which has replaced the synchronous functions, if any.
+let activeProfiler: BlockingCallProfiler | undefined;
+
+// Number of calls to wrapped synchronous functions in progress. Synchronous
+// functions may call others through their modules, such as fs.writeFileSync
+// calling fs.openSync, and only the outermost call is recorded.
+let callDepth = 0;
+
+/**
+ * Records the duration of calls to the synchronous functions of the fs,
+ * child_process and zlib modules, which block the event loop, attributed to
+ * the JavaScript stack of the caller.
+ *
+ * While recording, each synchronous function is replaced on its module by a
+ * wrapper which times the call, so calls through references to the original
+ * function obtained before recording started, such as by destructuring the
+ * module, are not recorded. Nothing is done when no synchronous function is
+ * called.
+ */
+export class BlockingCallProfiler {
+  // eslint-disable-next-line @typescript-eslint/ban-types
+  private originals: Array<[Module, string, Function]> = [];
+  private durations: StackDurations;
+
+  /**
+   * @param maxFrames - maximum number of frames captured per call.
+   * @param maxStacks - maximum number of distinct stacks; the durations of
+   * calls from other stacks are recorded without a stack.
+   * @param ignorePath - calls whose stack contains a frame with a file name
+   * containing ignorePath, such as those of the agent itself, are not
+   * recorded.
+   */
+  constructor(
+    readonly maxFrames: number,
+    readonly maxStacks: number,
+    readonly ignorePath: string
+  ) {
+    this.durations = new StackDurations('call', maxStacks);
+  }
+
+  /**
+   * Starts recording calls to synchronous functions.
+   *
+   * @throws error when another BlockingCallProfiler is recording.
+   */
+  start() {
+    if (activeProfiler === this) {
+      return;
+    }
+    if (activeProfiler) {
+      throw new Error('A blocking call profile is already being collected.');
+    }
+    activeProfiler = this;
+    this.durations.reset();
+    for (const [moduleName, mod] of MODULES) {
+      for (const name of Object.keys(mod)) {
+        const original = mod[name];
+        if (typeof original !== 'function' || !name.endsWith('Sync')) {
+          continue;
+        }
+        this.originals.push([mod, name, original]);
+        mod[name] = this.wrap(`${moduleName}.${name}`, original);
+      }
+    }
+  }
+
+  /**
+   * Stops recording, and restores the original synchronous functions.
+   *
+   * @return profile of the calls recorded, with sample types
+   * blocking_calls/count and blocking/nanoseconds, and a "call" label
+   * holding the name of the function called, such as "fs.readFileSync".
+   */
+  stop(): perftools.profiles.IProfile {
+    if (activeProfiler === this) {
+      for (const [mod, name, original] of this.originals) {
+        mod[name] = original;
+      }
+      this.originals = [];
+      activeProfiler = undefined;
+    }
+    return this.durations.profile('blocking_calls', 'blocking');
+  }
+
+  // eslint-disable-next-line @typescript-eslint/ban-types
+  private wrap(call: string, original: Function): Function {
+    const durations = this.durations;
+    const maxFrames = this.maxFrames;
+    const ignorePath = this.ignorePath;
+    const wrapper = function (this: unknown, ...args: unknown[]) {
+      if (callDepth > 0) {
+        return original.apply(this, args);
+      }
+      callDepth++;
+      const start = nowNanos();
+      try {
+        return original.apply(this, args);
+      } finally {
+        callDepth--;
+        const nanos = nowNanos() - start;
+        const frames = captureStack(maxFrames, wrapper);
+        if (
+          !ignorePath ||
+          !frames.some(f => f.filename.indexOf(ignorePath) >= 0)
+        ) {
+          durations.add(call, frames, nanos);
+        }
+      }
+    };
+    // Keep properties such as fs.realpathSync.native.
+    Object.assign(wrapper, original);
+    Object.defineProperty(wrapper, 'name', {value: original.name});
+    return wrapper;
+  }
+}
@@ -0,0 +1,312 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {EventEmitter} from 'events';
+import parseDuration from 'parse-duration';
+import {promisify} from 'util';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {loadMeter} from './governor';
+import {decodeProfile, ProfileMerger} from './merge';
+import {Profiler, RequestProfile} from './profiler';
+
+// Types of the IPC messages exchanged by the primary and its workers.
+const COLLECT_MESSAGE = 'cloud-profiler:collect';
+const RESULT_MESSAGE = 'cloud-profiler:result';
+const LOAD_MESSAGE = 'cloud-profiler:load';
+
+const gzip = promisify(zlib.gzip);
+
+// Interval at which workers report their CPU utilization to the primary.
+const LOAD_REPORT_INTERVAL_MILLIS = 10 * 1000;
+
+/**
+ * Ways in which the primary chooses the worker which collects a profile.
+ */
+export enum WorkerSelection {
+  // Workers take turns.
+  Rotation = 'rotation',
+  // The worker which most recently reported the highest CPU utilization.
+  Cpu = 'cpu',
+}
+
+/**
+ * The parts of a cluster worker, as seen from the primary, used by a
+ * ClusterCoordinator.
+ */
+export interface ClusterWorker {
+  id: number;
+  send(message: object): boolean;
+  isConnected(): boolean;
+}
+
+/**
+ * The parts of the cluster module, in the primary, used by a
+ * ClusterCoordinator.
+ */
+export interface ClusterPrimary {
+  workers?: {[id: string]: ClusterWorker | undefined};
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  on(event: string, listener: (...args: any[]) => void): unknown;
+}
+
+/**
+ * The parts of a worker process used by attachWorker().
+ */
+export interface WorkerProcess extends EventEmitter {
+  // False once the channel to the primary is closed, after which send() must
+  // not be called.
+  connected?: boolean;
+  send?(message: object): boolean;
+}
+
+interface PendingCollection {
+  workerId: number;
+  resolve: (prof: RequestProfile) => void;
+  reject: (err: Error) => void;
+  timer: NodeJS.Timeout;
+}
+
+/**
+ * @return instance label of the worker with ID workerId, derived from the
+ * instance label of the host.
+ */
+export function workerInstance(
+  instance: string | undefined,
+  workerId: number
+): string {
+  return instance ? `${instance}-worker-${workerId}` : `worker-${workerId}`;
+}
+
+/**
+ * Runs in the primary process of a cluster and delegates the collection of
+ * each profile requested by the profiler server to one worker over IPC, so
+ * that only the primary polls the profiler server.
+ */
+export class ClusterCoordinator {
+  private nextRequestId = 1;
+  private rotation = 0;
+  private pending = new Map<number, PendingCollection>();
+  private cpuUtilization = new Map<number, number>();
+
+  /**
+   * @param timeoutMillis - time, in addition to the duration of the
+   * profile, to wait for a worker to return a profile.
+   */
+  constructor(
+    readonly selection: WorkerSelection,
+    readonly timeoutMillis: number,
+    private cluster: ClusterPrimary
+  ) {
+    cluster.on('message', (worker: ClusterWorker, message) =>
+      this.onMessage(worker, message)
+    );
+    cluster.on('exit', (worker: ClusterWorker) => this.onExit(worker));
+  }
+
+  /**
+   * @return the worker which should collect the next profile, or undefined
+   * if there are no connected workers.
+   */
+  selectWorker(): ClusterWorker | undefined {
+    const workers = this.connectedWorkers();
+    if (workers.length === 0) {
+      return undefined;
+    }
+    const next = workers[this.rotation++ % workers.length];
+    if (this.selection !== WorkerSelection.Cpu) {
+      return next;
+    }
+    let busiest = next;
+    for (const w of workers) {
+      const cpu = this.cpuUtilization.get(w.id) || 0;
+      if (cpu > (this.cpuUtilization.get(busiest.id) || 0)) {
+        busiest = w;
+      }
+    }
+    return busiest;
+  }
+
+  private connectedWorkers(): ClusterWorker[] {
+    return Object.values(this.cluster.workers || {})
+      .filter((w): w is ClusterWorker => !!w && w.isConnected())
+      .sort((a, b) => a.id - b.id);
+  }
+
+  /**
+   * Asks a worker to collect the profile specified by prof.
+   *
+   * @return prof with its profileBytes and labels set by the worker.
+   * @throws error when there is no worker, or the worker fails to collect
+   * the profile or does not return it in time.
+   */
+  collect(prof: RequestProfile): Promise<RequestProfile> {
+    const worker = this.selectWorker();
+    if (!worker) {
+      return Promise.reject(
+        new Error('No cluster worker is available to collect profile.')
+      );
+    }
+    return this.collectFrom(worker, prof);
+  }
+
+  /**
+   * Asks every worker to collect the profile specified by prof, and merges
+   * the profiles they return into one profile. Workers which fail to
+   * collect the profile are left out of the merged profile.
+   *
+   * Each profile is merged as soon as it is returned, and the merged profile
+   * has at most maxSamples distinct samples, so that the memory used does
+   * not grow with the number of workers.
+   *
+   * @param labels - labels of the merged profile.
+   * @param maxSamples - maximum number of distinct samples of the merged
+   * profile, or 0 when it is not bounded.
+   * @return prof with its profileBytes set to the merged profile and its
+   * labels set to labels.
+   * @throws error when there is no worker, or no worker returns a profile.
+   */
+  async collectMerged(
+    prof: RequestProfile,
+    labels: {instance?: string},
+    maxSamples = 0
+  ): Promise<RequestProfile> {
+    const workers = this.connectedWorkers();
+    if (workers.length === 0) {
+      throw new Error('No cluster worker is available to collect profile.');
+    }
+    const merger = new ProfileMerger(maxSamples);
+    let lastError: Error | undefined;
+    await Promise.all(
+      workers.map(async w => {
+        try {
+          const r = await this.collectFrom(w, prof);
+          merger.add(decodeProfile(Buffer.from(r.profileBytes!, 'base64')));
+        } catch (err) {
+          lastError = err;
+        }
+      })
+    );
+    if (merger.merged() === 0) {
+      throw lastError;
+    }
+    const buffer = perftools.profiles.Profile.encode(merger.profile()).finish();
+    const profileBytes = ((await gzip(buffer)) as Buffer).toString('base64');
+    return Object.assign({}, prof, {profileBytes, labels});
+  }
+
+  private collectFrom(
+    worker: ClusterWorker,
+    prof: RequestProfile
+  ): Promise<RequestProfile> {
+    const id = this.nextRequestId++;
+    const durationMillis = prof.duration ? parseDuration(prof.duration) : 0;
+    const timeoutMillis = (durationMillis || 0) + this.timeoutMillis;
+    return new Promise<RequestProfile>((resolve, reject) => {
+      const timer = setTimeout(() => {
+        this.pending.delete(id);
+        reject(
+          new Error(
+            `Cluster worker ${worker.id} did not return profile within ` +
+              `${timeoutMillis}ms.`
+          )
+        );
+      }, timeoutMillis);
+      this.pending.set(id, {workerId: worker.id, resolve, reject, timer});
+      worker.send({type: COLLECT_MESSAGE, id, prof});
+    });
+  }
+
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  private onMessage(worker: ClusterWorker, message: any) {
+    if (!message) {
+      return;
+    }
+    if (message.type === LOAD_MESSAGE) {
+      this.cpuUtilization.set(worker.id, Number(message.cpuUtilization) || 0);
+      return;
+    }
+    if (message.type !== RESULT_MESSAGE) {
+      return;
+    }
+    const pending = this.pending.get(message.id);
+    if (!pending) {
+      return;
+    }
+    this.pending.delete(message.id);
+    clearTimeout(pending.timer);
+    if (message.error) {
+      pending.reject(new Error(message.error));
+    } else {
+      pending.resolve(message.prof);
+    }
+  }
+
+  private onExit(worker: ClusterWorker) {
+    this.cpuUtilization.delete(worker.id);
+    for (const [id, pending] of this.pending) {
+      if (pending.workerId === worker.id) {
+        this.pending.delete(id);
+        clearTimeout(pending.timer);
+        pending.reject(
+          new Error(`Cluster worker ${worker.id} exited before profiling.`)
+        );
+      }
+    }
+  }
+}
+
+/**
+ * Runs in a worker process of a cluster: collects the profiles requested by
+ * the primary with profiler, labels them with the instance label of this
+ * worker, and periodically reports the CPU utilization of this worker to the
+ * primary.
+ */
+export function attachWorker(
+  profiler: Pick<Profiler, 'config' | 'profile'>,
+  workerId: number,
+  proc: WorkerProcess = process
+) {
+  const instance = workerInstance(profiler.config.instance, workerId);
+  // Sending once the channel is closed, such as while the worker shuts down
+  // after disconnect(), would emit an error which would crash the worker.
+  const send = (message: object) => {
+    if (proc.connected && proc.send) {
+      proc.send(message);
+    }
+  };
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  proc.on('message', async (message: any) => {
+    if (!message || message.type !== COLLECT_MESSAGE) {
+      return;
+    }
+    let reply: object;
+    try {
+      const prof = await profiler.profile(message.prof);
+      prof.labels = {instance};
+      reply = {type: RESULT_MESSAGE, id: message.id, prof};
+    } catch (err) {
+      reply = {type: RESULT_MESSAGE, id: message.id, error: `${err}`};
+    }
+    send(reply);
+  });
+
+  const measure = loadMeter();
+  const timer = setInterval(() => {
+    send({type: LOAD_MESSAGE, cpuUtilization: measure().cpuUtilization});
+  }, LOAD_REPORT_INTERVAL_MILLIS);
+  timer.unref();
+  proc.on('disconnect', () => clearInterval(timer));
+}
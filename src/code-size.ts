@@ -0,0 +1,335 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {SourceMapper} from 'pprof';
+import * as v8 from 'v8';
+
+import {perftools} from '../protos/profile';
+import {ProfileBuilder} from './profile-builder';
+import {Frame, stackKey} from './profile-utils';
+
+/**
+ * The parts of a V8 heap snapshot read by codeSizes().
+ */
+export interface HeapSnapshot {
+  snapshot: {
+    meta: {
+      node_fields: string[];
+      // The first element lists the names of the node types.
+      node_types: unknown[];
+      edge_fields: string[];
+      // The first element lists the names of the edge types.
+      edge_types: unknown[];
+      location_fields?: string[];
+    };
+  };
+  nodes: number[];
+  edges: number[];
+  locations?: number[];
+  strings: string[];
+}
+
+/**
+ * Sizes, in bytes, of the code of one function.
+ */
+export interface FunctionCodeSize {
+  name: string;
+  filename: string;
+  // Zero-based line and column of the start of the function.
+  line: number;
+  column: number;
+  bytecodeBytes: number;
+  baselineBytes: number;
+  optimizedBytes: number;
+}
+
+// Memory used to take and parse a heap snapshot, in multiples of the bytes
+// used by the V8 heap, as measured with Node.js 20: V8 builds the snapshot
+// outside of the heap, and its JSON text and the parsed snapshot are then
+// held in the heap.
+const SNAPSHOT_BYTES_PER_HEAP_BYTE = 20;
+const SNAPSHOT_HEAP_BYTES_PER_HEAP_BYTE = 5;
+
+/**
+ * Estimate of the memory needed to take and parse a heap snapshot.
+ */
+export interface SnapshotMemory {
+  // Memory used by the process as a whole, including the V8 heap.
+  bytes: number;
+  // Memory used within the V8 heap.
+  heapBytes: number;
+  // Bytes which can still be allocated within the V8 heap.
+  availableHeapBytes: number;
+}
+
+/**
+ * @return estimate of the memory needed by takeHeapSnapshot(), which grows
+ * with the bytes used by the V8 heap, as described by stats.
+ */
+export function estimateSnapshotMemory(
+  stats: {
+    used_heap_size: number;
+    heap_size_limit: number;
+  } = v8.getHeapStatistics()
+): SnapshotMemory {
+  const used = stats.used_heap_size;
+  return {
+    bytes: used * SNAPSHOT_BYTES_PER_HEAP_BYTE,
+    heapBytes: used * SNAPSHOT_HEAP_BYTES_PER_HEAP_BYTE,
+    availableHeapBytes: stats.heap_size_limit - used,
+  };
+}
+
+/**
+ * @return a heap snapshot of this process.
+ * @throws error when heap snapshots are not supported, before Node 11.13.
+ */
+export async function takeHeapSnapshot(): Promise<HeapSnapshot> {
+  if (typeof v8.getHeapSnapshot !== 'function') {
+    throw new Error('Heap snapshots are not supported by this Node.js.');
+  }
+  const chunks: Buffer[] = [];
+  for await (const chunk of v8.getHeapSnapshot()) {
+    chunks.push(Buffer.from(chunk));
+  }
+  return JSON.parse(Buffer.concat(chunks).toString('utf8'));
+}
+
+/**
+ * @return the sizes of the bytecode, baseline code and optimized code of
+ * each function of snapshot which has any, found through the shared
+ * function info of each closure. Each code object is counted once, and
+ * builtins are not counted.
+ *
+ * Code objects are unnamed in snapshots of recent versions of V8, so their
+ * tier is found from the fields V8 reports as their edges: optimized code
+ * has deoptimization data, and baseline code has a bytecode offset table.
+ * The size of a code object includes the code objects it references, such
+ * as its instructions, relocation information and deoptimization data.
+ */
+export function codeSizes(snapshot: HeapSnapshot): FunctionCodeSize[] {
+  const meta = snapshot.snapshot.meta;
+  const {nodes, edges, strings} = snapshot;
+  const nodeFields = meta.node_fields.length;
+  const nodeTypes = meta.node_types[0] as string[];
+  const typeField = meta.node_fields.indexOf('type');
+  const nameField = meta.node_fields.indexOf('name');
+  const sizeField = meta.node_fields.indexOf('self_size');
+  const edgeCountField = meta.node_fields.indexOf('edge_count');
+  const edgeFields = meta.edge_fields.length;
+  const edgeTypes = meta.edge_types[0] as string[];
+  const edgeTypeField = meta.edge_fields.indexOf('type');
+  const edgeNameField = meta.edge_fields.indexOf('name_or_index');
+  const toNodeField = meta.edge_fields.indexOf('to_node');
+
+  // Offset in edges of the first edge of each node, by node offset.
+  const firstEdges = new Map<number, number>();
+  for (let n = 0, e = 0; n < nodes.length; n += nodeFields) {
+    firstEdges.set(n, e);
+    e += nodes[n + edgeCountField] * edgeFields;
+  }
+  const nodeType = (n: number) => nodeTypes[nodes[n + typeField]];
+  const nodeName = (n: number) => strings[nodes[n + nameField]] || '';
+  // Calls f with the type, name (or index for elements and hidden edges)
+  // and target node of each edge of node n.
+  const forEachEdge = (
+    n: number,
+    f: (type: string, name: string | number, to: number) => void
+  ) => {
+    const first = firstEdges.get(n)!;
+    const end = first + nodes[n + edgeCountField] * edgeFields;
+    for (let e = first; e < end; e += edgeFields) {
+      const type = edgeTypes[edges[e + edgeTypeField]];
+      const name =
+        type === 'element' || type === 'hidden'
+          ? edges[e + edgeNameField]
+          : strings[edges[e + edgeNameField]];
+      f(type, name, edges[e + toNodeField]);
+    }
+  };
+  // Nodes referenced by the edges of node n which are not elements, by name.
+  const namedEdges = (n: number) => {
+    const named = new Map<string, number>();
+    forEachEdge(n, (type, name, to) => {
+      if (typeof name === 'string') {
+        named.set(name, to);
+      }
+    });
+    return named;
+  };
+  const isScript = (n: number) =>
+    nodeType(n) === 'code' && namedEdges(n).has('source');
+  const codeTier = (
+    code: number
+  ): 'bytecode' | 'baseline' | 'optimized' | '' => {
+    if (nodeType(code) !== 'code') {
+      return '';
+    }
+    if (nodeName(code).indexOf('BytecodeArray') >= 0) {
+      return 'bytecode';
+    }
+    const named = namedEdges(code);
+    if (named.has('deoptimization_data')) {
+      return 'optimized';
+    }
+    if (named.has('bytecode_offset_table')) {
+      return 'baseline';
+    }
+    return '';
+  };
+
+  const locations = new Map<number, {line: number; column: number}>();
+  const locationFields = meta.location_fields || [];
+  const objectField = locationFields.indexOf('object_index');
+  const lineField = locationFields.indexOf('line');
+  const columnField = locationFields.indexOf('column');
+  const allLocations = snapshot.locations || [];
+  for (let l = 0; l < allLocations.length; l += locationFields.length) {
+    locations.set(allLocations[l + objectField], {
+      line: allLocations[l + lineField],
+      column: allLocations[l + columnField],
+    });
+  }
+
+  const countedCode = new Set<number>();
+  const functions = new Map<number, FunctionCodeSize>();
+  const addCode = (f: FunctionCodeSize, code: number | undefined) => {
+    if (code === undefined || countedCode.has(code)) {
+      return;
+    }
+    const tier = codeTier(code);
+    if (!tier) {
+      return;
+    }
+    countedCode.add(code);
+    let size = nodes[code + sizeField];
+    let bytecode: number | undefined;
+    forEachEdge(code, (type, name, to) => {
+      if (name === 'interpreter_data') {
+        // The bytecode from which baseline code was compiled.
+        bytecode = to;
+      } else if (nodeType(to) === 'code' && !countedCode.has(to)) {
+        countedCode.add(to);
+        size += nodes[to + sizeField];
+      }
+    });
+    if (tier === 'bytecode') {
+      f.bytecodeBytes += size;
+    } else if (tier === 'baseline') {
+      f.baselineBytes += size;
+    } else {
+      f.optimizedBytes += size;
+    }
+    addCode(f, bytecode);
+  };
+
+  for (let n = 0; n < nodes.length; n += nodeFields) {
+    if (nodeType(n) !== 'closure') {
+      continue;
+    }
+    const closureEdges = namedEdges(n);
+    const shared = closureEdges.get('shared');
+    if (shared === undefined) {
+      continue;
+    }
+    let f = functions.get(shared);
+    if (!f) {
+      const sharedEdges = namedEdges(shared);
+      let script = sharedEdges.get('script_or_debug_info');
+      if (script === undefined) {
+        // Name of the edge in older versions of V8.
+        script = sharedEdges.get('script');
+      }
+      if (script !== undefined && !isScript(script)) {
+        // Debug info, created while debugging or collecting coverage, which
+        // references the script.
+        const debugInfo = script;
+        script = undefined;
+        forEachEdge(debugInfo, (type, name, to) => {
+          if (script === undefined && isScript(to)) {
+            script = to;
+          }
+        });
+      }
+      const scriptName =
+        script === undefined ? undefined : namedEdges(script).get('name');
+      const location = locations.get(n) || {line: 0, column: 0};
+      f = {
+        name: nodeName(n) || '(anonymous)',
+        filename: scriptName === undefined ? '' : nodeName(scriptName),
+        line: location.line,
+        column: location.column,
+        bytecodeBytes: 0,
+        baselineBytes: 0,
+        optimizedBytes: 0,
+      };
+      functions.set(shared, f);
+      addCode(f, sharedEdges.get('function_data'));
+    }
+    addCode(f, closureEdges.get('code'));
+  }
+  return [...functions.values()].filter(
+    f => f.bytecodeBytes + f.baselineBytes + f.optimizedBytes > 0
+  );
+}
+
+/**
+ * @return profile with sample types bytecode/bytes, baseline/bytes,
+ * optimized/bytes and code/bytes, their sum, holding the code size of each
+ * function of sizes. Locations are mapped through sourceMapper when it has
+ * a source map for the file of a function.
+ */
+export function codeSizeProfile(
+  sizes: FunctionCodeSize[],
+  sourceMapper?: SourceMapper
+): perftools.profiles.IProfile {
+  const byFrame = new Map<string, {frame: Frame; values: number[]}>();
+  for (const s of sizes) {
+    let frame: Frame = {name: s.name, filename: s.filename, line: s.line + 1};
+    if (sourceMapper && s.filename && sourceMapper.hasMappingInfo(s.filename)) {
+      const mapped = sourceMapper.mappingInfo({
+        file: s.filename,
+        name: s.name,
+        line: s.line + 1,
+        column: s.column + 1,
+      });
+      frame = {
+        name: mapped.name || s.name,
+        filename: mapped.file || s.filename,
+        line: mapped.line || s.line + 1,
+      };
+    }
+    const values = [s.bytecodeBytes, s.baselineBytes, s.optimizedBytes];
+    const key = stackKey([frame]);
+    const existing = byFrame.get(key);
+    if (existing) {
+      values.forEach((v, i) => (existing.values[i] += v));
+    } else {
+      byFrame.set(key, {frame, values});
+    }
+  }
+
+  const builder = ProfileBuilder.create([
+    {type: 'bytecode', unit: 'bytes'},
+    {type: 'baseline', unit: 'bytes'},
+    {type: 'optimized', unit: 'bytes'},
+    {type: 'code', unit: 'bytes'},
+  ]);
+  for (const {frame, values} of byFrame.values()) {
+    builder.addSample([frame], [...values, values[0] + values[1] + values[2]]);
+  }
+  const p = builder.profile;
+  p.timeNanos = Date.now() * 1e6;
+  return p;
+}
@@ -15,6 +15,8 @@
 import {GoogleAuthOptions} from '@google-cloud/common';
 import parseDuration from 'parse-duration';
 
+import {ProfileExporter} from './exporters';
+
 // Configuration for Profiler.
 export interface Config extends GoogleAuthOptions {
   /**
@@ -85,6 +87,312 @@ export interface Config extends GoogleAuthOptions {
   // the profiler.
   ignoreHeapSamplesPath?: string;
 
+  // Frames of locations containing this as a substring in their file name
+  // are removed from time profiles. Samples in which such a frame is closer
+  // to the leaf than any frame of user code are removed entirely, and their
+  // values are reported as agent overhead in a comment on the profile.
+  // By default this is set to "@google-cloud/profiler" to exclude samples from
+  // the profiler.
+  ignoreTimeSamplesPath?: string;
+
+  // When the fraction of time the event loop was busy
+  // (performance.eventLoopUtilization()) exceeds this value, the encoding and
+  // upload of a profile is deferred and time profiles are collected with a
+  // reduced sampling rate. When 0, event loop utilization is not considered.
+  // Requires Node 14.10 or later.
+  governorMaxEventLoopUtilization?: number;
+
+  // When CPU time used by the process divided by elapsed time exceeds this
+  // value, the encoding and upload of a profile is deferred and time profiles
+  // are collected with a reduced sampling rate. When 0, CPU utilization is not
+  // considered.
+  governorMaxCpuUtilization?: number;
+
+  // Maximum time that encoding and upload of a profile will be deferred while
+  // the process is overloaded. This should be well below the time for which
+  // the server accepts a profile after asking for it.
+  governorMaxDeferMillis?: number;
+
+  // While the encoding and upload of a profile is deferred, load will be
+  // checked again every governorCheckIntervalMillis milliseconds.
+  governorCheckIntervalMillis?: number;
+
+  // When a time profile is started while the process is overloaded,
+  // timeIntervalMicros is multiplied by this factor for that profile.
+  governorTimeIntervalMultiplier?: number;
+
+  // Regular expression matched against function names, with the semantics of
+  // the drop_frames field of the pprof Profile message: frames whose function
+  // name fully matches are removed from stacks along with all frames they
+  // call, so their samples are attributed to the caller. The expression is
+  // also recorded in the profile. When empty, no frames are removed.
+  dropFrames?: string;
+
+  // Regular expression matched against function names, with the semantics of
+  // the keep_frames field of the pprof Profile message: frames whose function
+  // name fully matches are not removed, even if they match dropFrames.
+  keepFrames?: string;
+
+  // When greater than 0, consecutive repetitions of a cycle of at most this
+  // many frames (as produced by recursion) are collapsed into a single
+  // occurrence of the cycle in each stack, and the sample is labeled with the
+  // number of repetitions removed ("recursion_depth").
+  foldRecursionMaxCycleLength?: number;
+
+  // When greater than 0, only the pruneMaxStacks stacks with the largest
+  // values are kept in each profile. The values of each other stack are
+  // folded into a "(pruned)" frame under its deepest caller which is also a
+  // caller in a kept stack, or at the root, so that each profile has at most
+  // 2 * pruneMaxStacks + 1 stacks.
+  pruneMaxStacks?: number;
+
+  // When greater than 0, only the stacks with the largest values which
+  // together cover this fraction (between 0 and 1) of the total value of a
+  // profile are kept. Other stacks are folded as with pruneMaxStacks.
+  pruneValueFraction?: number;
+
+  // Maximum estimated memory, in bytes, used to hold and encode a single
+  // profile. Profiles which exceed this budget keep only their largest
+  // samples; the values of the remaining samples are aggregated into a
+  // single "(over memory budget)" sample. Heap profiles are fitted to the
+  // budget before they are built, and code size profiles are not collected
+  // when the heap snapshot they need is estimated to exceed the budget. When
+  // 0, profiles are not pruned.
+  profileMemoryBudgetBytes?: number;
+
+  // When the memory limit of the cgroup of this process minus its current
+  // usage, read from /sys/fs/cgroup, is less than this many bytes, profiles
+  // are not collected. Code size profiles are not collected either when the
+  // memory needed by their heap snapshot would leave less than this many
+  // bytes. When 0, memory headroom is not checked.
+  minMemoryHeadroomBytes?: number;
+
+  // When true, heap profiles include an additional "space_delta" sample type
+  // holding the change in live bytes at each stack since the previous heap
+  // profile collected by this process.
+  heapDelta?: boolean;
+
+  // When heapDelta is true, at most this many stacks of the previous heap
+  // profile, those with the most live bytes, are retained for computing
+  // deltas.
+  heapDeltaMaxStacks?: number;
+
+  // When true, the live bytes at each allocation site are tracked across
+  // heap profiles, and sites whose live bytes grow monotonically are
+  // reported as possible leaks.
+  leakDetection?: boolean;
+
+  // When leakDetection is true, at most this many allocation sites, those
+  // with the most live bytes, are tracked.
+  leakDetectionMaxSites?: number;
+
+  // When leakDetection is true, at most this many heap profiles are retained
+  // for each allocation site.
+  leakDetectionMaxPoints?: number;
+
+  // When leakDetection is true, an allocation site is only reported once its
+  // live bytes have grown over at least this many heap profiles.
+  leakDetectionMinPoints?: number;
+
+  // When set, V8 heap usage is checked periodically, and once it exceeds
+  // heapLimitThreshold of the heap size limit a heap profile is captured
+  // synchronously and written to this directory. Profiles in this directory
+  // are uploaded the next time the agent starts, by the process which polls
+  // the profiler server: the cluster primary rather than its workers, and
+  // the daemon, started with the same heapLimitProfileDir, rather than its
+  // clients. When empty, heap usage is not checked.
+  heapLimitProfileDir?: string;
+
+  // Fraction of the V8 heap size limit above which a heap profile is
+  // written to heapLimitProfileDir.
+  heapLimitThreshold?: number;
+
+  // Interval at which V8 heap usage is checked when heapLimitProfileDir is
+  // set.
+  heapLimitCheckIntervalMillis?: number;
+
+  // When greater than 0, a flight recorder collects a wall profile and a
+  // heap profile at this interval, independently of the profiles requested
+  // by the profiler server, and keeps the most recent profiles in memory so
+  // they can be written to disk on demand. Profiles requested by the server
+  // are also kept. When 0, the flight recorder is disabled.
+  flightRecorderPeriodMillis?: number;
+
+  // Duration of the wall profiles collected by the flight recorder.
+  flightRecorderTimeDurationMillis?: number;
+
+  // The flight recorder keeps at most this many profiles.
+  flightRecorderMaxProfiles?: number;
+
+  // The flight recorder keeps profiles with a total compressed size of at
+  // most this many bytes.
+  flightRecorderMaxBytes?: number;
+
+  // Directory to which the flight recorder writes its profiles. Defaults to
+  // the operating system's temporary directory.
+  flightRecorderDumpDir?: string;
+
+  // Signal on which the flight recorder writes its profiles to
+  // flightRecorderDumpDir. When empty, profiles are only written when
+  // requested through dumpFlightRecorder().
+  flightRecorderDumpSignal?: string;
+
+  // When greater than 0, a wall profile is captured immediately once the
+  // 99th percentile of event loop delay over triggerCheckIntervalMillis
+  // exceeds this many ms.
+  triggerEventLoopDelayMillis?: number;
+
+  // When greater than 0, a wall profile is captured immediately once the
+  // CPU time used by the process divided by elapsed time, over
+  // triggerCheckIntervalMillis, exceeds this value.
+  triggerCpuUtilization?: number;
+
+  // When greater than 0, a heap profile is captured immediately once the
+  // resident set size of the process grows faster than this many bytes per
+  // second over triggerCheckIntervalMillis.
+  triggerRssGrowthBytesPerSecond?: number;
+
+  // Interval at which trigger thresholds are checked.
+  triggerCheckIntervalMillis?: number;
+
+  // At most one profile is captured by triggers within this interval.
+  triggerMinIntervalMillis?: number;
+
+  // Duration of the wall profiles captured by triggers.
+  triggerTimeDurationMillis?: number;
+
+  // When set, profiles captured by triggers are written to this directory
+  // rather than uploaded.
+  triggerProfileDir?: string;
+
+  // When true and this process is part of a cluster created with the
+  // cluster module, only the primary process polls the profiler server. It
+  // asks one worker at a time, over IPC, to collect each profile. Workers
+  // label their profiles with their own instance label.
+  clusterMode?: boolean;
+
+  // How the primary chooses the worker which collects a profile: "rotation"
+  // to let workers take turns, or "cpu" to choose the worker with the
+  // highest recent CPU utilization.
+  clusterWorkerSelection?: string;
+
+  // Time, in addition to the duration of a profile, for which the primary
+  // waits for a worker to return the profile.
+  clusterWorkerTimeoutMillis?: number;
+
+  // When true and clusterMode is true, the primary asks every worker to
+  // collect each profile and uploads a single profile merging the profiles
+  // of all workers, labeled with the instance label of the host.
+  clusterMergeProfiles?: boolean;
+
+  // Maximum number of distinct samples of a profile merged by the primary
+  // when clusterMergeProfiles is true, which bounds the memory used to merge
+  // the profiles of many workers. The values of other samples are added to
+  // a single "(merge overflow)" sample. When 0, it is not bounded.
+  clusterMergeMaxSamples?: number;
+
+  // When set, start() connects to the profiler daemon listening on the Unix
+  // domain socket at this path, and collects the profiles it requests,
+  // rather than polling the profiler server itself. startDaemon() listens
+  // on this path.
+  daemonSocketPath?: string;
+
+  // File mode of the socket created by startDaemon(). Any process which can
+  // connect to the socket can have the daemon upload profiles under its
+  // credentials, so by default only the user running the daemon can.
+  daemonSocketMode?: number;
+
+  // When set, each profile collected is also written to a new file in this
+  // directory.
+  exportProfileDir?: string;
+
+  // When set, each profile collected is also sent to the OpenTelemetry
+  // collector at this URL, such as "http://localhost:4318", with the OTLP
+  // profiles signal. otlpHeaders are added to each request.
+  otlpProfilesEndpoint?: string;
+  otlpHeaders?: {[name: string]: string};
+
+  // When set, each profile collected is also sent to the ingest API of the
+  // Pyroscope server at this URL, such as "http://localhost:4040".
+  // pyroscopeAuthToken, when set, is sent as a bearer token.
+  pyroscopeServerAddress?: string;
+  pyroscopeAuthToken?: string;
+
+  // Additional exporters to which each profile collected is sent. Profiles
+  // are encoded once, and sent to all exporters concurrently.
+  exporters?: ProfileExporter[];
+
+  // Limits of I/O wait profiles, which are collected by requesting a profile
+  // of type "IO_WAIT" from Profiler.profile(): the maximum number of frames
+  // captured when an I/O operation starts, the maximum number of operations
+  // tracked at once, and the maximum number of distinct stacks.
+  ioWaitMaxFrames?: number;
+  ioWaitMaxPending?: number;
+  ioWaitMaxStacks?: number;
+
+  // Limits of blocking call profiles, which are collected by requesting a
+  // profile of type "BLOCKING" from Profiler.profile(): the maximum number of
+  // frames captured per call of a synchronous fs, child_process or zlib
+  // function, and the maximum number of distinct stacks.
+  blockingMaxFrames?: number;
+  blockingMaxStacks?: number;
+
+  // Sampling of promise profiles, which are collected by requesting a profile
+  // of type "PROMISE" from Profiler.profile(): one in every
+  // promiseSamplingInterval promises created is recorded, with at most
+  // promiseMaxFrames frames per stack. promiseMaxPending limits the recorded
+  // promises tracked at once, and promiseMaxStacks the number of distinct
+  // stacks.
+  promiseSamplingInterval?: number;
+  promiseMaxFrames?: number;
+  promiseMaxPending?: number;
+  promiseMaxStacks?: number;
+
+  // When true, the callbacks run by the event loop while each time profile
+  // is collected are timed, and attributed to the phase of the loop which
+  // ran them: timers, poll, check (setImmediate()) or microtasks. The time
+  // spent in each phase is added as a comment on the time profile.
+  timeLoopPhases?: boolean;
+
+  // When true, and the CPU time of the main thread can be read from
+  // /proc/thread-self/schedstat, the CPU time consumed by the main thread
+  // while each time profile was collected is added to the profile as a
+  // comment. Time profiles have no CPU sample type: stacks are sampled by
+  // the native time profiler, which cannot read the CPU clock of the thread
+  // at each sample, so CPU time cannot be attributed to stacks.
+  timeThreadCpu?: boolean;
+
+  // Maximum number of mapped files listed separately in memory profiles,
+  // which are collected by requesting a profile of type "MEMORY" from
+  // Profiler.profile(). Other files are listed as "(other files)". Memory
+  // profiles are not accepted by the profiler server, so they are only
+  // passed to exporters, the flight recorder and startLocal().
+  memoryMapMaxFiles?: number;
+
+  // When true, each sample of heap profiles is labeled with the type of the
+  // objects allocated, inferred from the function which allocated them: its
+  // name when it is a constructor, or Buffer for Node.js buffer functions.
+  // Samples allocated by other functions are not labeled. The live bytes of
+  // each type in the last heap profile are returned by
+  // Profiler.heapTypeTotals().
+  //
+  // The inference is coarse. Heap profiles do not report the built-in
+  // constructors, such as Map or Array, which allocate most objects, so
+  // most samples are not labeled. A constructor's label also covers the
+  // objects it allocates for its fields, such as the Map created by
+  // "this.items = new Map()".
+  heapTypeLabels?: boolean;
+
+  // When true, IDs of strings, functions and locations are kept stable
+  // across the profiles collected by this process, and the encoded form of
+  // each is cached so that only entries which are new since earlier profiles
+  // need to be encoded.
+  stableProfileIds?: boolean;
+
+  // When stableProfileIds is true, the cached strings, functions and
+  // locations are discarded once any of them has more than this many entries.
+  stableProfileIdsMaxEntries?: number;
+
   // On each consecutive error in profile creation, the backoff envelope will
   // increase by this factor. The backoff will be a random value selected
   // from a uniform distribution between 0 and the backoff envelope.
@@ -118,10 +426,21 @@ export interface Config extends GoogleAuthOptions {
   // For testing with startLocal() only.
   localLogPeriodMillis?: number;
 
+  // When set, profiles collected by startLocal() are written to this
+  // directory, which is created if it does not exist, rather than discarded.
+  // For testing with startLocal() only.
+  localProfileDir?: string;
+
   // Duration of time profiles collected when using startLocal().
   // For testing with startLocal() only.
   localTimeDurationMillis?: number;
 
+  // Types of profiles collected by startLocal() in addition to heap and wall
+  // profiles, such as "IO_WAIT" or "BLOCKING". Each is collected for
+  // localTimeDurationMillis.
+  // For testing with startLocal() only.
+  localAdditionalProfileTypes?: string[];
+
   // List of directories recursively searched for *.js.map files. Defaults to
   // process.cwd().
   //
@@ -158,13 +477,78 @@ export interface LocalConfig extends GoogleAuthOptions {
   heapIntervalBytes: number;
   heapMaxStackDepth: number;
   ignoreHeapSamplesPath: string;
+  ignoreTimeSamplesPath: string;
+  governorMaxEventLoopUtilization: number;
+  governorMaxCpuUtilization: number;
+  governorMaxDeferMillis: number;
+  governorCheckIntervalMillis: number;
+  governorTimeIntervalMultiplier: number;
+  dropFrames: string;
+  keepFrames: string;
+  foldRecursionMaxCycleLength: number;
+  pruneMaxStacks: number;
+  pruneValueFraction: number;
+  profileMemoryBudgetBytes: number;
+  minMemoryHeadroomBytes: number;
+  heapDelta: boolean;
+  heapDeltaMaxStacks: number;
+  leakDetection: boolean;
+  leakDetectionMaxSites: number;
+  leakDetectionMaxPoints: number;
+  leakDetectionMinPoints: number;
+  heapLimitProfileDir: string;
+  heapLimitThreshold: number;
+  heapLimitCheckIntervalMillis: number;
+  flightRecorderPeriodMillis: number;
+  flightRecorderTimeDurationMillis: number;
+  flightRecorderMaxProfiles: number;
+  flightRecorderMaxBytes: number;
+  flightRecorderDumpDir: string;
+  flightRecorderDumpSignal: string;
+  triggerEventLoopDelayMillis: number;
+  triggerCpuUtilization: number;
+  triggerRssGrowthBytesPerSecond: number;
+  triggerCheckIntervalMillis: number;
+  triggerMinIntervalMillis: number;
+  triggerTimeDurationMillis: number;
+  triggerProfileDir: string;
+  clusterMode: boolean;
+  clusterWorkerSelection: string;
+  clusterWorkerTimeoutMillis: number;
+  clusterMergeProfiles: boolean;
+  clusterMergeMaxSamples: number;
+  daemonSocketPath: string;
+  daemonSocketMode: number;
+  exportProfileDir: string;
+  otlpProfilesEndpoint: string;
+  otlpHeaders: {[name: string]: string};
+  pyroscopeServerAddress: string;
+  pyroscopeAuthToken: string;
+  exporters: ProfileExporter[];
+  ioWaitMaxFrames: number;
+  ioWaitMaxPending: number;
+  ioWaitMaxStacks: number;
+  blockingMaxFrames: number;
+  blockingMaxStacks: number;
+  promiseSamplingInterval: number;
+  promiseMaxFrames: number;
+  promiseMaxPending: number;
+  promiseMaxStacks: number;
+  timeLoopPhases: boolean;
+  timeThreadCpu: boolean;
+  memoryMapMaxFiles: number;
+  heapTypeLabels: boolean;
+  stableProfileIds: boolean;
+  stableProfileIdsMaxEntries: number;
   initialBackoffMillis: number;
   backoffCapMillis: number;
   backoffMultiplier: number;
   serverBackoffCapMillis: number;
   localProfilingPeriodMillis: number;
   localLogPeriodMillis: number;
+  localProfileDir: string;
   localTimeDurationMillis: number;
+  localAdditionalProfileTypes: string[];
   sourceMapSearchPath: string[];
   disableSourceMaps: boolean;
 }
@@ -174,6 +558,9 @@ export interface ProfilerConfig extends LocalConfig {
   projectId: string;
 }
 
+// Names of services accepted in serviceContext.service.
+export const serviceRegex = /^[a-z]([-a-z0-9_.]{0,253}[a-z0-9])?$/;
+
 // Default values for configuration for a profiler.
 export const defaultConfig = {
   logLevel: 2,
@@ -184,6 +571,69 @@ export const defaultConfig = {
   heapIntervalBytes: 512 * 1024,
   heapMaxStackDepth: 64,
   ignoreHeapSamplesPath: '@google-cloud/profiler',
+  ignoreTimeSamplesPath: '@google-cloud/profiler',
+  governorMaxEventLoopUtilization: 0,
+  governorMaxCpuUtilization: 0,
+  governorMaxDeferMillis: 10 * 1000,
+  governorCheckIntervalMillis: 500,
+  governorTimeIntervalMultiplier: 2,
+  dropFrames: '',
+  keepFrames: '',
+  foldRecursionMaxCycleLength: 0,
+  pruneMaxStacks: 0,
+  pruneValueFraction: 0,
+  profileMemoryBudgetBytes: 0,
+  minMemoryHeadroomBytes: 0,
+  heapDelta: false,
+  heapDeltaMaxStacks: 10 * 1000,
+  leakDetection: false,
+  leakDetectionMaxSites: 1000,
+  leakDetectionMaxPoints: 24,
+  leakDetectionMinPoints: 4,
+  heapLimitProfileDir: '',
+  heapLimitThreshold: 0.9,
+  heapLimitCheckIntervalMillis: 1000,
+  flightRecorderPeriodMillis: 0,
+  flightRecorderTimeDurationMillis: 10 * 1000,
+  flightRecorderMaxProfiles: 60,
+  flightRecorderMaxBytes: 16 * 1024 * 1024,
+  flightRecorderDumpDir: '',
+  flightRecorderDumpSignal: 'SIGUSR2',
+  triggerEventLoopDelayMillis: 0,
+  triggerCpuUtilization: 0,
+  triggerRssGrowthBytesPerSecond: 0,
+  triggerCheckIntervalMillis: 1000,
+  triggerMinIntervalMillis: 10 * 60 * 1000,
+  triggerTimeDurationMillis: 10 * 1000,
+  triggerProfileDir: '',
+  clusterMode: false,
+  clusterWorkerSelection: 'rotation',
+  clusterWorkerTimeoutMillis: 60 * 1000,
+  clusterMergeProfiles: false,
+  clusterMergeMaxSamples: 10000,
+  daemonSocketPath: '',
+  daemonSocketMode: 0o600,
+  exportProfileDir: '',
+  otlpProfilesEndpoint: '',
+  otlpHeaders: {},
+  pyroscopeServerAddress: '',
+  pyroscopeAuthToken: '',
+  exporters: [],
+  ioWaitMaxFrames: 64,
+  ioWaitMaxPending: 10 * 1000,
+  ioWaitMaxStacks: 5000,
+  blockingMaxFrames: 64,
+  blockingMaxStacks: 5000,
+  promiseSamplingInterval: 1000,
+  promiseMaxFrames: 32,
+  promiseMaxPending: 10 * 1000,
+  promiseMaxStacks: 5000,
+  timeLoopPhases: false,
+  timeThreadCpu: false,
+  memoryMapMaxFiles: 20,
+  heapTypeLabels: false,
+  stableProfileIds: false,
+  stableProfileIdsMaxEntries: 100 * 1000,
   initialBackoffMillis: 60 * 1000, // 1 minute
   backoffCapMillis: parseDuration('1h'),
   backoffMultiplier: 1.3,
@@ -196,7 +646,9 @@ export const defaultConfig = {
 
   localProfilingPeriodMillis: 1000,
   localLogPeriodMillis: 10000,
+  localProfileDir: '',
   localTimeDurationMillis: 1000,
+  localAdditionalProfileTypes: [],
   sourceMapSearchPath: [process.cwd()],
   disableSourceMaps: false,
 };
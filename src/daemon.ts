@@ -0,0 +1,380 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {EventEmitter} from 'events';
+import * as extend from 'extend';
+import * as fs from 'fs';
+import * as net from 'net';
+
+import {
+  attachWorker,
+  ClusterCoordinator,
+  ClusterPrimary,
+  ClusterWorker,
+  WorkerSelection,
+} from './cluster';
+import {ProfilerConfig, serviceRegex} from './config';
+import {createLogger} from './logger';
+import {Profiler, Retryer} from './profiler';
+
+const HELLO_MESSAGE = 'cloud-profiler:hello';
+
+// Frames larger than this are rejected, and the connection closed.
+export const MAX_FRAME_BYTES = 256 * 1024 * 1024;
+
+/**
+ * @return message serialized as JSON, prefixed with its length as a 32-bit
+ * big-endian integer.
+ */
+export function encodeFrame(message: object): Buffer {
+  const body = Buffer.from(JSON.stringify(message));
+  const header = Buffer.alloc(4);
+  header.writeUInt32BE(body.length, 0);
+  return Buffer.concat([header, body]);
+}
+
+/**
+ * Splits the bytes read from a stream into the messages encoded by
+ * encodeFrame().
+ */
+export class FrameDecoder {
+  // Chunks are only concatenated once a whole frame has been read, so that
+  // reading a large frame takes time linear in its size.
+  private chunks: Buffer[] = [];
+  private bufferedBytes = 0;
+
+  /**
+   * @return the messages completed by chunk.
+   * @throws error when a frame is larger than MAX_FRAME_BYTES or is not
+   * valid JSON.
+   */
+  push(chunk: Buffer): object[] {
+    this.chunks.push(chunk);
+    this.bufferedBytes += chunk.length;
+    const messages: object[] = [];
+    while (this.bufferedBytes >= 4) {
+      if (this.chunks[0].length < 4) {
+        this.chunks = [Buffer.concat(this.chunks, this.bufferedBytes)];
+      }
+      const length = this.chunks[0].readUInt32BE(0);
+      if (length > MAX_FRAME_BYTES) {
+        throw new Error(`Frame of ${length} bytes exceeds maximum size.`);
+      }
+      if (this.bufferedBytes < 4 + length) {
+        break;
+      }
+      const buffered =
+        this.chunks.length === 1
+          ? this.chunks[0]
+          : Buffer.concat(this.chunks, this.bufferedBytes);
+      const rest = buffered.slice(4 + length);
+      this.chunks = rest.length > 0 ? [rest] : [];
+      this.bufferedBytes = rest.length;
+      messages.push(JSON.parse(buffered.slice(4, 4 + length).toString()));
+    }
+    return messages;
+  }
+}
+
+/**
+ * @return true if the hello message of a process names a valid service, and
+ * a version which is a string if any.
+ */
+// eslint-disable-next-line @typescript-eslint/no-explicit-any
+function isValidHello(message: any): boolean {
+  return (
+    typeof message.service === 'string' &&
+    serviceRegex.test(message.service) &&
+    (message.version === undefined || typeof message.version === 'string')
+  );
+}
+
+/**
+ * Removes the socket at path left by a daemon which is no longer listening,
+ * if any.
+ *
+ * @throws error when path exists and is not a socket, or a daemon is
+ * listening on it.
+ */
+async function removeStaleSocket(path: string): Promise<void> {
+  let stats: fs.Stats;
+  try {
+    stats = fs.lstatSync(path);
+  } catch (err) {
+    return;
+  }
+  if (!stats.isSocket()) {
+    throw new Error(`${path} exists and is not a socket.`);
+  }
+  const listening = await new Promise<boolean>(resolve => {
+    const probe = net.createConnection(path);
+    probe.once('connect', () => {
+      probe.destroy();
+      resolve(true);
+    });
+    probe.once('error', () => resolve(false));
+  });
+  if (listening) {
+    throw new Error(`A profiler daemon is already listening on ${path}.`);
+  }
+  fs.unlinkSync(path);
+}
+
+/**
+ * A process connected to the daemon, which collects profiles on request.
+ */
+class DaemonConnection implements ClusterWorker {
+  constructor(readonly id: number, private socket: net.Socket) {}
+
+  send(message: object): boolean {
+    return this.socket.write(encodeFrame(message));
+  }
+
+  isConnected(): boolean {
+    return !this.socket.destroyed;
+  }
+}
+
+/**
+ * The processes connected to the daemon which belong to one deployment.
+ * Presents them to a ClusterCoordinator as if they were cluster workers.
+ */
+class DaemonGroup extends EventEmitter implements ClusterPrimary {
+  workers: {[id: string]: DaemonConnection | undefined} = {};
+
+  constructor(readonly key: string, readonly profiler: Profiler) {
+    super();
+  }
+}
+
+/**
+ * Host-local daemon which polls the profiler server and uploads profiles on
+ * behalf of the processes which connect to it over a Unix domain socket.
+ * Processes are grouped by service and version; the daemon polls the
+ * profiler server once for each group, and asks one process in the group to
+ * collect each requested profile.
+ */
+export class ProfilerDaemon {
+  private server: net.Server | undefined;
+  private sockets = new Set<net.Socket>();
+  private groups = new Map<string, DaemonGroup>();
+  private nextConnectionId = 1;
+  private logger: ReturnType<typeof createLogger>;
+
+  /**
+   * @param config - configuration of the daemon. The serviceContext of each
+   * group is taken from the processes which connect.
+   * @param createProfiler - for testing. Creates the profiler of a group.
+   */
+  constructor(
+    readonly config: ProfilerConfig,
+    private createProfiler = (c: ProfilerConfig) => new Profiler(c)
+  ) {
+    this.logger = createLogger(config.logLevel);
+  }
+
+  /**
+   * Listens for connections on the Unix domain socket at path, whose file
+   * mode is set to config.daemonSocketMode, replacing a socket left by an
+   * earlier daemon which is no longer listening.
+   *
+   * @throws error when path exists and is not a socket, or another daemon
+   * is listening on it.
+   */
+  async listen(path: string): Promise<void> {
+    await removeStaleSocket(path);
+    const server = net.createServer(socket => this.onConnection(socket));
+    this.server = server;
+    await new Promise<void>((resolve, reject) => {
+      server.once('error', reject);
+      server.listen(path, () => {
+        server.removeListener('error', reject);
+        resolve();
+      });
+    });
+    try {
+      fs.chmodSync(path, this.config.daemonSocketMode);
+    } catch (err) {
+      this.close();
+      throw err;
+    }
+  }
+
+  /**
+   * Stops listening and closes the connections of all processes.
+   */
+  close() {
+    if (this.server) {
+      this.server.close();
+      this.server = undefined;
+    }
+    for (const socket of this.sockets) {
+      socket.destroy();
+    }
+  }
+
+  private onConnection(socket: net.Socket) {
+    this.sockets.add(socket);
+    const conn = new DaemonConnection(this.nextConnectionId++, socket);
+    const decoder = new FrameDecoder();
+    let group: DaemonGroup | undefined;
+    socket.on('data', chunk => {
+      let messages: object[];
+      try {
+        messages = decoder.push(chunk);
+      } catch (err) {
+        this.logger.debug(`Closing daemon connection ${conn.id}: ${err}`);
+        socket.destroy();
+        return;
+      }
+      // eslint-disable-next-line @typescript-eslint/no-explicit-any
+      for (const message of messages as any[]) {
+        if (!group) {
+          if (!message || message.type !== HELLO_MESSAGE) {
+            socket.destroy();
+            return;
+          }
+          if (!isValidHello(message)) {
+            this.logger.debug(
+              `Closing daemon connection ${conn.id}: invalid service ` +
+                `${message.service} or version ${message.version}.`
+            );
+            socket.destroy();
+            return;
+          }
+          group = this.group(message.service, message.version);
+          group.workers[String(conn.id)] = conn;
+        } else {
+          group.emit('message', conn, message);
+        }
+      }
+    });
+    socket.on('error', err => {
+      this.logger.debug(`Daemon connection ${conn.id} failed: ${err}`);
+    });
+    socket.on('close', () => {
+      this.sockets.delete(socket);
+      if (group) {
+        delete group.workers[String(conn.id)];
+        group.emit('exit', conn);
+        if (Object.keys(group.workers).length === 0) {
+          this.removeGroup(group);
+        }
+      }
+    });
+  }
+
+  /**
+   * @return the group of the processes of service and version, creating it
+   * and starting to poll the profiler server for it if it does not exist.
+   */
+  private group(service: string, version?: string): DaemonGroup {
+    const key = `${service}@${version || ''}`;
+    let group = this.groups.get(key);
+    if (!group) {
+      const config: ProfilerConfig = extend(true, {}, this.config, {
+        serviceContext: {service, version},
+      });
+      group = new DaemonGroup(key, this.createProfiler(config));
+      this.groups.set(key, group);
+      const coordinator = new ClusterCoordinator(
+        config.clusterWorkerSelection as WorkerSelection,
+        config.clusterWorkerTimeoutMillis,
+        group
+      );
+      group.profiler.useCollector(prof => coordinator.collect(prof));
+      // The features of the agent which run within a process, such as the
+      // flight recorder, run in the processes of the group instead. Heap
+      // profiles they wrote near the heap limit are uploaded by the daemon.
+      if (config.heapLimitProfileDir) {
+        group.profiler.uploadPendingProfiles();
+      }
+      group.profiler.runLoop();
+      this.logger.debug(`Started profiling ${key} for daemon clients.`);
+    }
+    return group;
+  }
+
+  /**
+   * Stops polling the profiler server for group, whose last process has
+   * disconnected.
+   */
+  private removeGroup(group: DaemonGroup) {
+    group.profiler.stop();
+    group.removeAllListeners();
+    this.groups.delete(group.key);
+    this.logger.debug(`Stopped profiling ${group.key} for daemon clients.`);
+  }
+}
+
+/**
+ * Connects profiler to the daemon listening on the Unix domain socket at
+ * path, and collects the profiles the daemon requests. If the connection
+ * cannot be made or is lost, it is retried with backoff.
+ */
+export function connectToDaemon(profiler: Profiler, path: string) {
+  const config = profiler.config;
+  const logger = createLogger(config.logLevel);
+  const retryer = new Retryer(
+    config.initialBackoffMillis,
+    config.backoffCapMillis,
+    config.backoffMultiplier
+  );
+  let socket: net.Socket | undefined;
+  const proc = new EventEmitter() as EventEmitter & {
+    connected: boolean;
+    send(message: object): boolean;
+  };
+  Object.defineProperty(proc, 'connected', {
+    get: () => !!socket && !socket.destroyed,
+  });
+  proc.send = (message: object) =>
+    !!socket && !socket.destroyed && socket.write(encodeFrame(message));
+  attachWorker(profiler, process.pid, proc);
+
+  const connect = () => {
+    const decoder = new FrameDecoder();
+    const s = net.createConnection(path);
+    socket = s;
+    s.unref();
+    s.on('connect', () => {
+      retryer.reset();
+      s.write(
+        encodeFrame({
+          type: HELLO_MESSAGE,
+          service: config.serviceContext.service,
+          version: config.serviceContext.version,
+        })
+      );
+    });
+    s.on('data', chunk => {
+      try {
+        for (const message of decoder.push(chunk)) {
+          proc.emit('message', message);
+        }
+      } catch (err) {
+        logger.debug(`Invalid message from profiler daemon: ${err}`);
+        s.destroy();
+      }
+    });
+    s.on('error', err => {
+      logger.debug(`Profiler daemon connection failed: ${err}`);
+    });
+    s.on('close', () => {
+      socket = undefined;
+      setTimeout(connect, retryer.getBackoff()).unref();
+    });
+  };
+  connect();
+}
@@ -0,0 +1,358 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as crypto from 'crypto';
+import * as fs from 'fs';
+import * as http from 'http';
+import * as https from 'https';
+import * as path from 'path';
+import {URL} from 'url';
+import * as zlib from 'zlib';
+
+// Time to wait for a backend to accept an exported profile.
+const EXPORT_TIMEOUT_MILLIS = 30 * 1000;
+
+/**
+ * A profile collected by the agent, as passed to each ProfileExporter. The
+ * profile is encoded once and the same bytes are passed to every exporter.
+ */
+export interface ExportedProfile {
+  // Type of the profile, such as "WALL" or "HEAP".
+  profileType: string;
+  // Gzipped, serialized pprof profile.
+  profileBytes: Buffer;
+  service: string;
+  version?: string;
+  // Labels of the profile, such as "instance".
+  labels: {[key: string]: string};
+  // Time at which collection of the profile started, in ms since the epoch.
+  startMillis: number;
+  // Duration of the profile, in ms, or 0 for profiles of a point in time.
+  durationMillis: number;
+}
+
+/**
+ * Sends collected profiles to a backend or to local storage, in addition to
+ * the profiler server.
+ */
+export interface ProfileExporter {
+  // Name of the exporter, used in log messages.
+  readonly name: string;
+
+  /**
+   * @throws error when the profile could not be exported.
+   */
+  export(profile: ExportedProfile): Promise<void>;
+}
+
+/**
+ * Sends body to url with a POST request.
+ *
+ * @throws error when the request fails, or the response status is not 2xx.
+ */
+function post(
+  url: string,
+  body: Buffer,
+  headers: http.OutgoingHttpHeaders
+): Promise<void> {
+  const u = new URL(url);
+  const transport = u.protocol === 'http:' ? http : https;
+  return new Promise((resolve, reject) => {
+    const req = transport.request(
+      {
+        protocol: u.protocol,
+        hostname: u.hostname,
+        port: u.port,
+        path: u.pathname + u.search,
+        method: 'POST',
+        headers: Object.assign({'Content-Length': body.length}, headers),
+        timeout: EXPORT_TIMEOUT_MILLIS,
+      },
+      res => {
+        res.resume();
+        res.on('end', () => {
+          const code = res.statusCode || 0;
+          if (code < 200 || code >= 300) {
+            reject(new Error(`${url} responded with status ${code}.`));
+          } else {
+            resolve();
+          }
+        });
+      }
+    );
+    req.on('timeout', () => {
+      req.abort();
+      reject(new Error(`${url} did not respond in time.`));
+    });
+    req.on('error', reject);
+    req.end(body);
+  });
+}
+
+/**
+ * Writes each profile to a new file in a local directory.
+ */
+export class FileExporter implements ProfileExporter {
+  readonly name = 'file';
+
+  constructor(readonly dir: string) {}
+
+  async export(profile: ExportedProfile): Promise<void> {
+    if (!fs.existsSync(this.dir)) {
+      fs.mkdirSync(this.dir);
+    }
+    const time = new Date(profile.startMillis)
+      .toISOString()
+      .replace(/[:-]/g, '');
+    const file = path.join(
+      this.dir,
+      `${profile.service}-${profile.profileType.toLowerCase()}-${time}.pb.gz`
+    );
+    fs.writeFileSync(file, profile.profileBytes);
+  }
+}
+
+/**
+ * Sends each profile to an OpenTelemetry collector with the OTLP/HTTP
+ * profiles signal, using the JSON encoding. The pprof profile is carried
+ * as the original payload of the OTLP profile.
+ */
+export class OtlpExporter implements ProfileExporter {
+  readonly name = 'otlp';
+
+  /**
+   * @param endpoint - base URL of the collector, such as
+   * "http://localhost:4318".
+   * @param headers - additional headers of each request, such as those used
+   * for authentication.
+   */
+  constructor(
+    readonly endpoint: string,
+    readonly headers: {[name: string]: string} = {}
+  ) {}
+
+  async export(profile: ExportedProfile): Promise<void> {
+    const attributes = [{key: 'service.name', value: profile.service}];
+    if (profile.version) {
+      attributes.push({key: 'service.version', value: profile.version});
+    }
+    for (const [key, value] of Object.entries(profile.labels)) {
+      attributes.push({
+        key: key === 'instance' ? 'service.instance.id' : key,
+        value,
+      });
+    }
+    const request = {
+      resourceProfiles: [
+        {
+          resource: {
+            attributes: attributes.map(a => ({
+              key: a.key,
+              value: {stringValue: a.value},
+            })),
+          },
+          scopeProfiles: [
+            {
+              scope: {name: '@google-cloud/profiler'},
+              profiles: [
+                {
+                  profileId: crypto.randomBytes(16).toString('hex'),
+                  timeNanos: `${profile.startMillis * 1e6}`,
+                  durationNanos: `${profile.durationMillis * 1e6}`,
+                  originalPayloadFormat: 'pprof',
+                  originalPayload: zlib
+                    .gunzipSync(profile.profileBytes)
+                    .toString('base64'),
+                },
+              ],
+            },
+          ],
+        },
+      ],
+    };
+    await post(
+      this.endpoint.replace(/\/+$/, '') + '/v1development/profiles',
+      Buffer.from(JSON.stringify(request)),
+      Object.assign({'Content-Type': 'application/json'}, this.headers)
+    );
+  }
+}
+
+// Pyroscope sample type configuration of each type of profile, which tells
+// the server how to present the sample types of the profiles of this agent.
+const PYROSCOPE_SAMPLE_TYPES: {[profileType: string]: object} = {
+  WALL: {
+    sample: {units: 'samples', 'display-name': 'wall'},
+  },
+  HEAP: {
+    objects: {
+      units: 'objects',
+      aggregation: 'average',
+      'display-name': 'inuse_objects',
+    },
+    space: {
+      units: 'bytes',
+      aggregation: 'average',
+      'display-name': 'inuse_space',
+    },
+  },
+};
+
+/**
+ * Sends each profile to the ingest API of a Pyroscope server.
+ */
+export class PyroscopeExporter implements ProfileExporter {
+  readonly name = 'pyroscope';
+
+  /**
+   * @param serverAddress - base URL of the server, such as
+   * "http://localhost:4040".
+   * @param authToken - when set, sent as a bearer token with each request.
+   */
+  constructor(readonly serverAddress: string, readonly authToken = '') {}
+
+  async export(profile: ExportedProfile): Promise<void> {
+    const tags: string[] = [];
+    if (profile.version) {
+      tags.push(`version=${profile.version}`);
+    }
+    for (const [key, value] of Object.entries(profile.labels)) {
+      tags.push(`${key}=${value}`);
+    }
+    const from = Math.floor(profile.startMillis / 1000);
+    const until = Math.max(
+      from + 1,
+      Math.ceil((profile.startMillis + profile.durationMillis) / 1000)
+    );
+    const query = [
+      `name=${encodeURIComponent(`${profile.service}{${tags.join(',')}}`)}`,
+      `from=${from}`,
+      `until=${until}`,
+      'format=pprof',
+      'spyName=nodespy',
+    ].join('&');
+
+    const boundary = crypto.randomBytes(16).toString('hex');
+    const part = (name: string, contentType: string, data: Buffer) =>
+      Buffer.concat([
+        Buffer.from(
+          `--${boundary}\r\n` +
+            `Content-Disposition: form-data; name="${name}"; ` +
+            `filename="${name}"\r\n` +
+            `Content-Type: ${contentType}\r\n\r\n`
+        ),
+        data,
+        Buffer.from('\r\n'),
+      ]);
+    const parts = [
+      part('profile', 'application/octet-stream', profile.profileBytes),
+    ];
+    const sampleTypes = PYROSCOPE_SAMPLE_TYPES[profile.profileType];
+    if (sampleTypes) {
+      parts.push(
+        part(
+          'sample_type_config',
+          'application/json',
+          Buffer.from(JSON.stringify(sampleTypes))
+        )
+      );
+    }
+    parts.push(Buffer.from(`--${boundary}--\r\n`));
+
+    const headers: http.OutgoingHttpHeaders = {
+      'Content-Type': `multipart/form-data; boundary=${boundary}`,
+    };
+    if (this.authToken) {
+      headers['Authorization'] = `Bearer ${this.authToken}`;
+    }
+    await post(
+      `${this.serverAddress.replace(/\/+$/, '')}/ingest?${query}`,
+      Buffer.concat(parts),
+      headers
+    );
+  }
+}
+
+/**
+ * Exports each profile to all of exporters concurrently.
+ */
+export class FanOutExporter implements ProfileExporter {
+  readonly name: string;
+
+  constructor(readonly exporters: ProfileExporter[]) {
+    this.name = exporters.map(e => e.name).join(',');
+  }
+
+  /**
+   * @throws error naming the exporters which failed, once every exporter
+   * has finished.
+   */
+  async export(profile: ExportedProfile): Promise<void> {
+    const errors = await Promise.all(
+      this.exporters.map(e =>
+        e.export(profile).then(
+          () => undefined,
+          (err: Error) => `${e.name}: ${err}`
+        )
+      )
+    );
+    const failed = errors.filter(e => e !== undefined);
+    if (failed.length > 0) {
+      throw new Error(`Failed to export profile to ${failed.join('; ')}`);
+    }
+  }
+}
+
+/**
+ * Options of the built-in exporters.
+ */
+export interface ExporterOptions {
+  exportProfileDir: string;
+  otlpProfilesEndpoint: string;
+  otlpHeaders: {[name: string]: string};
+  pyroscopeServerAddress: string;
+  pyroscopeAuthToken: string;
+  exporters: ProfileExporter[];
+}
+
+/**
+ * @return the exporters enabled by options, or undefined when no exporter
+ * is enabled.
+ */
+export function createExporter(
+  options: ExporterOptions
+): ProfileExporter | undefined {
+  const exporters: ProfileExporter[] = [];
+  if (options.exportProfileDir) {
+    exporters.push(new FileExporter(options.exportProfileDir));
+  }
+  if (options.otlpProfilesEndpoint) {
+    exporters.push(
+      new OtlpExporter(options.otlpProfilesEndpoint, options.otlpHeaders)
+    );
+  }
+  if (options.pyroscopeServerAddress) {
+    exporters.push(
+      new PyroscopeExporter(
+        options.pyroscopeServerAddress,
+        options.pyroscopeAuthToken
+      )
+    );
+  }
+  exporters.push(...(options.exporters || []));
+  if (exporters.length === 0) {
+    return undefined;
+  }
+  return exporters.length === 1 ? exporters[0] : new FanOutExporter(exporters);
+}
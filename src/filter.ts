@@ -0,0 +1,214 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+import {
+  addComment,
+  addString,
+  copyProfile,
+  getString,
+  locationFunctions,
+  mergeSamples,
+  removeUnreferenced,
+} from './profile-utils';
+import {isNodeInternal} from './stack-capture';
+
+/**
+ * Values of the samples removed from a profile because they were attributed
+ * to the profiler itself.
+ */
+export interface AgentOverhead {
+  // Number of samples removed.
+  samples: number;
+  // Sum of the removed samples, one entry per sample type of the profile.
+  values: number[];
+}
+
+/**
+ * Removes the frames of the agent, those with a file name which contains
+ * ignorePath, from time profiles.
+ *
+ * A sample in which the agent was running, because an agent frame is closer
+ * to the leaf than any frame of user code, is removed entirely. Agent frames
+ * of other samples, such as those of wrappers which call back into user
+ * code, are removed from their stacks, and samples which become identical
+ * are merged. Locations and functions which are no longer referenced are
+ * removed. When samples are removed, the removed values are recorded in a
+ * comment on the returned profile.
+ *
+ * This is the time profile counterpart of the ignoreSamplePath argument of
+ * pprof's heap profiler.
+ *
+ * @return the filtered profile, which is p itself when no frames matched,
+ * and the values of the samples which were removed.
+ */
+export function excludeAgentSamples(
+  p: perftools.profiles.IProfile,
+  ignorePath: string
+): {profile: perftools.profiles.IProfile; overhead: AgentOverhead} {
+  const numTypes = (p.sampleType || []).length;
+  const overhead: AgentOverhead = {
+    samples: 0,
+    values: new Array(numTypes).fill(0),
+  };
+  if (!ignorePath) {
+    return {profile: p, overhead};
+  }
+
+  const agentLocations = new Set<number>();
+  const userLocations = new Set<number>();
+  for (const [id, fns] of locationFunctions(p)) {
+    const filenames = fns.map(f => getString(p, f.filename));
+    if (filenames.some(f => f.indexOf(ignorePath) >= 0)) {
+      agentLocations.add(id);
+    } else if (filenames.some(f => !isNodeInternal(f))) {
+      userLocations.add(id);
+    }
+  }
+
+  const kept: perftools.profiles.ISample[] = [];
+  let stripped = false;
+  for (const s of p.sample || []) {
+    const stack = (s.locationId || []).map(Number);
+    const firstAgent = stack.findIndex(id => agentLocations.has(id));
+    const firstUser = stack.findIndex(id => userLocations.has(id));
+    if (firstAgent < 0) {
+      kept.push(s);
+    } else if (firstUser < 0 || firstAgent < firstUser) {
+      overhead.samples++;
+      (s.value || []).forEach((v, i) => {
+        overhead.values[i] += Number(v);
+      });
+    } else {
+      stripped = true;
+      kept.push(
+        new perftools.profiles.Sample({
+          locationId: stack.filter(id => !agentLocations.has(id)),
+          value: s.value,
+          label: s.label,
+        })
+      );
+    }
+  }
+  if (overhead.samples === 0 && !stripped) {
+    return {profile: p, overhead};
+  }
+
+  const filtered = copyProfile(p);
+  filtered.sample = stripped ? mergeSamples(kept) : kept;
+  removeUnreferenced(filtered);
+  if (overhead.samples > 0) {
+    addComment(filtered, formatOverhead(p, overhead));
+  }
+  return {profile: filtered, overhead};
+}
+
+/**
+ * @return description of overhead, such as
+ * "agent overhead: 3 samples, sample/count=3, wall/microseconds=3000".
+ */
+function formatOverhead(
+  p: perftools.profiles.IProfile,
+  overhead: AgentOverhead
+): string {
+  const values = (p.sampleType || []).map(
+    (t, i) =>
+      `${getString(p, t.type)}/${getString(p, t.unit)}=${overhead.values[i]}`
+  );
+  return [`agent overhead: ${overhead.samples} samples`, ...values].join(', ');
+}
+
+/**
+ * @return regular expression which matches function names fully matching
+ * the pprof dropFrames or keepFrames regular expression re.
+ * @throws error when re is not a valid regular expression.
+ */
+export function frameRegExp(re: string): RegExp {
+  return new RegExp(`^(?:${re})$`);
+}
+
+/**
+ * Trims frames from the stacks of p with the semantics of the dropFrames and
+ * keepFrames fields of the pprof Profile message: a location whose function
+ * name fully matches dropFrames, and does not fully match keepFrames, is
+ * removed from each stack along with all of the frames it called, so that
+ * its samples are attributed to its caller. Frames between the root and the
+ * first frame which does not match are never removed, so that stacks do not
+ * become empty. Samples which become identical are merged.
+ *
+ * The regular expressions are recorded in the dropFrames and keepFrames
+ * fields of the returned profile.
+ *
+ * @return p when dropFrames is empty, and the trimmed profile otherwise.
+ */
+export function trimFrames(
+  p: perftools.profiles.IProfile,
+  dropFrames: string,
+  keepFrames: string
+): perftools.profiles.IProfile {
+  if (!dropFrames) {
+    return p;
+  }
+  const dropRe = frameRegExp(dropFrames);
+  const keepRe = keepFrames ? frameRegExp(keepFrames) : undefined;
+
+  const drop = new Set<number>();
+  for (const [id, fns] of locationFunctions(p)) {
+    if (
+      fns.some(f => {
+        const name = getString(p, f.name);
+        return dropRe.test(name) && !(keepRe && keepRe.test(name));
+      })
+    ) {
+      drop.add(id);
+    }
+  }
+
+  const samples: perftools.profiles.ISample[] = [];
+  for (const s of p.sample || []) {
+    const stack = (s.locationId || []).map(Number);
+    // Scan from the root to the leaf for the first frame to drop after the
+    // first frame which is kept.
+    let foundKept = false;
+    let cut = -1;
+    for (let i = stack.length - 1; i >= 0; i--) {
+      if (!drop.has(stack[i])) {
+        foundKept = true;
+      } else if (foundKept) {
+        cut = i;
+        break;
+      }
+    }
+    if (cut < 0) {
+      samples.push(s);
+    } else {
+      samples.push(
+        new perftools.profiles.Sample({
+          locationId: stack.slice(cut + 1),
+          value: s.value,
+          label: s.label,
+        })
+      );
+    }
+  }
+
+  const out = copyProfile(p);
+  out.sample = mergeSamples(samples);
+  removeUnreferenced(out);
+  out.dropFrames = addString(out, dropFrames);
+  if (keepFrames) {
+    out.keepFrames = addString(out, keepFrames);
+  }
+  return out;
+}
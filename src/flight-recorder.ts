@@ -0,0 +1,93 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+import * as path from 'path';
+
+/**
+ * A profile retained by a FlightRecorder.
+ */
+export interface RecordedProfile {
+  // Type of the profile, such as "WALL" or "HEAP".
+  profileType: string;
+  // Time at which collection of the profile completed.
+  timeMillis: number;
+  // Gzipped, serialized pprof profile.
+  bytes: Buffer;
+}
+
+/**
+ * Ring of the most recently collected profiles, holding at most maxProfiles
+ * profiles with a total size of at most maxBytes. The oldest profiles are
+ * discarded first.
+ */
+export class FlightRecorder {
+  private ring: RecordedProfile[] = [];
+  private totalBytes = 0;
+
+  constructor(readonly maxProfiles: number, readonly maxBytes: number) {}
+
+  /**
+   * Adds a profile, discarding the oldest profiles as needed to stay within
+   * the limits of the recorder. A profile larger than maxBytes is not added.
+   */
+  add(profileType: string, bytes: Buffer, timeMillis = Date.now()) {
+    if (bytes.length > this.maxBytes || this.maxProfiles <= 0) {
+      return;
+    }
+    this.ring.push({profileType, timeMillis, bytes});
+    this.totalBytes += bytes.length;
+    while (
+      this.ring.length > this.maxProfiles ||
+      this.totalBytes > this.maxBytes
+    ) {
+      this.totalBytes -= this.ring.shift()!.bytes.length;
+    }
+  }
+
+  /**
+   * @return the retained profiles, oldest first.
+   */
+  profiles(): RecordedProfile[] {
+    return this.ring.slice();
+  }
+
+  /**
+   * @return total size of the retained profiles.
+   */
+  bytes(): number {
+    return this.totalBytes;
+  }
+
+  /**
+   * Synchronously writes each retained profile to its own file in dir, named
+   * after its type and collection time.
+   *
+   * @return paths of the files written, oldest profile first.
+   */
+  dump(dir: string): string[] {
+    if (!fs.existsSync(dir)) {
+      fs.mkdirSync(dir);
+    }
+    return this.ring.map((p, i) => {
+      const time = new Date(p.timeMillis).toISOString().replace(/[:-]/g, '');
+      const file = path.join(
+        dir,
+        `${p.profileType.toLowerCase()}-${time}-${i}.pb.gz`
+      );
+      fs.writeFileSync(file, p.bytes);
+      return file;
+    });
+  }
+}
@@ -0,0 +1,174 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import delay from 'delay';
+import * as perfHooks from 'perf_hooks';
+
+/**
+ * Load of the process since the previous measurement.
+ */
+export interface Load {
+  // Fraction of time the event loop was busy, between 0 and 1.
+  eventLoopUtilization: number;
+  // CPU time used by the process divided by elapsed time. May exceed 1 when
+  // the process uses multiple threads.
+  cpuUtilization: number;
+}
+
+/**
+ * Counts of the actions taken by a LoadGovernor.
+ */
+export interface GovernorStats {
+  // Number of times encoding and upload of a profile was deferred.
+  deferrals: number;
+  // Total time, in ms, for which profiles were deferred.
+  deferredMillis: number;
+  // Number of time profiles collected with a reduced sampling rate.
+  reducedSamplingRate: number;
+}
+
+type EventLoopUtilization = {idle: number; active: number; utilization: number};
+
+/**
+ * @return a function which measures the load of the process since the
+ * previous call.
+ */
+export function loadMeter(): () => Load {
+  // performance.eventLoopUtilization() is not available before Node 14.10.
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  const perf = perfHooks.performance as any;
+  const elu: (
+    cur?: EventLoopUtilization,
+    prev?: EventLoopUtilization
+  ) => EventLoopUtilization | undefined =
+    typeof perf.eventLoopUtilization === 'function'
+      ? perf.eventLoopUtilization.bind(perf)
+      : () => undefined;
+
+  let prevElu = elu();
+  let prevCpu = process.cpuUsage();
+  let prevTime = process.hrtime();
+  return () => {
+    const curElu = elu();
+    const eventLoopUtilization =
+      curElu && prevElu ? elu(curElu, prevElu)!.utilization : 0;
+    prevElu = curElu;
+
+    const cpu = process.cpuUsage(prevCpu);
+    prevCpu = process.cpuUsage();
+    const [sec, nanos] = process.hrtime(prevTime);
+    prevTime = process.hrtime();
+    const elapsedMicros = sec * 1e6 + nanos / 1e3;
+    const cpuUtilization =
+      elapsedMicros > 0 ? (cpu.user + cpu.system) / elapsedMicros : 0;
+
+    return {eventLoopUtilization, cpuUtilization};
+  };
+}
+
+/**
+ * Decides whether the process is too busy for profiling work to be done on
+ * the event loop, and defers that work until the load drops.
+ *
+ * A threshold of 0 disables the corresponding check; when both thresholds
+ * are 0, the governor never defers work or reduces the sampling rate.
+ */
+export class LoadGovernor {
+  private deferrals = 0;
+  private deferredMillis = 0;
+  private reducedSamplingRate = 0;
+
+  // For testing. Allows the load measurement to be replaced.
+  private measure: () => Load;
+
+  constructor(
+    readonly maxEventLoopUtilization: number,
+    readonly maxCpuUtilization: number,
+    readonly maxDeferMillis: number,
+    readonly checkIntervalMillis: number,
+    measure?: () => Load
+  ) {
+    this.measure = measure || loadMeter();
+  }
+
+  enabled(): boolean {
+    return this.maxEventLoopUtilization > 0 || this.maxCpuUtilization > 0;
+  }
+
+  /**
+   * @return true iff the load since the previous measurement exceeded either
+   * threshold.
+   */
+  overloaded(): boolean {
+    if (!this.enabled()) {
+      return false;
+    }
+    const load = this.measure();
+    return (
+      (this.maxEventLoopUtilization > 0 &&
+        load.eventLoopUtilization > this.maxEventLoopUtilization) ||
+      (this.maxCpuUtilization > 0 &&
+        load.cpuUtilization > this.maxCpuUtilization)
+    );
+  }
+
+  /**
+   * @return the sampling interval to use for a time profile; this is
+   * intervalMicros multiplied by multiplier if the process is overloaded and
+   * intervalMicros otherwise.
+   */
+  timeIntervalMicros(intervalMicros: number, multiplier: number): number {
+    if (multiplier <= 1 || !this.overloaded()) {
+      return intervalMicros;
+    }
+    this.reducedSamplingRate++;
+    return intervalMicros * multiplier;
+  }
+
+  /**
+   * Waits until the process is no longer overloaded, or until maxDeferMillis
+   * has elapsed, whichever comes first. Work is never deferred longer than
+   * maxDeferMillis, so that the profile can still be uploaded before the
+   * server stops accepting it.
+   *
+   * @return time, in ms, spent waiting.
+   */
+  async waitForCapacity(): Promise<number> {
+    if (!this.overloaded()) {
+      return 0;
+    }
+    this.deferrals++;
+    const start = Date.now();
+    let waited = 0;
+    while (waited < this.maxDeferMillis) {
+      await delay(
+        Math.min(this.checkIntervalMillis, this.maxDeferMillis - waited)
+      );
+      waited = Date.now() - start;
+      if (!this.overloaded()) {
+        break;
+      }
+    }
+    this.deferredMillis += waited;
+    return waited;
+  }
+
+  stats(): GovernorStats {
+    return {
+      deferrals: this.deferrals,
+      deferredMillis: this.deferredMillis,
+      reducedSamplingRate: this.reducedSamplingRate,
+    };
+  }
+}
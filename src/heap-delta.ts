@@ -0,0 +1,133 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+import {ProfileBuilder} from './profile-builder';
+import {Frame, locationFrames, stackKey} from './profile-utils';
+
+export const DELTA_SAMPLE_TYPE = 'space_delta';
+
+/**
+ * The live bytes allocated at one stack.
+ */
+interface StackSummary {
+  frames: Frame[];
+  bytes: number;
+}
+
+/**
+ * @return the total of the last sample type of the samples of p, by stack.
+ */
+export function summarizeByStack(
+  p: perftools.profiles.IProfile
+): Map<string, StackSummary> {
+  const frames = locationFrames(p);
+  const valueIdx = (p.sampleType || []).length - 1;
+  const summary = new Map<string, StackSummary>();
+  for (const s of p.sample || []) {
+    const stack: Frame[] = [];
+    for (const id of s.locationId || []) {
+      stack.push(...(frames.get(Number(id)) || []));
+    }
+    const key = stackKey(stack);
+    const bytes = Number((s.value || [])[valueIdx] || 0);
+    const existing = summary.get(key);
+    if (existing) {
+      existing.bytes += bytes;
+    } else {
+      summary.set(key, {frames: stack, bytes});
+    }
+  }
+  return summary;
+}
+
+/**
+ * Retains a compact summary of the previous heap profile and adds the change
+ * in live bytes since that profile as an additional sample type.
+ *
+ * At most maxStacks stacks, those with the most live bytes, are retained.
+ * Stacks which were not retained are reported as if they were not present in
+ * the previous profile.
+ */
+export class HeapDeltaTracker {
+  private previous: Map<string, StackSummary> | undefined;
+
+  constructor(readonly maxStacks: number) {}
+
+  /**
+   * @return a copy of p with a "space_delta" sample type holding, for each
+   * stack, the change in live bytes since the previous profile passed to
+   * addDelta(). Stacks which are no longer present are added with negative
+   * deltas.
+   */
+  addDelta(p: perftools.profiles.IProfile): perftools.profiles.IProfile {
+    const current = summarizeByStack(p);
+    const previous = this.previous;
+    this.retain(current);
+
+    const builder = new ProfileBuilder(p);
+    const out = builder.profile;
+    out.sampleType!.push(
+      builder.valueType({type: DELTA_SAMPLE_TYPE, unit: 'bytes'})
+    );
+    if (!previous) {
+      out.comment!.push(
+        builder.string(`${DELTA_SAMPLE_TYPE}: no previous heap profile`)
+      );
+    }
+
+    // The delta of a stack is reported on its first sample.
+    const frames = locationFrames(p);
+    const reported = new Set<string>();
+    out.sample = out.sample!.map(s => {
+      const stack: Frame[] = [];
+      for (const id of s.locationId || []) {
+        stack.push(...(frames.get(Number(id)) || []));
+      }
+      const key = stackKey(stack);
+      let delta = 0;
+      if (!reported.has(key)) {
+        reported.add(key);
+        const prev = previous && previous.get(key);
+        delta = current.get(key)!.bytes - (prev ? prev.bytes : 0);
+      }
+      return new perftools.profiles.Sample({
+        locationId: s.locationId,
+        value: (s.value || []).concat([delta]),
+        label: s.label,
+      });
+    });
+
+    if (previous) {
+      const zeros = new Array(out.sampleType!.length - 1).fill(0);
+      for (const [key, prev] of previous) {
+        if (!current.has(key) && prev.bytes !== 0) {
+          builder.addSample(prev.frames, zeros.concat([-prev.bytes]));
+        }
+      }
+    }
+    return out;
+  }
+
+  private retain(current: Map<string, StackSummary>) {
+    if (current.size <= this.maxStacks) {
+      this.previous = current;
+      return;
+    }
+    const largest = Array.from(current.entries())
+      .sort((a, b) => b[1].bytes - a[1].bytes)
+      .slice(0, this.maxStacks);
+    this.previous = new Map(largest);
+  }
+}
@@ -0,0 +1,191 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+import * as path from 'path';
+import * as v8 from 'v8';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+
+const PENDING_PREFIX = 'heap-limit-';
+const PENDING_SUFFIX = '.pb.gz';
+const CLAIMED_SUFFIX = '.claimed';
+
+// At most this many pending profiles are kept on disk; older ones are
+// removed when a new one is written.
+export const MAX_PENDING_PROFILES = 5;
+
+export interface HeapUsage {
+  usedBytes: number;
+  limitBytes: number;
+}
+
+/**
+ * @return the bytes used by the V8 heap and the limit on its size.
+ */
+export function heapUsage(): HeapUsage {
+  const stats = v8.getHeapStatistics();
+  return {usedBytes: stats.used_heap_size, limitBytes: stats.heap_size_limit};
+}
+
+/**
+ * Periodically checks V8 heap usage and calls onNearLimit once heap usage
+ * exceeds the fraction threshold of the heap size limit. onNearLimit is
+ * called again only after heap usage has dropped back below the threshold.
+ */
+export class HeapLimitWatcher {
+  private timer: NodeJS.Timeout | undefined;
+  private triggered = false;
+
+  constructor(
+    readonly threshold: number,
+    readonly checkIntervalMillis: number,
+    private onNearLimit: (usage: HeapUsage) => void,
+    private measure: () => HeapUsage = heapUsage
+  ) {}
+
+  start() {
+    if (this.timer) {
+      return;
+    }
+    this.timer = setInterval(() => this.check(), this.checkIntervalMillis);
+    this.timer.unref();
+  }
+
+  stop() {
+    if (this.timer) {
+      clearInterval(this.timer);
+      this.timer = undefined;
+    }
+  }
+
+  /**
+   * @return true if heap usage was found to exceed the threshold, and
+   * onNearLimit was called.
+   *
+   * Public for testing.
+   */
+  check(): boolean {
+    const usage = this.measure();
+    const near = usage.usedBytes >= this.threshold * usage.limitBytes;
+    if (!near) {
+      this.triggered = false;
+      return false;
+    }
+    if (this.triggered) {
+      return false;
+    }
+    this.triggered = true;
+    this.onNearLimit(usage);
+    return true;
+  }
+}
+
+/**
+ * @return paths of the pending profiles in dir, oldest first. When service
+ * is given, only the profiles written by processes of service, or written
+ * without a service, are returned.
+ */
+export function pendingProfilePaths(dir: string, service?: string): string[] {
+  let names: string[];
+  try {
+    names = fs.readdirSync(dir);
+  } catch (err) {
+    return [];
+  }
+  return names
+    .filter(n => n.startsWith(PENDING_PREFIX) && n.endsWith(PENDING_SUFFIX))
+    .filter(n => {
+      if (service === undefined) {
+        return true;
+      }
+      const id = n.slice(PENDING_PREFIX.length, -PENDING_SUFFIX.length);
+      const m = /^\d+-\d+(?:-(.*))?$/.exec(id);
+      return !!m && (!m[1] || m[1] === service);
+    })
+    .sort()
+    .map(n => path.join(dir, n));
+}
+
+/**
+ * Synchronously writes p as a gzipped, serialized pprof profile to a new
+ * file in dir, removing the oldest pending profiles so that at most
+ * MAX_PENDING_PROFILES remain. The file is written under a temporary name
+ * and renamed, so that a partially written file is never uploaded.
+ *
+ * @param service - name of the service of this process, recorded in the
+ * file name so that the profile is uploaded for the same service.
+ * @return path of the new file.
+ */
+export function writePendingProfile(
+  dir: string,
+  p: perftools.profiles.IProfile,
+  service = '',
+  timeMillis = Date.now()
+): string {
+  const buffer = zlib.gzipSync(perftools.profiles.Profile.encode(p).finish());
+  // Zero-padding the time keeps lexical order consistent with time order.
+  const time = String(timeMillis).padStart(15, '0');
+  const tag = service ? `-${service}` : '';
+  const file = path.join(
+    dir,
+    `${PENDING_PREFIX}${time}-${process.pid}${tag}${PENDING_SUFFIX}`
+  );
+  if (!fs.existsSync(dir)) {
+    fs.mkdirSync(dir);
+  }
+  fs.writeFileSync(`${file}.tmp`, buffer);
+  fs.renameSync(`${file}.tmp`, file);
+
+  const pending = pendingProfilePaths(dir);
+  for (const old of pending.slice(0, -MAX_PENDING_PROFILES)) {
+    try {
+      fs.unlinkSync(old);
+    } catch (err) {
+      // Already claimed by a process uploading it.
+    }
+  }
+  return file;
+}
+
+/**
+ * Claims the pending profile file for this process, by renaming it to a name
+ * which is not returned by pendingProfilePaths(). As renaming is atomic, a
+ * file is claimed by at most one of the processes sharing dir.
+ *
+ * @return path of the claimed file, or undefined when the file was already
+ * claimed or removed by another process.
+ */
+export function claimPendingProfile(file: string): string | undefined {
+  const claimed = `${file}.${process.pid}${CLAIMED_SUFFIX}`;
+  try {
+    fs.renameSync(file, claimed);
+    return claimed;
+  } catch (err) {
+    return undefined;
+  }
+}
+
+/**
+ * Returns the pending profile claimed by claimPendingProfile() to the
+ * pending profiles, under its original path file, to be uploaded later.
+ */
+export function releasePendingProfile(claimed: string, file: string) {
+  try {
+    fs.renameSync(claimed, file);
+  } catch (err) {
+    // The profile is lost, which is no worse than failing to upload it.
+  }
+}
@@ -12,20 +12,46 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+import * as cluster from 'cluster';
 import delay from 'delay';
 import * as extend from 'extend';
 import * as fs from 'fs';
 import * as gcpMetadata from 'gcp-metadata';
+import * as path from 'path';
 import {heap as heapProfiler} from 'pprof';
 import * as semver from 'semver';
 
-import {Config, defaultConfig, LocalConfig, ProfilerConfig} from './config';
+import {attachWorker, ClusterCoordinator, WorkerSelection} from './cluster';
+import {
+  Config,
+  defaultConfig,
+  LocalConfig,
+  ProfilerConfig,
+  serviceRegex,
+} from './config';
+import {connectToDaemon, ProfilerDaemon} from './daemon';
+import {frameRegExp} from './filter';
 import {createLogger} from './logger';
-import {Profiler} from './profiler';
+import {formatLoopPhases} from './loop-phases';
+import {Profiler, RequestProfile} from './profiler';
+
+export {
+  ExportedProfile,
+  FileExporter,
+  OtlpExporter,
+  ProfileExporter,
+  PyroscopeExporter,
+} from './exporters';
 
 // eslint-disable-next-line @typescript-eslint/no-var-requires
 const pjson = require('../../package.json');
-const serviceRegex = /^[a-z]([-a-z0-9_.]{0,253}[a-z0-9])?$/;
+
+// Placeholder service of the configuration of a profiler daemon; the daemon
+// profiles the services of the processes which connect to it.
+const DAEMON_SERVICE = 'profiler-daemon';
+
+// Profiler started by start(), if any.
+let activeProfiler: Profiler | undefined;
 
 function hasService(
   config: Config
@@ -40,6 +66,18 @@ function hasProjectId(config: Config): config is {projectId: string} {
   return typeof config.projectId === 'string';
 }
 
+/**
+ * Throws error if re, the value of the config field named field, is not a
+ * valid regular expression.
+ */
+function checkFrameRegExp(field: string, re: string) {
+  try {
+    frameRegExp(re);
+  } catch (e) {
+    throw new Error(`${field} is not a valid regular expression: ${e}`);
+  }
+}
+
 /**
  * Sets unset values in the configuration to the value retrieved from
  * environment variables or specified in defaultConfig.
@@ -103,6 +141,17 @@ function initConfigLocal(config: Config): LocalConfig {
     );
   }
 
+  checkFrameRegExp('dropFrames', mergedConfig.dropFrames);
+  checkFrameRegExp('keepFrames', mergedConfig.keepFrames);
+
+  const selections: string[] = Object.values(WorkerSelection);
+  if (selections.indexOf(mergedConfig.clusterWorkerSelection) < 0) {
+    throw new Error(
+      `clusterWorkerSelection must be one of ${selections.join(', ')}, ` +
+        `not "${mergedConfig.clusterWorkerSelection}"`
+    );
+  }
+
   return mergedConfig;
 }
 
@@ -216,9 +265,79 @@ export async function createProfiler(config: Config = {}): Promise<Profiler> {
  */
 export async function start(config: Config = {}): Promise<void> {
   const profiler = await createProfiler(config);
+  activeProfiler = profiler;
+  if (profiler.config.daemonSocketPath) {
+    // The daemon polls the profiler server on behalf of this process.
+    await profiler.startInProcess();
+    connectToDaemon(profiler, profiler.config.daemonSocketPath);
+    return;
+  }
+  if (profiler.config.clusterMode && cluster.isWorker) {
+    // The primary polls the profiler server on behalf of this worker.
+    await profiler.startInProcess();
+    attachWorker(profiler, cluster.worker.id);
+    return;
+  }
+  if (profiler.config.clusterMode) {
+    const coordinator = new ClusterCoordinator(
+      profiler.config.clusterWorkerSelection as WorkerSelection,
+      profiler.config.clusterWorkerTimeoutMillis,
+      cluster
+    );
+    if (profiler.config.clusterMergeProfiles) {
+      const labels = profiler.config.instance
+        ? {instance: profiler.config.instance}
+        : {};
+      const maxSamples = profiler.config.clusterMergeMaxSamples;
+      profiler.useCollector(prof =>
+        coordinator.collectMerged(prof, labels, maxSamples)
+      );
+    } else {
+      profiler.useCollector(prof => coordinator.collect(prof));
+    }
+  }
   profiler.start();
 }
 
+/**
+ * Starts a host-local profiler daemon, which listens on the Unix domain
+ * socket at config.daemonSocketPath, and polls the profiler server and
+ * uploads profiles on behalf of the processes started with the same
+ * daemonSocketPath.
+ *
+ * @example
+ * profiler.startDaemon({daemonSocketPath: '/run/cloud-profiler.sock'});
+ */
+export async function startDaemon(
+  config: Config = {}
+): Promise<ProfilerDaemon> {
+  const localConfig = initConfigLocal(
+    extend(true, {serviceContext: {service: DAEMON_SERVICE}}, config)
+  );
+  if (!localConfig.daemonSocketPath) {
+    throw new Error('daemonSocketPath must be specified to start a daemon');
+  }
+  const daemon = new ProfilerDaemon(await initConfigMetadata(localConfig));
+  await daemon.listen(localConfig.daemonSocketPath);
+  return daemon;
+}
+
+/**
+ * Writes the profiles kept by the flight recorder of the profiler started by
+ * start() to dir, which defaults to the flightRecorderDumpDir configuration
+ * value.
+ *
+ * @return paths of the files written.
+ * @throws error when the profiler has not been started or its flight
+ * recorder is not enabled.
+ */
+export function dumpFlightRecorder(dir?: string): string[] {
+  if (!activeProfiler) {
+    throw new Error('Profiler has not been started.');
+  }
+  return activeProfiler.dumpFlightRecorder(dir);
+}
+
 /**
  * For debugging purposes. Collects profiles and discards the collected
  * profiles.
@@ -236,6 +355,8 @@ export async function startLocal(config: Config = {}): Promise<void> {
   setInterval(() => {
     const curTime = Date.now();
     const {rss, heapTotal, heapUsed} = process.memoryUsage();
+    const {deferrals, reducedSamplingRate} = profiler.governorStats();
+    const loopPhases = profiler.loopPhaseTimes();
     logger.debug(
       new Date().toISOString(),
       'rss',
@@ -252,35 +373,83 @@ export async function startLocal(config: Config = {}): Promise<void> {
       'profiles/s,',
       'time profile collection rate',
       ((timeProfileCount * 1000) / (curTime - prevLogTime)).toFixed(3),
-      'profiles/s'
+      'profiles/s,',
+      'profiles deferred due to load',
+      deferrals,
+      'time profiles with reduced sampling rate',
+      reducedSamplingRate
     );
+    if (loopPhases) {
+      logger.debug(new Date().toISOString(), formatLoopPhases(loopPhases));
+    }
 
     heapProfileCount = 0;
     timeProfileCount = 0;
     prevLogTime = curTime;
   }, profiler.config.localLogPeriodMillis);
 
+  const dir = profiler.config.localProfileDir;
+  if (dir) {
+    await fs.promises.mkdir(dir, {recursive: true});
+  }
+
   // Periodic profiling
   setInterval(async () => {
-    if (!config.disableHeap) {
-      await profiler.profile({
-        name: 'Heap-Profile' + new Date(),
-        profileType: 'HEAP',
-      });
-      heapProfileCount++;
+    try {
+      if (!config.disableHeap) {
+        const heap = await profiler.profile({
+          name: 'Heap-Profile' + new Date(),
+          profileType: 'HEAP',
+        });
+        await writeLocalProfile(dir, heap);
+        await profiler.exportProfile(heap);
+        heapProfileCount++;
+      }
+      await delay(profiler.config.localProfilingPeriodMillis / 2);
+      if (!config.disableTime) {
+        const wall = await profiler.profile({
+          name: 'Time-Profile' + new Date(),
+          profileType: 'WALL',
+          duration: profiler.config.localTimeDurationMillis.toString() + 'ms',
+        });
+        await writeLocalProfile(dir, wall);
+        await profiler.exportProfile(wall);
+        timeProfileCount++;
+      }
+    } catch (err) {
+      logger.error(`Failed to collect local profile: ${err}`);
     }
-    await delay(profiler.config.localProfilingPeriodMillis / 2);
-    if (!config.disableTime) {
-      await profiler.profile({
-        name: 'Time-Profile' + new Date(),
-        profileType: 'WALL',
-        duration: profiler.config.localTimeDurationMillis.toString() + 'ms',
-      });
-      timeProfileCount++;
+    for (const profileType of profiler.config.localAdditionalProfileTypes) {
+      try {
+        const prof = await profiler.profile({
+          name: `${profileType}-Profile${new Date()}`,
+          profileType,
+          duration: `${profiler.config.localTimeDurationMillis}ms`,
+        });
+        await writeLocalProfile(dir, prof);
+        await profiler.exportProfile(prof);
+      } catch (err) {
+        logger.debug(`Failed to collect ${profileType} profile: ${err}`);
+      }
     }
   }, profiler.config.localProfilingPeriodMillis);
 }
 
+/**
+ * Writes a profile collected by startLocal() to dir, which must exist, as a
+ * gzipped pprof profile, when dir is set.
+ */
+async function writeLocalProfile(dir: string, prof: RequestProfile) {
+  if (!dir || !prof.profileBytes) {
+    return;
+  }
+  const time = new Date().toISOString().replace(/[:-]/g, '');
+  await fs.promises.writeFile(
+    path.join(dir, `${prof.profileType!.toLowerCase()}-${time}.pb.gz`),
+    Buffer.from(prof.profileBytes, 'base64')
+  );
+}
+
 // If the module was --require'd from the command line, start the agent.
 if (module.parent && module.parent.id === 'internal/preload') {
   start();
@@ -0,0 +1,211 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as asyncHooks from 'async_hooks';
+
+import {perftools} from '../protos/profile';
+import {Frame} from './profile-utils';
+import {captureStack, nowNanos, StackDurations} from './stack-capture';
+
+// Kind of I/O of each type of async resource whose lifetime is the duration
+// of one I/O operation.
+const IO_RESOURCE_TYPES: {[type: string]: string} = {
+  FSREQCALLBACK: 'fs',
+  FSREQPROMISE: 'fs',
+  GETADDRINFOREQWRAP: 'dns',
+  GETNAMEINFOREQWRAP: 'dns',
+  QUERYWRAP: 'dns',
+  TCPCONNECTWRAP: 'net',
+  PIPECONNECTWRAP: 'net',
+};
+
+// Names of the diagnostics channels which report the start and end of
+// outbound HTTP requests, available in Node 18 and later.
+const HTTP_REQUEST_START_CHANNEL = 'http.client.request.start';
+const HTTP_RESPONSE_FINISH_CHANNEL = 'http.client.response.finish';
+
+/**
+ * The parts of a diagnostics channel used by IoWaitProfiler.
+ */
+interface Channel {
+  subscribe(listener: (message: {request?: object}) => void): void;
+  unsubscribe(listener: (message: {request?: object}) => void): void;
+}
+
+/**
+ * @return the diagnostics channel named name, or undefined if the
+ * diagnostics_channel module is not available.
+ */
+function diagnosticsChannel(name: string): Channel | undefined {
+  try {
+    // eslint-disable-next-line @typescript-eslint/no-var-requires
+    return require('diagnostics_channel').channel(name);
+  } catch (err) {
+    return undefined;
+  }
+}
+
+interface PendingOperation {
+  kind: string;
+  frames: Frame[];
+  startNanos: number;
+}
+
+/**
+ * Records the time spent waiting for file system, DNS, socket connect and
+ * outbound HTTP operations, attributed to the JavaScript stack which
+ * started each operation.
+ *
+ * The stack is captured when an operation's async resource is created, and
+ * the operation completes when its callback is invoked or the resource is
+ * destroyed. Outbound HTTP requests are timed from the creation of the
+ * request to the end of its response when the diagnostics_channel module
+ * reports them.
+ */
+export class IoWaitProfiler {
+  private hook: asyncHooks.AsyncHook | undefined;
+  private pending = new Map<number, PendingOperation>();
+  private pendingRequests = new WeakMap<object, PendingOperation>();
+  private durations: StackDurations;
+  private requestStart: Channel | undefined;
+  private responseFinish: Channel | undefined;
+
+  /**
+   * @param maxFrames - maximum number of frames captured per stack.
+   * @param maxPending - maximum number of operations tracked at once;
+   * operations started while this many are in progress are not recorded.
+   * @param maxStacks - maximum number of distinct stacks; the wait time of
+   * operations started from other stacks is recorded without a stack.
+   * @param ignorePath - operations whose stack contains a frame with a file
+   * name containing ignorePath, such as those of the agent itself, are not
+   * recorded.
+   */
+  constructor(
+    readonly maxFrames: number,
+    readonly maxPending: number,
+    readonly maxStacks: number,
+    readonly ignorePath: string
+  ) {
+    this.durations = new StackDurations('io', maxStacks);
+  }
+
+  /**
+   * Starts recording I/O operations.
+   */
+  start() {
+    if (this.hook) {
+      return;
+    }
+    this.durations.reset();
+    const init = (asyncId: number, type: string) => {
+      const kind = IO_RESOURCE_TYPES[type];
+      if (kind) {
+        this.begin(asyncId, kind, init);
+      }
+    };
+    this.hook = asyncHooks.createHook({
+      init,
+      before: (asyncId: number) => this.end(asyncId),
+      destroy: (asyncId: number) => this.end(asyncId),
+    });
+    this.hook.enable();
+
+    this.requestStart = diagnosticsChannel(HTTP_REQUEST_START_CHANNEL);
+    this.responseFinish = diagnosticsChannel(HTTP_RESPONSE_FINISH_CHANNEL);
+    if (this.requestStart && this.responseFinish) {
+      this.requestStart.subscribe(this.onRequestStart);
+      this.responseFinish.subscribe(this.onResponseFinish);
+    }
+  }
+
+  /**
+   * Stops recording I/O operations.
+   *
+   * @return profile of the time spent waiting for the operations which
+   * completed while recording, with sample types io_operations/count and
+   * io_wait/nanoseconds, and an "io" label holding the kind of I/O: fs,
+   * dns, net or http.
+   */
+  stop(): perftools.profiles.IProfile {
+    if (this.hook) {
+      this.hook.disable();
+      this.hook = undefined;
+    }
+    if (this.requestStart && this.responseFinish) {
+      this.requestStart.unsubscribe(this.onRequestStart);
+      this.responseFinish.unsubscribe(this.onResponseFinish);
+    }
+    this.pending.clear();
+    return this.durations.profile('io_operations', 'io_wait');
+  }
+
+  private onRequestStart = (message: {request?: object}) => {
+    if (message.request) {
+      const op = this.operation('http', this.onRequestStart);
+      if (op) {
+        this.pendingRequests.set(message.request, op);
+      }
+    }
+  };
+
+  private onResponseFinish = (message: {request?: object}) => {
+    const op = message.request && this.pendingRequests.get(message.request);
+    if (op) {
+      this.pendingRequests.delete(message.request!);
+      this.record(op);
+    }
+  };
+
+  // eslint-disable-next-line @typescript-eslint/ban-types
+  private begin(asyncId: number, kind: string, below: Function) {
+    if (this.pending.size >= this.maxPending) {
+      return;
+    }
+    const op = this.operation(kind, below);
+    if (op) {
+      this.pending.set(asyncId, op);
+    }
+  }
+
+  /**
+   * @return an operation of kind started by the caller of below, or
+   * undefined if the operation was started by the agent.
+   */
+  private operation(
+    kind: string,
+    // eslint-disable-next-line @typescript-eslint/ban-types
+    below: Function
+  ): PendingOperation | undefined {
+    const frames = captureStack(this.maxFrames, below);
+    if (
+      this.ignorePath &&
+      frames.some(f => f.filename.indexOf(this.ignorePath) >= 0)
+    ) {
+      return undefined;
+    }
+    return {kind, frames, startNanos: nowNanos()};
+  }
+
+  private end(asyncId: number) {
+    const op = this.pending.get(asyncId);
+    if (op) {
+      this.pending.delete(asyncId);
+      this.record(op);
+    }
+  }
+
+  private record(op: PendingOperation) {
+    this.durations.add(op.kind, op.frames, nowNanos() - op.startNanos);
+  }
+}
@@ -0,0 +1,152 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+import {summarizeByStack} from './heap-delta';
+import {ProfileBuilder} from './profile-builder';
+import {Frame} from './profile-utils';
+
+const MILLIS_PER_HOUR = 60 * 60 * 1000;
+
+/**
+ * Growth of the live bytes allocated at one stack across heap profiles.
+ */
+export interface LeakTrend {
+  // Stack of the allocation site, leaf first.
+  frames: Frame[];
+  // Slope of the least-squares fit of live bytes over time.
+  bytesPerHour: number;
+  // Live bytes in the most recent heap profile.
+  latestBytes: number;
+  // Number of heap profiles over which the trend was fit.
+  points: number;
+}
+
+interface Series {
+  frames: Frame[];
+  times: number[];
+  bytes: number[];
+}
+
+/**
+ * @return slope of the least-squares line through (xs[i], ys[i]).
+ */
+export function slope(xs: number[], ys: number[]): number {
+  const n = xs.length;
+  let sumX = 0;
+  let sumY = 0;
+  for (let i = 0; i < n; i++) {
+    sumX += xs[i];
+    sumY += ys[i];
+  }
+  const meanX = sumX / n;
+  const meanY = sumY / n;
+  let num = 0;
+  let den = 0;
+  for (let i = 0; i < n; i++) {
+    num += (xs[i] - meanX) * (ys[i] - meanY);
+    den += (xs[i] - meanX) * (xs[i] - meanX);
+  }
+  return den === 0 ? 0 : num / den;
+}
+
+/**
+ * Keeps a bounded time series of the live bytes at each allocation site
+ * across heap profiles, and finds the sites whose live bytes are growing
+ * monotonically.
+ *
+ * At most maxSites sites, those with the most live bytes in the latest heap
+ * profile, and the latest maxPoints profiles of each site are kept.
+ */
+export class LeakDetector {
+  private series = new Map<string, Series>();
+
+  constructor(
+    readonly maxSites: number,
+    readonly maxPoints: number,
+    readonly minPoints: number
+  ) {}
+
+  /**
+   * Adds the live bytes of each stack of the heap profile p, collected at
+   * timeMillis, to the time series.
+   */
+  record(p: perftools.profiles.IProfile, timeMillis = Date.now()) {
+    const sites = Array.from(summarizeByStack(p).entries())
+      .sort((a, b) => b[1].bytes - a[1].bytes)
+      .slice(0, this.maxSites);
+    const series = new Map<string, Series>();
+    for (const [key, {frames, bytes}] of sites) {
+      const s = this.series.get(key) || {frames, times: [], bytes: []};
+      s.times.push(timeMillis);
+      s.bytes.push(bytes);
+      if (s.times.length > this.maxPoints) {
+        s.times.shift();
+        s.bytes.shift();
+      }
+      series.set(key, s);
+    }
+    this.series = series;
+  }
+
+  /**
+   * @return the sites whose live bytes never decreased over at least
+   * minPoints heap profiles and grew overall, ordered by decreasing growth
+   * rate.
+   */
+  trends(): LeakTrend[] {
+    const trends: LeakTrend[] = [];
+    for (const s of this.series.values()) {
+      const n = s.bytes.length;
+      if (n < this.minPoints || s.bytes[n - 1] <= s.bytes[0]) {
+        continue;
+      }
+      let monotonic = true;
+      for (let i = 1; i < n && monotonic; i++) {
+        monotonic = s.bytes[i] >= s.bytes[i - 1];
+      }
+      if (!monotonic) {
+        continue;
+      }
+      const hours = s.times.map(t => (t - s.times[0]) / MILLIS_PER_HOUR);
+      trends.push({
+        frames: s.frames,
+        bytesPerHour: slope(hours, s.bytes),
+        latestBytes: s.bytes[n - 1],
+        points: n,
+      });
+    }
+    return trends.sort((a, b) => b.bytesPerHour - a.bytesPerHour);
+  }
+
+  /**
+   * @return a profile with one sample per growing site, whose value is the
+   * growth rate of the site in bytes per hour.
+   */
+  trendProfile(): perftools.profiles.IProfile {
+    const builder = ProfileBuilder.create([
+      {type: 'space_growth', unit: 'bytes_per_hour'},
+      {type: 'space', unit: 'bytes'},
+    ]);
+    for (const t of this.trends()) {
+      builder.addSample(
+        t.frames,
+        [Math.round(t.bytesPerHour), t.latestBytes],
+        {points: t.points}
+      );
+    }
+    builder.profile.timeNanos = Date.now() * 1e6;
+    return builder.profile;
+  }
+}
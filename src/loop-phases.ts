@@ -0,0 +1,151 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as asyncHooks from 'async_hooks';
+
+import {nowNanos} from './stack-capture';
+
+/**
+ * Phases of the event loop to which LoopPhaseTracker attributes callbacks.
+ * Callbacks of close handlers run in the context of the handle closed, so
+ * they are attributed to poll, as are those of all other I/O. Callbacks
+ * passed to process.nextTick() run along with promise continuations, and
+ * are attributed to microtasks.
+ */
+export const LOOP_PHASES = ['timers', 'poll', 'check', 'microtasks'];
+
+/**
+ * Time spent running callbacks in each phase of the event loop.
+ */
+export interface LoopPhaseTimes {
+  // Time, in ns, spent running callbacks of each of LOOP_PHASES.
+  phaseNanos: {[phase: string]: number};
+  // Time, in ns, over which callbacks were timed.
+  durationNanos: number;
+}
+
+/**
+ * @return description of times, such as "loop phases: timers=1.200ms,
+ * poll=30.000ms, check=0.000ms, microtasks=4.500ms, outside
+ * callbacks=964.300ms".
+ */
+export function formatLoopPhases(times: LoopPhaseTimes): string {
+  let inCallbacks = 0;
+  const phases = LOOP_PHASES.map(phase => {
+    const nanos = times.phaseNanos[phase] || 0;
+    inCallbacks += nanos;
+    return `${phase}=${(nanos / 1e6).toFixed(3)}ms`;
+  });
+  const outside = Math.max(0, times.durationNanos - inCallbacks);
+  phases.push(`outside callbacks=${(outside / 1e6).toFixed(3)}ms`);
+  return `loop phases: ${phases.join(', ')}`;
+}
+
+/**
+ * Times the callbacks run by the event loop, and attributes each to the
+ * phase of the loop which ran it, based on the type of its async resource.
+ * Only the outermost callback is timed when callbacks are nested.
+ *
+ * Requires async_hooks.executionAsyncResource(), available in Node 12.17
+ * and later; nothing is recorded otherwise.
+ */
+export class LoopPhaseTracker {
+  private hook: asyncHooks.AsyncHook | undefined;
+  private tickObjects = new WeakSet<object>();
+  private depth = 0;
+  private phase = '';
+  private callbackStartNanos = 0;
+  private phaseNanos: {[phase: string]: number} = {};
+  private startNanos = 0;
+
+  /**
+   * Starts timing callbacks.
+   */
+  start() {
+    if (this.hook || typeof asyncHooks.executionAsyncResource !== 'function') {
+      return;
+    }
+    this.depth = 0;
+    this.phaseNanos = {};
+    this.startNanos = nowNanos();
+    this.hook = asyncHooks.createHook({
+      init: (
+        asyncId: number,
+        type: string,
+        triggerAsyncId: number,
+        resource: object
+      ) => {
+        if (type === 'TickObject') {
+          this.tickObjects.add(resource);
+        }
+      },
+      before: () => this.before(),
+      after: () => this.after(),
+    });
+    this.hook.enable();
+  }
+
+  /**
+   * Stops timing callbacks.
+   *
+   * @return time spent running callbacks in each phase since start() was
+   * called.
+   */
+  stop(): LoopPhaseTimes {
+    if (this.hook) {
+      this.hook.disable();
+      this.hook = undefined;
+    }
+    const durationNanos = this.startNanos ? nowNanos() - this.startNanos : 0;
+    const times = {phaseNanos: this.phaseNanos, durationNanos};
+    this.phaseNanos = {};
+    this.startNanos = 0;
+    return times;
+  }
+
+  private before() {
+    if (this.depth++ > 0) {
+      return;
+    }
+    this.phase = this.phaseOf(asyncHooks.executionAsyncResource());
+    this.callbackStartNanos = nowNanos();
+  }
+
+  private after() {
+    if (this.depth === 0 || --this.depth > 0) {
+      return;
+    }
+    const nanos = nowNanos() - this.callbackStartNanos;
+    this.phaseNanos[this.phase] = (this.phaseNanos[this.phase] || 0) + nanos;
+  }
+
+  private phaseOf(resource: object | undefined): string {
+    if (!resource) {
+      return 'poll';
+    }
+    if (resource instanceof Promise || this.tickObjects.has(resource)) {
+      return 'microtasks';
+    }
+    switch (resource.constructor && resource.constructor.name) {
+      case 'Timeout':
+        return 'timers';
+      case 'Immediate':
+        return 'check';
+      case 'PromiseWrap':
+        return 'microtasks';
+      default:
+        return 'poll';
+    }
+  }
+}
@@ -0,0 +1,306 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+import * as path from 'path';
+
+import {perftools} from '../protos/profile';
+import {
+  addComment,
+  addSyntheticLocation,
+  copyProfile,
+  removeUnreferenced,
+} from './profile-utils';
+import {AllocationProfileNode} from './v8-types';
+
+export const OVER_BUDGET_FRAME = '(over memory budget)';
+
+// cgroup v1 reports a limit close to 2^63 when no limit is set.
+const UNLIMITED_V1_BYTES = 2 ** 62;
+
+/**
+ * Memory limit and usage of the cgroup of this process.
+ */
+export interface CgroupMemory {
+  limitBytes: number;
+  usageBytes: number;
+}
+
+function readNumber(file: string): number | undefined {
+  let contents: string;
+  try {
+    contents = fs.readFileSync(file, 'utf8').trim();
+  } catch (e) {
+    return undefined;
+  }
+  if (contents === 'max') {
+    return Infinity;
+  }
+  const n = Number(contents);
+  return isNaN(n) ? undefined : n;
+}
+
+/**
+ * @return the memory limit and usage of the cgroup of this process, read from
+ * the cgroup v2 or, failing that, the cgroup v1 memory controller mounted at
+ * root. Returns undefined when neither can be read or when no limit is set.
+ */
+export function readCgroupMemory(
+  root = '/sys/fs/cgroup'
+): CgroupMemory | undefined {
+  let limitBytes = readNumber(path.join(root, 'memory.max'));
+  let usageBytes = readNumber(path.join(root, 'memory.current'));
+  if (limitBytes === undefined || usageBytes === undefined) {
+    const v1 = path.join(root, 'memory');
+    limitBytes = readNumber(path.join(v1, 'memory.limit_in_bytes'));
+    usageBytes = readNumber(path.join(v1, 'memory.usage_in_bytes'));
+  }
+  if (
+    limitBytes === undefined ||
+    usageBytes === undefined ||
+    limitBytes === Infinity ||
+    limitBytes >= UNLIMITED_V1_BYTES
+  ) {
+    return undefined;
+  }
+  return {limitBytes, usageBytes};
+}
+
+// Rough per-entry sizes, in bytes, of the JavaScript objects holding a
+// profile and of their encoded form.
+const SAMPLE_BYTES = 96;
+const ENTRY_BYTES = 16;
+const LOCATION_BYTES = 128;
+const FUNCTION_BYTES = 96;
+const STRING_BYTES = 48;
+
+function sampleBytes(s: perftools.profiles.ISample): number {
+  return (
+    SAMPLE_BYTES +
+    ENTRY_BYTES *
+      ((s.locationId || []).length +
+        (s.value || []).length +
+        (s.label || []).length)
+  );
+}
+
+/**
+ * @return estimate of the memory, in bytes, needed to hold p and to encode
+ * it.
+ */
+export function estimateProfileBytes(p: perftools.profiles.IProfile): number {
+  let bytes = 0;
+  for (const s of p.sample || []) {
+    bytes += sampleBytes(s);
+  }
+  bytes += LOCATION_BYTES * (p.location || []).length;
+  bytes += FUNCTION_BYTES * (p.function || []).length;
+  for (const s of p.stringTable || []) {
+    bytes += STRING_BYTES + 2 * s.length;
+  }
+  return bytes;
+}
+
+/**
+ * When the estimated size of p exceeds budgetBytes, keeps the samples with
+ * the largest values (as measured by the sample type at index valueIdx, the
+ * last sample type by default) which fit within the budget, and aggregates
+ * the values of all other samples into a single sample with the frame
+ * "(over memory budget)".
+ *
+ * @return p when it fits within the budget or budgetBytes is 0, and the
+ * pruned profile otherwise.
+ */
+export function fitToBudget(
+  p: perftools.profiles.IProfile,
+  budgetBytes: number,
+  valueIdx?: number
+): perftools.profiles.IProfile {
+  if (!budgetBytes || estimateProfileBytes(p) <= budgetBytes) {
+    return p;
+  }
+  const numTypes = (p.sampleType || []).length;
+  const idx = valueIdx === undefined ? numTypes - 1 : valueIdx;
+  const samples = (p.sample || []).slice();
+  samples.sort(
+    (a, b) =>
+      Number((b.value || [])[idx] || 0) - Number((a.value || [])[idx] || 0)
+  );
+
+  // Strings are kept, and locations and functions are charged as they
+  // are first referenced by a kept sample.
+  let used = estimateProfileBytes({stringTable: p.stringTable});
+  const charged = new Set<number>();
+  const kept: perftools.profiles.ISample[] = [];
+  const dropped = new Array(numTypes).fill(0);
+  let numDropped = 0;
+  for (const s of samples) {
+    const newLocations = (s.locationId || [])
+      .map(Number)
+      .filter(id => !charged.has(id));
+    const cost =
+      sampleBytes(s) + newLocations.length * (LOCATION_BYTES + FUNCTION_BYTES);
+    if (used + cost <= budgetBytes) {
+      used += cost;
+      newLocations.forEach(id => charged.add(id));
+      kept.push(s);
+    } else {
+      numDropped++;
+      (s.value || []).forEach((v, i) => {
+        dropped[i] += Number(v);
+      });
+    }
+  }
+
+  const pruned = copyProfile(p);
+  pruned.sample = kept;
+  removeUnreferenced(pruned);
+  const locationId = addSyntheticLocation(pruned, OVER_BUDGET_FRAME);
+  pruned.sample.push(
+    new perftools.profiles.Sample({locationId: [locationId], value: dropped})
+  );
+  addComment(
+    pruned,
+    `${numDropped} samples aggregated to fit memory budget of ` +
+      `${budgetBytes} bytes`
+  );
+  return pruned;
+}
+
+/**
+ * @return estimate of the memory, in bytes, needed to hold and encode the
+ * location, function and samples serialized from node, at depth in its tree.
+ */
+function nodeBytes(node: AllocationProfileNode, depth: number): number {
+  return (
+    LOCATION_BYTES +
+    FUNCTION_BYTES +
+    STRING_BYTES +
+    2 * (node.name || '').length +
+    node.allocations.length * (SAMPLE_BYTES + ENTRY_BYTES * (depth + 2))
+  );
+}
+
+/**
+ * @return estimate of the memory, in bytes, needed to hold and encode the
+ * heap profile serialized from the allocation tree under root.
+ */
+export function estimateTreeBytes(root: AllocationProfileNode): number {
+  let bytes = 0;
+  const stack: Array<[AllocationProfileNode, number]> = [[root, 0]];
+  while (stack.length > 0) {
+    const [node, depth] = stack.pop()!;
+    bytes += nodeBytes(node, depth);
+    for (const child of node.children as AllocationProfileNode[]) {
+      stack.push([child, depth + 1]);
+    }
+  }
+  return bytes;
+}
+
+interface TreeEntry {
+  node: AllocationProfileNode;
+  depth: number;
+  // Index of the entry of the parent of node, or -1 for the root.
+  parent: number;
+  // Bytes allocated by node and its descendants.
+  bytes: number;
+}
+
+/**
+ * When the estimated size of the heap profile which would be serialized from
+ * the allocation tree under root exceeds budgetBytes, keeps the nodes whose
+ * subtrees allocated the most bytes which fit within the budget, along with
+ * their ancestors, and aggregates the allocations of all other nodes into a
+ * single "(over memory budget)" child of root.
+ *
+ * Only the tree returned by V8 is walked, so that the memory needed by a
+ * profile which exceeds the budget is never allocated.
+ *
+ * @return root when it fits within the budget or budgetBytes is 0, and a
+ * pruned copy of the tree otherwise, with the number of nodes whose
+ * allocations were aggregated.
+ */
+export function fitTreeToBudget(
+  root: AllocationProfileNode,
+  budgetBytes: number
+): {root: AllocationProfileNode; aggregatedNodes: number} {
+  if (!budgetBytes || estimateTreeBytes(root) <= budgetBytes) {
+    return {root, aggregatedNodes: 0};
+  }
+
+  // Parents are listed before their children.
+  const entries: TreeEntry[] = [];
+  const stack = [{node: root, depth: 0, parent: -1}];
+  while (stack.length > 0) {
+    const e = stack.pop()!;
+    const idx = entries.length;
+    const bytes = e.node.allocations.reduce(
+      (total, a) => total + a.sizeBytes * a.count,
+      0
+    );
+    entries.push({...e, bytes});
+    for (const child of e.node.children as AllocationProfileNode[]) {
+      stack.push({node: child, depth: e.depth + 1, parent: idx});
+    }
+  }
+  for (let i = entries.length - 1; i > 0; i--) {
+    entries[entries[i].parent].bytes += entries[i].bytes;
+  }
+  // A node never allocated more than its parent, so parents are considered
+  // before their children.
+  const order = entries.map((e, i) => i).slice(1);
+  order.sort(
+    (a, b) =>
+      entries[b].bytes - entries[a].bytes || entries[a].depth - entries[b].depth
+  );
+
+  const overBudget: AllocationProfileNode = {
+    name: OVER_BUDGET_FRAME,
+    scriptName: '',
+    children: [],
+    allocations: [],
+  };
+  const copies: Array<AllocationProfileNode | undefined> = [
+    {...root, children: [overBudget]},
+  ];
+  let used = nodeBytes(root, 0) + nodeBytes(overBudget, 1);
+  const aggregated = new Map<number, number>();
+  let aggregatedNodes = 0;
+  for (const i of order) {
+    const {node, depth, parent} = entries[i];
+    const parentCopy = copies[parent];
+    const cost = nodeBytes(node, depth);
+    if (parentCopy && used + cost <= budgetBytes) {
+      used += cost;
+      const copy: AllocationProfileNode = {...node, children: []};
+      parentCopy.children.push(copy);
+      copies[i] = copy;
+      continue;
+    }
+    aggregatedNodes++;
+    for (const a of node.allocations) {
+      const count = aggregated.get(a.sizeBytes);
+      if (count === undefined) {
+        // Each distinct size becomes a sample of the over budget node.
+        used += SAMPLE_BYTES + ENTRY_BYTES * 3;
+      }
+      aggregated.set(a.sizeBytes, (count || 0) + a.count);
+    }
+  }
+  for (const [sizeBytes, count] of aggregated) {
+    overBudget.allocations.push({sizeBytes, count});
+  }
+  return {root: copies[0]!, aggregatedNodes};
+}
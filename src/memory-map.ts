@@ -0,0 +1,205 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+import * as v8 from 'v8';
+
+import {perftools} from '../protos/profile';
+import {ProfileBuilder} from './profile-builder';
+import {addComment} from './profile-utils';
+
+/**
+ * Resident size of one mapping of /proc/self/smaps.
+ */
+export interface Mapping {
+  // Path of the mapped file, a pseudo-path such as "[heap]" or "[stack]", or
+  // '' for anonymous memory.
+  pathname: string;
+  rssBytes: number;
+}
+
+/**
+ * Sizes, in bytes, of the memory of this process.
+ */
+export interface MemorySnapshot {
+  rssBytes: number;
+  // Memory of objects outside the V8 heap which are referenced from
+  // JavaScript, such as ArrayBuffers.
+  externalBytes: number;
+  heapSpaces: Array<{name: string; usedBytes: number; physicalBytes: number}>;
+  // Sizes from v8.getHeapCodeStatistics(), when available.
+  code?: {[name: string]: number};
+  // Mappings of /proc/self/smaps, when it can be read.
+  mappings?: Mapping[];
+}
+
+/**
+ * @return the mappings of contents, the contents of an smaps file.
+ */
+export function parseSmaps(contents: string): Mapping[] {
+  const mappings: Mapping[] = [];
+  for (const line of contents.split('\n')) {
+    if (/^[0-9a-f]+-[0-9a-f]+ /.test(line)) {
+      // Fields are address, permissions, offset, device, inode and an
+      // optional path, which may contain spaces.
+      const pathname = line.split(/\s+/).slice(5).join(' ').trim();
+      mappings.push({pathname, rssBytes: 0});
+      continue;
+    }
+    const rss = /^Rss:\s+(\d+) kB/.exec(line);
+    if (rss && mappings.length > 0) {
+      mappings[mappings.length - 1].rssBytes = Number(rss[1]) * 1024;
+    }
+  }
+  return mappings;
+}
+
+/**
+ * @return sizes of the memory of this process, including its mappings when
+ * smapsFile can be read.
+ */
+export function readMemorySnapshot(
+  smapsFile = '/proc/self/smaps'
+): MemorySnapshot {
+  const {rss, external} = process.memoryUsage();
+  const snapshot: MemorySnapshot = {
+    rssBytes: rss,
+    externalBytes: external,
+    heapSpaces: v8.getHeapSpaceStatistics().map(s => ({
+      name: s.space_name,
+      usedBytes: s.space_used_size,
+      physicalBytes: s.physical_space_size,
+    })),
+  };
+  if (typeof v8.getHeapCodeStatistics === 'function') {
+    const code = v8.getHeapCodeStatistics();
+    snapshot.code = {
+      code_and_metadata: code.code_and_metadata_size,
+      bytecode_and_metadata: code.bytecode_and_metadata_size,
+      external_script_source: code.external_script_source_size,
+    };
+  }
+  try {
+    snapshot.mappings = parseSmaps(fs.readFileSync(smapsFile, 'utf8'));
+  } catch (e) {
+    // Not available on this platform.
+  }
+  return snapshot;
+}
+
+/**
+ * Removes up to bytes from the values of sizes, in order, and returns the
+ * bytes which could not be removed.
+ */
+function subtract(
+  sizes: Map<string, number>,
+  keys: string[],
+  bytes: number
+): number {
+  for (const key of keys) {
+    const removed = Math.min(bytes, sizes.get(key) || 0);
+    sizes.set(key, (sizes.get(key) || 0) - removed);
+    bytes -= removed;
+  }
+  return bytes;
+}
+
+/**
+ * Converts snapshot to a profile with sample type space/bytes, whose
+ * synthetic stacks break the resident memory of the process down by
+ * category:
+ *
+ * - "V8 heap", then the heap space, then "used" or "unused";
+ * - "external", memory outside the V8 heap referenced from JavaScript;
+ * - "native", then "malloc heap" ([heap]), "stack" or "anonymous", holding
+ *   anonymous memory other than the V8 heap and external memory;
+ * - "file-backed", then the path of the mapped file, for at most maxFiles
+ *   files with the largest resident size, and "(other files)".
+ *
+ * The V8 heap is assumed to be in anonymous mappings, and external memory in
+ * the malloc heap or, failing that, anonymous mappings. When the mappings
+ * are not available, the rest of the resident size is attributed to
+ * "native", "unattributed". Code statistics, which overlap the V8 heap, are
+ * added as a comment.
+ */
+export function memoryMapProfile(
+  snapshot: MemorySnapshot,
+  maxFiles: number
+): perftools.profiles.IProfile {
+  const builder = ProfileBuilder.create([{type: 'space', unit: 'bytes'}]);
+  const add = (stack: string[], bytes: number) => {
+    if (bytes > 0) {
+      const frames = stack.map(name => ({name, filename: '', line: 0}));
+      builder.addSample(frames.reverse(), [Math.round(bytes)]);
+    }
+  };
+
+  let heapBytes = 0;
+  for (const s of snapshot.heapSpaces) {
+    add(['V8 heap', s.name, 'used'], Math.min(s.usedBytes, s.physicalBytes));
+    add(['V8 heap', s.name, 'unused'], s.physicalBytes - s.usedBytes);
+    heapBytes += s.physicalBytes;
+  }
+  add(['external'], snapshot.externalBytes);
+
+  if (snapshot.mappings) {
+    const native = new Map<string, number>([
+      ['malloc heap', 0],
+      ['stack', 0],
+      ['anonymous', 0],
+    ]);
+    const files = new Map<string, number>();
+    for (const m of snapshot.mappings) {
+      if (m.pathname === '[heap]') {
+        native.set('malloc heap', native.get('malloc heap')! + m.rssBytes);
+      } else if (m.pathname.startsWith('[stack')) {
+        native.set('stack', native.get('stack')! + m.rssBytes);
+      } else if (m.pathname === '' || m.pathname.startsWith('[')) {
+        native.set('anonymous', native.get('anonymous')! + m.rssBytes);
+      } else {
+        files.set(m.pathname, (files.get(m.pathname) || 0) + m.rssBytes);
+      }
+    }
+    subtract(native, ['anonymous', 'malloc heap'], heapBytes);
+    subtract(native, ['malloc heap', 'anonymous'], snapshot.externalBytes);
+    for (const [name, bytes] of native) {
+      add(['native', name], bytes);
+    }
+
+    const bySize = [...files].sort((a, b) => b[1] - a[1]);
+    for (const [pathname, bytes] of bySize.slice(0, maxFiles)) {
+      add(['file-backed', pathname], bytes);
+    }
+    let otherBytes = 0;
+    for (const [, bytes] of bySize.slice(maxFiles)) {
+      otherBytes += bytes;
+    }
+    add(['file-backed', '(other files)'], otherBytes);
+  } else {
+    add(
+      ['native', 'unattributed'],
+      snapshot.rssBytes - heapBytes - snapshot.externalBytes
+    );
+  }
+
+  const p = builder.profile;
+  p.timeNanos = Date.now() * 1e6;
+  if (snapshot.code) {
+    const code = Object.keys(snapshot.code).map(
+      name => `${name}=${snapshot.code![name]}`
+    );
+    addComment(p, `V8 code statistics, in bytes: ${code.join(', ')}`);
+  }
+  return p;
+}
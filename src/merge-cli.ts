@@ -0,0 +1,77 @@
+#!/usr/bin/env node
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {decodeProfile, ProfileMerger} from './merge';
+
+const USAGE = `
+Usage: cloud-profiler-merge [--max-samples N] -o OUTPUT PROFILE...
+
+Merges pprof profiles of the same type, such as those written by startLocal()
+to localProfileDir, into one gzipped profile written to OUTPUT.
+`.trim();
+
+/**
+ * Runs the command with command line arguments args.
+ *
+ * @return exit code of the command.
+ */
+export function main(
+  args: string[],
+  log: (message: string) => void = console.error
+): number {
+  let output = '';
+  let maxSamples = 0;
+  const inputs: string[] = [];
+  for (let i = 0; i < args.length; i++) {
+    switch (args[i]) {
+      case '-o':
+        output = args[++i] || '';
+        break;
+      case '--max-samples':
+        maxSamples = Number(args[++i]);
+        break;
+      default:
+        inputs.push(args[i]);
+    }
+  }
+  if (!output || inputs.length === 0 || !(maxSamples >= 0)) {
+    log(USAGE);
+    return 2;
+  }
+
+  // Profiles are read and merged one at a time, so that only the merged
+  // profile is held in memory.
+  const merger = new ProfileMerger(maxSamples);
+  for (const input of inputs) {
+    try {
+      merger.add(decodeProfile(fs.readFileSync(input)));
+    } catch (err) {
+      log(`Failed to merge ${input}: ${err}`);
+      return 1;
+    }
+  }
+  const buffer = perftools.profiles.Profile.encode(merger.profile()).finish();
+  fs.writeFileSync(output, zlib.gzipSync(buffer));
+  log(`Merged ${merger.merged()} profiles into ${output}.`);
+  return 0;
+}
+
+if (require.main === module) {
+  process.exitCode = main(process.argv.slice(2));
+}
@@ -0,0 +1,323 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {getString, NumberOrLong} from './profile-utils';
+
+export const MERGE_OVERFLOW_FRAME = '(merge overflow)';
+
+interface MergedSample {
+  locationId: number[];
+  value: number[];
+  label: perftools.profiles.ILabel[];
+}
+
+/**
+ * Merges profiles of the same sample types, one at a time, into a single
+ * profile. Strings, mappings, functions, locations and samples which are
+ * equal in different profiles are stored once, and the values of equal
+ * samples are summed, so memory use depends on the number of distinct
+ * entries rather than on the number of profiles merged.
+ *
+ * At most maxSamples distinct samples are kept; the values of samples which
+ * would exceed this are added to a single "(merge overflow)" sample. When
+ * maxSamples is 0, the number of samples is not bounded.
+ */
+export class ProfileMerger {
+  private out: perftools.profiles.IProfile = {
+    sampleType: [],
+    sample: [],
+    mapping: [],
+    location: [],
+    function: [],
+    stringTable: [''],
+    comment: [],
+  };
+  private strings = new Map<string, number>([['', 0]]);
+  private mappings = new Map<string, number>();
+  private functions = new Map<string, number>();
+  private locations = new Map<string, number>();
+  private samples = new Map<string, MergedSample>();
+  private sampleTypesKey: string | undefined;
+  private endNanos = 0;
+  private count = 0;
+
+  constructor(readonly maxSamples = 0) {}
+
+  /**
+   * @return number of profiles merged so far.
+   */
+  merged(): number {
+    return this.count;
+  }
+
+  /**
+   * Adds the samples of p to the merged profile.
+   *
+   * @throws error when the sample types of p differ from those of the
+   * profiles merged before it.
+   */
+  add(p: perftools.profiles.IProfile) {
+    const str = (idx: NumberOrLong) => this.string(getString(p, idx));
+    const key = (p.sampleType || [])
+      .map(t => `${getString(p, t.type)}/${getString(p, t.unit)}`)
+      .join(',');
+    if (this.sampleTypesKey === undefined) {
+      this.sampleTypesKey = key;
+      this.out.sampleType = (p.sampleType || []).map(t => ({
+        type: str(t.type),
+        unit: str(t.unit),
+      }));
+      if (p.periodType) {
+        this.out.periodType = {
+          type: str(p.periodType.type),
+          unit: str(p.periodType.unit),
+        };
+        this.out.period = p.period;
+      }
+      if (p.defaultSampleType) {
+        this.out.defaultSampleType = str(p.defaultSampleType);
+      }
+    } else if (key !== this.sampleTypesKey) {
+      throw new Error(
+        `Cannot merge profile with sample types ${key} into profile with ` +
+          `sample types ${this.sampleTypesKey}.`
+      );
+    }
+    this.count++;
+
+    const startNanos = Number(p.timeNanos || 0);
+    if (startNanos > 0) {
+      const prevStart = Number(this.out.timeNanos || 0);
+      if (prevStart === 0 || startNanos < prevStart) {
+        this.out.timeNanos = startNanos;
+      }
+      const end = startNanos + Number(p.durationNanos || 0);
+      this.endNanos = Math.max(this.endNanos, end);
+      this.out.durationNanos = this.endNanos - Number(this.out.timeNanos);
+    }
+    for (const c of p.comment || []) {
+      const idx = str(c);
+      if (this.out.comment!.indexOf(idx) < 0) {
+        this.out.comment!.push(idx);
+      }
+    }
+
+    const mappingIds = new Map<number, number>();
+    for (const m of p.mapping || []) {
+      mappingIds.set(Number(m.id), this.mappingId(m, str));
+    }
+    const functionIds = new Map<number, number>();
+    for (const f of p.function || []) {
+      functionIds.set(
+        Number(f.id),
+        this.functionId(
+          str(f.name),
+          str(f.systemName),
+          str(f.filename),
+          Number(f.startLine || 0)
+        )
+      );
+    }
+    const locationIds = new Map<number, number>();
+    for (const loc of p.location || []) {
+      locationIds.set(
+        Number(loc.id),
+        this.locationId(
+          mappingIds.get(Number(loc.mappingId)) || 0,
+          Number(loc.address || 0),
+          (loc.line || []).map(l => ({
+            functionId: functionIds.get(Number(l.functionId)) || 0,
+            line: Number(l.line || 0),
+          }))
+        )
+      );
+    }
+
+    for (const s of p.sample || []) {
+      this.addSample(
+        (s.locationId || []).map(id => locationIds.get(Number(id)) || 0),
+        (s.value || []).map(Number),
+        (s.label || []).map(l => ({
+          key: str(l.key),
+          str: l.str ? str(l.str) : 0,
+          num: Number(l.num || 0),
+          numUnit: l.numUnit ? str(l.numUnit) : 0,
+        }))
+      );
+    }
+  }
+
+  /**
+   * @return the merged profile.
+   */
+  profile(): perftools.profiles.IProfile {
+    this.out.sample = Array.from(this.samples.values()).map(
+      s => new perftools.profiles.Sample(s)
+    );
+    return this.out;
+  }
+
+  private string(s: string): number {
+    let idx = this.strings.get(s);
+    if (idx === undefined) {
+      idx = this.out.stringTable!.length;
+      this.out.stringTable!.push(s);
+      this.strings.set(s, idx);
+    }
+    return idx;
+  }
+
+  private mappingId(
+    m: perftools.profiles.IMapping,
+    str: (idx: NumberOrLong) => number
+  ): number {
+    const filename = str(m.filename);
+    const buildId = str(m.buildId);
+    const key = [
+      filename,
+      buildId,
+      Number(m.memoryStart || 0),
+      Number(m.memoryLimit || 0),
+      Number(m.fileOffset || 0),
+    ].join(',');
+    let id = this.mappings.get(key);
+    if (id === undefined) {
+      id = this.mappings.size + 1;
+      this.mappings.set(key, id);
+      this.out.mapping!.push(
+        new perftools.profiles.Mapping(
+          Object.assign({}, m, {id, filename, buildId})
+        )
+      );
+    }
+    return id;
+  }
+
+  private functionId(
+    name: number,
+    systemName: number,
+    filename: number,
+    startLine: number
+  ): number {
+    const key = `${name},${systemName},${filename},${startLine}`;
+    let id = this.functions.get(key);
+    if (id === undefined) {
+      id = this.functions.size + 1;
+      this.functions.set(key, id);
+      this.out.function!.push(
+        new perftools.profiles.Function({
+          id,
+          name,
+          systemName,
+          filename,
+          startLine,
+        })
+      );
+    }
+    return id;
+  }
+
+  private locationId(
+    mappingId: number,
+    address: number,
+    line: Array<{functionId: number; line: number}>
+  ): number {
+    const key =
+      `${mappingId};${address};` +
+      line.map(l => `${l.functionId}:${l.line}`).join(';');
+    let id = this.locations.get(key);
+    if (id === undefined) {
+      id = this.locations.size + 1;
+      this.locations.set(key, id);
+      this.out.location!.push(
+        new perftools.profiles.Location({id, mappingId, address, line})
+      );
+    }
+    return id;
+  }
+
+  private addSample(
+    locationId: number[],
+    value: number[],
+    label: perftools.profiles.ILabel[]
+  ) {
+    let key =
+      locationId.join(',') +
+      '|' +
+      label
+        .map(l => `${l.key}=${l.str}:${l.num}:${l.numUnit}`)
+        .sort()
+        .join(',');
+    let sample = this.samples.get(key);
+    if (
+      !sample &&
+      this.maxSamples > 0 &&
+      this.samples.size >= this.maxSamples
+    ) {
+      const name = this.string(MERGE_OVERFLOW_FRAME);
+      const overflow = this.locationId(0, 0, [
+        {functionId: this.functionId(name, name, 0, 0), line: 0},
+      ]);
+      locationId = [overflow];
+      label = [];
+      key = `${overflow}|`;
+      sample = this.samples.get(key);
+    }
+    if (sample) {
+      sample.value = sample.value.map((v, i) => v + (value[i] || 0));
+    } else {
+      this.samples.set(key, {locationId, value: value.slice(), label});
+    }
+  }
+}
+
+/**
+ * @return a single profile holding the samples of all of profiles, with at
+ * most maxSamples distinct samples as with ProfileMerger.
+ */
+export function mergeProfiles(
+  profiles: perftools.profiles.IProfile[],
+  maxSamples = 0
+): perftools.profiles.IProfile {
+  const merger = new ProfileMerger(maxSamples);
+  for (const p of profiles) {
+    merger.add(p);
+  }
+  return merger.profile();
+}
+
+/**
+ * @return the serialized profile in buffer, uncompressing it if it is
+ * gzipped.
+ */
+export function uncompressProfile(buffer: Buffer): Buffer {
+  return isGzipped(buffer) ? zlib.gunzipSync(buffer) : buffer;
+}
+
+/**
+ * @return true if buffer starts with the magic number of gzip.
+ */
+export function isGzipped(buffer: Buffer): boolean {
+  return buffer.length >= 2 && buffer[0] === 0x1f && buffer[1] === 0x8b;
+}
+
+/**
+ * @return the profile serialized in buffer, which may be gzipped.
+ */
+export function decodeProfile(buffer: Buffer): perftools.profiles.Profile {
+  return perftools.profiles.Profile.decode(uncompressProfile(buffer));
+}
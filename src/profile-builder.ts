@@ -0,0 +1,181 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+import {copyProfile, Frame, getString, stackKey} from './profile-utils';
+
+/**
+ * Type and unit of the values of a profile.
+ */
+export interface ValueType {
+  type: string;
+  unit: string;
+}
+
+/**
+ * Builds a profile from stacks of frames, adding the strings, functions and
+ * locations needed by each stack.
+ */
+export class ProfileBuilder {
+  readonly profile: perftools.profiles.IProfile;
+  private strings = new Map<string, number>();
+  private locations = new Map<string, number>();
+  private functions = new Map<string, number>();
+  private nextLocationId = 1;
+  private nextFunctionId = 1;
+
+  /**
+   * @param profile - profile to which samples are added. It is copied, so
+   * it is not modified. Its existing locations are reused.
+   */
+  constructor(profile: perftools.profiles.IProfile = {}) {
+    this.profile = copyProfile(profile);
+    const p = this.profile;
+    if (p.stringTable!.length === 0) {
+      p.stringTable!.push('');
+    }
+    p.stringTable!.forEach((s, i) => {
+      if (!this.strings.has(s)) {
+        this.strings.set(s, i);
+      }
+    });
+    for (const f of p.function!) {
+      const key = `${getString(p, f.name)}@${getString(p, f.filename)}`;
+      this.functions.set(key, Number(f.id));
+      this.nextFunctionId = Math.max(this.nextFunctionId, Number(f.id) + 1);
+    }
+    const functions = new Map<number, perftools.profiles.IFunction>();
+    for (const f of p.function!) {
+      functions.set(Number(f.id), f);
+    }
+    for (const loc of p.location!) {
+      const lines = loc.line || [];
+      const id = Number(loc.id);
+      this.nextLocationId = Math.max(this.nextLocationId, id + 1);
+      if (lines.length !== 1) {
+        continue;
+      }
+      const f = functions.get(Number(lines[0].functionId));
+      const frame = {
+        name: f ? getString(p, f.name) : '',
+        filename: f ? getString(p, f.filename) : '',
+        line: Number(lines[0].line || 0),
+      };
+      this.locations.set(stackKey([frame]), id);
+    }
+  }
+
+  /**
+   * @return builder for a new profile with the specified sample types.
+   */
+  static create(
+    sampleTypes: ValueType[],
+    periodType?: ValueType,
+    period?: number
+  ): ProfileBuilder {
+    const builder = new ProfileBuilder();
+    const p = builder.profile;
+    p.sampleType = sampleTypes.map(t => builder.valueType(t));
+    if (periodType) {
+      p.periodType = builder.valueType(periodType);
+      p.period = period;
+    }
+    return builder;
+  }
+
+  /**
+   * @return index of s in the string table.
+   */
+  string(s: string): number {
+    let idx = this.strings.get(s);
+    if (idx === undefined) {
+      idx = this.profile.stringTable!.length;
+      this.profile.stringTable!.push(s);
+      this.strings.set(s, idx);
+    }
+    return idx;
+  }
+
+  valueType(t: ValueType): perftools.profiles.ValueType {
+    return new perftools.profiles.ValueType({
+      type: this.string(t.type),
+      unit: this.string(t.unit),
+    });
+  }
+
+  /**
+   * @return ID of the location of frame, adding it if it is not present.
+   */
+  locationId(frame: Frame): number {
+    const key = stackKey([frame]);
+    let id = this.locations.get(key);
+    if (id === undefined) {
+      id = this.nextLocationId++;
+      this.locations.set(key, id);
+      this.profile.location!.push(
+        new perftools.profiles.Location({
+          id,
+          line: [{functionId: this.functionId(frame), line: frame.line}],
+        })
+      );
+    }
+    return id;
+  }
+
+  private functionId(frame: Frame): number {
+    const key = `${frame.name}@${frame.filename}`;
+    let id = this.functions.get(key);
+    if (id === undefined) {
+      id = this.nextFunctionId++;
+      this.functions.set(key, id);
+      const name = this.string(frame.name);
+      this.profile.function!.push(
+        new perftools.profiles.Function({
+          id,
+          name,
+          systemName: name,
+          filename: this.string(frame.filename),
+        })
+      );
+    }
+    return id;
+  }
+
+  /**
+   * Adds a sample.
+   *
+   * @param frames - stack of the sample, leaf first.
+   * @param values - one value per sample type.
+   * @param labels - string or numeric labels of the sample.
+   */
+  addSample(
+    frames: Frame[],
+    values: number[],
+    labels: {[key: string]: string | number} = {}
+  ) {
+    const label = Object.keys(labels).map(key => {
+      const v = labels[key];
+      return typeof v === 'number'
+        ? {key: this.string(key), num: v}
+        : {key: this.string(key), str: this.string(v)};
+    });
+    this.profile.sample!.push(
+      new perftools.profiles.Sample({
+        locationId: frames.map(f => this.locationId(f)),
+        value: values,
+        label,
+      })
+    );
+  }
+}
@@ -0,0 +1,251 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+
+/**
+ * Helpers for post-processing profiles returned by pprof before they are
+ * encoded and uploaded.
+ *
+ * Profiles returned by pprof (and the fixtures used in tests) may be frozen,
+ * so none of these helpers modify their input in place.
+ */
+
+// Numeric fields of profiles may be numbers or, once decoded, Longs.
+export type NumberOrLong = perftools.profiles.IFunction['id'];
+
+/**
+ * @return a copy of p in which the top-level repeated fields can be modified
+ * without modifying p.
+ */
+export function copyProfile(
+  p: perftools.profiles.IProfile
+): perftools.profiles.IProfile {
+  return Object.assign({}, p, {
+    sampleType: (p.sampleType || []).slice(),
+    sample: (p.sample || []).slice(),
+    location: (p.location || []).slice(),
+    function: (p.function || []).slice(),
+    stringTable: (p.stringTable || []).slice(),
+    comment: (p.comment || []).slice(),
+  });
+}
+
+/**
+ * @return the index of s in the string table of p, appending s to the string
+ * table if it is not present. p must be a copy returned by copyProfile().
+ */
+export function addString(p: perftools.profiles.IProfile, s: string): number {
+  const idx = p.stringTable!.indexOf(s);
+  if (idx >= 0) {
+    return idx;
+  }
+  p.stringTable!.push(s);
+  return p.stringTable!.length - 1;
+}
+
+/**
+ * Appends s to the comments of p. p must be a copy returned by copyProfile().
+ */
+export function addComment(p: perftools.profiles.IProfile, s: string) {
+  p.comment!.push(addString(p, s));
+}
+
+/**
+ * @return the string at index idx of the string table of p.
+ */
+export function getString(
+  p: perftools.profiles.IProfile,
+  idx: NumberOrLong
+): string {
+  return (p.stringTable || [])[Number(idx || 0)] || '';
+}
+
+/**
+ * Adds a function and a location for a frame which does not correspond to
+ * JavaScript source (for example "(pruned)") to p.
+ * p must be a copy returned by copyProfile().
+ *
+ * @return the ID of the new location.
+ */
+export function addSyntheticLocation(
+  p: perftools.profiles.IProfile,
+  name: string,
+  filename = ''
+): number {
+  const nameIdx = addString(p, name);
+  const filenameIdx = filename ? addString(p, filename) : 0;
+  const functionId = maxId(p.function!) + 1;
+  p.function!.push(
+    new perftools.profiles.Function({
+      id: functionId,
+      name: nameIdx,
+      systemName: nameIdx,
+      filename: filenameIdx,
+    })
+  );
+  const locationId = maxId(p.location!) + 1;
+  p.location!.push(
+    new perftools.profiles.Location({
+      id: locationId,
+      line: [{functionId}],
+    })
+  );
+  return locationId;
+}
+
+function maxId(entries: Array<{id?: NumberOrLong}>): number {
+  let max = 0;
+  for (const e of entries) {
+    max = Math.max(max, Number(e.id || 0));
+  }
+  return max;
+}
+
+/**
+ * @return map from location ID to the functions, leaf first, of the lines of
+ * that location.
+ */
+export function locationFunctions(
+  p: perftools.profiles.IProfile
+): Map<number, perftools.profiles.IFunction[]> {
+  const functions = new Map<number, perftools.profiles.IFunction>();
+  for (const f of p.function || []) {
+    functions.set(Number(f.id), f);
+  }
+  const locations = new Map<number, perftools.profiles.IFunction[]>();
+  for (const loc of p.location || []) {
+    const fns: perftools.profiles.IFunction[] = [];
+    for (const line of loc.line || []) {
+      const f = functions.get(Number(line.functionId));
+      if (f) {
+        fns.push(f);
+      }
+    }
+    locations.set(Number(loc.id), fns);
+  }
+  return locations;
+}
+
+/**
+ * A frame of a stack, identified independently of the IDs used by any one
+ * profile.
+ */
+export interface Frame {
+  name: string;
+  filename: string;
+  line: number;
+}
+
+/**
+ * @return map from each location ID of p to the frames of that location,
+ * leaf first.
+ */
+export function locationFrames(
+  p: perftools.profiles.IProfile
+): Map<number, Frame[]> {
+  const functions = new Map<number, perftools.profiles.IFunction>();
+  for (const f of p.function || []) {
+    functions.set(Number(f.id), f);
+  }
+  const frames = new Map<number, Frame[]>();
+  for (const loc of p.location || []) {
+    frames.set(
+      Number(loc.id),
+      (loc.line || []).map(l => {
+        const f = functions.get(Number(l.functionId));
+        return {
+          name: f ? getString(p, f.name) : '',
+          filename: f ? getString(p, f.filename) : '',
+          line: Number(l.line || 0),
+        };
+      })
+    );
+  }
+  return frames;
+}
+
+/**
+ * @return key which identifies a stack of frames.
+ */
+export function stackKey(frames: Frame[]): string {
+  return frames.map(f => `${f.name}@${f.filename}:${f.line}`).join(';');
+}
+
+/**
+ * @return key which is equal for two samples if and only if the samples have
+ * the same stack and labels.
+ */
+export function sampleKey(s: perftools.profiles.ISample): string {
+  const stack = (s.locationId || []).map(Number).join(',');
+  if (!s.label || s.label.length === 0) {
+    return stack;
+  }
+  const labels = s.label.map(
+    l => `${Number(l.key)}:${Number(l.str || 0)}:${Number(l.num || 0)}`
+  );
+  return `${stack};${labels.join(',')}`;
+}
+
+/**
+ * @return samples, with the values of samples which have the same stack and
+ * labels summed into a single sample. Samples are not modified.
+ */
+export function mergeSamples(
+  samples: perftools.profiles.ISample[]
+): perftools.profiles.ISample[] {
+  const merged = new Map<string, perftools.profiles.ISample>();
+  for (const s of samples) {
+    const key = sampleKey(s);
+    const existing = merged.get(key);
+    if (existing) {
+      merged.set(
+        key,
+        new perftools.profiles.Sample({
+          locationId: existing.locationId,
+          label: existing.label,
+          value: (existing.value || []).map(
+            (v, i) => Number(v) + Number((s.value || [])[i] || 0)
+          ),
+        })
+      );
+    } else {
+      merged.set(key, s);
+    }
+  }
+  return Array.from(merged.values());
+}
+
+/**
+ * Removes locations and functions which are not referenced by any sample of
+ * p. The string table is left unchanged.
+ * p must be a copy returned by copyProfile().
+ */
+export function removeUnreferenced(p: perftools.profiles.IProfile) {
+  const usedLocations = new Set<number>();
+  for (const s of p.sample!) {
+    for (const id of s.locationId || []) {
+      usedLocations.add(Number(id));
+    }
+  }
+  p.location = p.location!.filter(loc => usedLocations.has(Number(loc.id)));
+
+  const usedFunctions = new Set<number>();
+  for (const loc of p.location) {
+    for (const line of loc.line || []) {
+      usedFunctions.add(Number(line.functionId));
+    }
+  }
+  p.function = p.function!.filter(f => usedFunctions.has(Number(f.id)));
+}
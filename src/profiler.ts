@@ -19,15 +19,61 @@ import {
   ApiError,
   DecorateRequestOptions,
 } from '@google-cloud/common';
+import delay from 'delay';
 import {heap as heapProfiler, SourceMapper, time as timeProfiler} from 'pprof';
+import {serializeHeapProfile} from 'pprof/out/src/profile-serializer';
+import * as fs from 'fs';
+import * as os from 'os';
 import * as msToStr from 'pretty-ms';
 import {promisify} from 'util';
 import * as zlib from 'zlib';
 import * as r from 'teeny-request';
 
 import {perftools} from '../protos/profile';
+import {addTypeLabels, TypeTotal} from './allocation-types';
+import {BlockingCallProfiler} from './blocking';
+import {
+  codeSizeProfile,
+  codeSizes,
+  estimateSnapshotMemory,
+  takeHeapSnapshot,
+} from './code-size';
 import {ProfilerConfig} from './config';
+import {createExporter, ProfileExporter} from './exporters';
+import {excludeAgentSamples, trimFrames} from './filter';
+import {FlightRecorder} from './flight-recorder';
+import {GovernorStats, LoadGovernor} from './governor';
+import {HeapDeltaTracker} from './heap-delta';
+import {IoWaitProfiler} from './io-wait';
+import {
+  claimPendingProfile,
+  HeapLimitWatcher,
+  HeapUsage,
+  pendingProfilePaths,
+  releasePendingProfile,
+  writePendingProfile,
+} from './heap-limit';
+import {LeakDetector, LeakTrend} from './leak-detector';
+import {
+  formatLoopPhases,
+  LoopPhaseTimes,
+  LoopPhaseTracker,
+} from './loop-phases';
+import {
+  fitToBudget,
+  fitTreeToBudget,
+  readCgroupMemory,
+} from './memory-budget';
+import {memoryMapProfile, readMemorySnapshot} from './memory-map';
 import {createLogger} from './logger';
+import {PromiseProfiler} from './promise-profile';
+import {addComment, copyProfile, stackKey} from './profile-utils';
+import {pruneStacks} from './prune';
+import {foldRecursion} from './recursion';
+import {SymbolTable} from './symbol-table';
+import {formatThreadCpu, readThreadCpuNanos} from './thread-cpu';
+import {Trigger, TriggerMonitor, writeTriggeredProfile} from './triggers';
+import {AllocationProfileNode} from './v8-types';
 
 import parseDuration from 'parse-duration';
 // eslint-disable-next-line @typescript-eslint/no-var-requires
@@ -38,8 +84,22 @@ const gzip = promisify(zlib.gzip);
 enum ProfileTypes {
   Wall = 'WALL',
   Heap = 'HEAP',
+  // Only collected when requested through Profiler.profile(). The profiler
+  // server does not accept these types, so they are only exported, recorded
+  // by the flight recorder and written by startLocal(), and never uploaded.
+  IoWait = 'IO_WAIT',
+  Blocking = 'BLOCKING',
+  Promise = 'PROMISE',
+  Memory = 'MEMORY',
+  Code = 'CODE',
 }
 
+// Types of profiles accepted by the profiler server.
+const UPLOADED_PROFILE_TYPES = new Set<string>([
+  ProfileTypes.Wall,
+  ProfileTypes.Heap,
+]);
+
 /**
  * @return true iff http status code indicates an error.
  */
@@ -76,6 +136,19 @@ export interface RequestProfile {
   labels?: {instance?: string};
 }
 
+/**
+ * Collects the profile specified by a RequestProfile in place of
+ * Profiler.profile(), setting its profileBytes and labels fields.
+ */
+export type ProfileCollector = (
+  prof: RequestProfile
+) => Promise<RequestProfile>;
+
+/**
+ * Labels of a profile uploaded with the CreateOfflineProfile API.
+ */
+type OfflineLabels = {instance?: string; trigger?: string};
+
 /**
  * @return the error's message, if present. Otherwise returns the
  * message of the response body, if that field exists, or the response status
@@ -186,9 +259,16 @@ function isRequestProfile(prof: any): prof is RequestProfile {
  * of the program, but for a short period of time, since profiles are small.
  *
  * @param p - profile to be converted to string.
+ * @param symbols - when specified, table used to assign IDs and encode the
+ * strings, functions and locations of the profile.
  */
-async function profileBytes(p: perftools.profiles.IProfile): Promise<string> {
-  const buffer = perftools.profiles.Profile.encode(p).finish();
+async function profileBytes(
+  p: perftools.profiles.IProfile,
+  symbols?: SymbolTable
+): Promise<string> {
+  const buffer = symbols
+    ? symbols.encode(p)
+    : perftools.profiles.Profile.encode(p).finish();
   const gzBuf = (await gzip(buffer)) as Buffer;
   return gzBuf.toString('base64');
 }
@@ -286,6 +366,24 @@ export class Profiler extends ServiceObject {
   private deployment: Deployment;
   private profileTypes: string[];
   private retryer: Retryer;
+  private governor: LoadGovernor;
+  private symbols: SymbolTable | undefined;
+  private heapDelta: HeapDeltaTracker | undefined;
+  private leakDetector: LeakDetector | undefined;
+  private loggedLeakSites = new Set<string>();
+  private lastHeapTypeTotals: TypeTotal[] = [];
+  private loopPhaseTracker: LoopPhaseTracker | undefined;
+  private lastLoopPhases: LoopPhaseTimes | undefined;
+  private heapLimitWatcher: HeapLimitWatcher | undefined;
+  private flightRecorder: FlightRecorder | undefined;
+  private flightRecording = false;
+  private flightRecorderTimer: NodeJS.Timeout | undefined;
+  private flightRecorderDumpHandler: (() => void) | undefined;
+  private stopped = false;
+  private timeProfileInProgress: Promise<unknown> | undefined;
+  private triggerMonitor: TriggerMonitor;
+  private collector: ProfileCollector | undefined;
+  private exporter: ProfileExporter | undefined;
   private sourceMapper: SourceMapper | undefined;
   private baseApiUrl: string;
 
@@ -342,6 +440,105 @@ export class Profiler extends ServiceObject {
       this.config.backoffCapMillis,
       this.config.backoffMultiplier
     );
+    this.governor = new LoadGovernor(
+      this.config.governorMaxEventLoopUtilization,
+      this.config.governorMaxCpuUtilization,
+      this.config.governorMaxDeferMillis,
+      this.config.governorCheckIntervalMillis
+    );
+    if (this.config.stableProfileIds) {
+      this.symbols = new SymbolTable(this.config.stableProfileIdsMaxEntries);
+    }
+    if (this.config.heapDelta) {
+      this.heapDelta = new HeapDeltaTracker(this.config.heapDeltaMaxStacks);
+    }
+    if (this.config.timeLoopPhases) {
+      this.loopPhaseTracker = new LoopPhaseTracker();
+    }
+    if (this.config.leakDetection) {
+      this.leakDetector = new LeakDetector(
+        this.config.leakDetectionMaxSites,
+        this.config.leakDetectionMaxPoints,
+        this.config.leakDetectionMinPoints
+      );
+    }
+    if (this.config.heapLimitProfileDir && !this.config.disableHeap) {
+      this.heapLimitWatcher = new HeapLimitWatcher(
+        this.config.heapLimitThreshold,
+        this.config.heapLimitCheckIntervalMillis,
+        usage => this.writeHeapLimitProfile(usage)
+      );
+    }
+    this.triggerMonitor = new TriggerMonitor(
+      {
+        eventLoopDelayP99Millis: this.config.triggerEventLoopDelayMillis,
+        cpuUtilization: this.config.triggerCpuUtilization,
+        rssGrowthBytesPerSecond: this.config.triggerRssGrowthBytesPerSecond,
+      },
+      this.config.triggerCheckIntervalMillis,
+      this.config.triggerMinIntervalMillis,
+      trigger => this.captureTriggeredProfile(trigger)
+    );
+    if (this.config.flightRecorderPeriodMillis > 0) {
+      this.flightRecorder = new FlightRecorder(
+        this.config.flightRecorderMaxProfiles,
+        this.config.flightRecorderMaxBytes
+      );
+    }
+    this.exporter = createExporter(this.config);
+  }
+
+  /**
+   * @return counts of the profiles which were deferred or collected with a
+   * reduced sampling rate because the process was overloaded.
+   */
+  governorStats(): GovernorStats {
+    return this.governor.stats();
+  }
+
+  /**
+   * @return the allocation sites whose live bytes grew monotonically across
+   * the heap profiles collected so far, or an empty array when leakDetection
+   * is not enabled.
+   */
+  leakTrends(): LeakTrend[] {
+    return this.leakDetector ? this.leakDetector.trends() : [];
+  }
+
+  /**
+   * @return the live bytes of each type of object in the last heap profile,
+   * sorted by bytes descending, or an empty array when heapTypeLabels is not
+   * enabled or no heap profile has been collected. Types are inferred as
+   * described for heapTypeLabels, so the bytes of objects whose type is not
+   * known, usually most of them, are reported as "(unknown)".
+   */
+  heapTypeTotals(): TypeTotal[] {
+    return this.lastHeapTypeTotals;
+  }
+
+  /**
+   * @return the time spent in each phase of the event loop while the last
+   * time profile was collected, or undefined when timeLoopPhases is not
+   * enabled or no time profile has been collected.
+   */
+  loopPhaseTimes(): LoopPhaseTimes | undefined {
+    return this.lastLoopPhases;
+  }
+
+  /**
+   * @return a profile of the growth rate of the live bytes at each growing
+   * allocation site, or undefined when leakDetection is not enabled.
+   */
+  leakTrendProfile(): perftools.profiles.IProfile | undefined {
+    return this.leakDetector ? this.leakDetector.trendProfile() : undefined;
+  }
+
+  /**
+   * Sets the function used to collect the profiles requested by the profiler
+   * server, for example to delegate collection to a cluster worker.
+   */
+  useCollector(collector: ProfileCollector) {
+    this.collector = collector;
   }
 
   /**
@@ -355,6 +552,23 @@ export class Profiler extends ServiceObject {
    * error level and getting profile type will be retried.
    */
   async start(): Promise<void> {
+    await this.startInProcess();
+    if (this.config.heapLimitProfileDir) {
+      await this.uploadPendingProfiles();
+    }
+    this.runLoop();
+  }
+
+  /**
+   * Loads source maps and starts the features of the agent which run within
+   * this process, whether or not this process polls the profiler server
+   * itself: the heap limit watcher, flight recorder and triggers.
+   *
+   * Profiles written when the heap limit was approached are uploaded by the
+   * process which polls the profiler server, with start(), rather than by
+   * each process sharing heapLimitProfileDir.
+   */
+  async startInProcess(): Promise<void> {
     if (!this.config.disableSourceMaps) {
       try {
         this.sourceMapper = await SourceMapper.create(
@@ -368,14 +582,131 @@ export class Profiler extends ServiceObject {
       }
     }
     this.logger.debug(`Cloud Profiler Node.js agent version: ${pjson.version}`);
-    this.runLoop();
+    if (this.heapLimitWatcher) {
+      this.heapLimitWatcher.start();
+    }
+    if (this.flightRecorder) {
+      this.startFlightRecorder();
+    }
+    this.triggerMonitor.start();
+  }
+
+  private startFlightRecorder() {
+    this.flightRecorderTimer = setInterval(
+      () => this.recordFlightProfiles(),
+      this.config.flightRecorderPeriodMillis
+    );
+    this.flightRecorderTimer.unref();
+    const signal = this.config.flightRecorderDumpSignal;
+    if (signal) {
+      this.flightRecorderDumpHandler = () => {
+        try {
+          this.dumpFlightRecorder();
+        } catch (err) {
+          this.logger.error(`Failed to write flight recorder profiles: ${err}`);
+        }
+      };
+      process.on(signal as NodeJS.Signals, this.flightRecorderDumpHandler);
+    }
   }
 
   /**
-   * Endlessly polls the profiler server for instructions, and collects and
-   * uploads profiles as requested.
+   * Stops polling the profiler server, once any request in progress
+   * completes, and stops the features started by startInProcess().
+   */
+  stop() {
+    this.stopped = true;
+    if (this.heapLimitWatcher) {
+      this.heapLimitWatcher.stop();
+    }
+    if (this.flightRecorderTimer) {
+      clearInterval(this.flightRecorderTimer);
+      this.flightRecorderTimer = undefined;
+    }
+    if (this.flightRecorderDumpHandler) {
+      process.removeListener(
+        this.config.flightRecorderDumpSignal as NodeJS.Signals,
+        this.flightRecorderDumpHandler
+      );
+      this.flightRecorderDumpHandler = undefined;
+    }
+    this.triggerMonitor.stop();
+  }
+
+  /**
+   * Collects a heap profile and a wall profile for the flight recorder. If
+   * the profiles collected at the previous interval are still being
+   * collected, does nothing.
+   *
+   * Public to allow for testing.
+   */
+  async recordFlightProfiles(): Promise<void> {
+    if (!this.flightRecorder || this.flightRecording) {
+      return;
+    }
+    this.flightRecording = true;
+    try {
+      if (!this.config.disableHeap) {
+        const p = heapProfiler.profile(
+          this.config.ignoreHeapSamplesPath,
+          this.sourceMapper
+        );
+        this.flightRecorder.add(
+          ProfileTypes.Heap,
+          await this.serializeProfile(p)
+        );
+      }
+      if (!this.config.disableTime) {
+        const p = await this.timeProfile({
+          durationMillis: this.config.flightRecorderTimeDurationMillis,
+          intervalMicros: this.config.timeIntervalMicros,
+          sourceMapper: this.sourceMapper,
+        });
+        const {profile} = excludeAgentSamples(
+          p,
+          this.config.ignoreTimeSamplesPath
+        );
+        this.flightRecorder.add(
+          ProfileTypes.Wall,
+          await this.serializeProfile(profile)
+        );
+      }
+    } catch (err) {
+      this.logger.debug(`Failed to collect flight recorder profile: ${err}`);
+    } finally {
+      this.flightRecording = false;
+    }
+  }
+
+  /**
+   * Writes the profiles kept by the flight recorder to dir, which defaults
+   * to flightRecorderDumpDir or, when that is not set, the operating
+   * system's temporary directory.
+   *
+   * @return paths of the files written.
+   * @throws error when the flight recorder is not enabled.
+   */
+  dumpFlightRecorder(
+    dir = this.config.flightRecorderDumpDir || os.tmpdir()
+  ): string[] {
+    if (!this.flightRecorder) {
+      throw new Error('Flight recorder is not enabled.');
+    }
+    const files = this.flightRecorder.dump(dir);
+    this.logger.info(
+      `Wrote ${files.length} flight recorder profiles to ${dir}.`
+    );
+    return files;
+  }
+
+  /**
+   * Polls the profiler server for instructions, and collects and uploads
+   * profiles as requested, until stop() is called.
    */
   async runLoop() {
+    if (this.stopped) {
+      return;
+    }
     const delayMillis = await this.collectProfile();
     setTimeout(this.runLoop.bind(this), delayMillis).unref();
   }
@@ -407,6 +738,9 @@ export class Profiler extends ServiceObject {
       return backoff;
     }
     this.retryer.reset();
+    if (this.stopped) {
+      return 0;
+    }
     await this.profileAndUpload(prof);
     return 0;
   }
@@ -472,7 +806,8 @@ export class Profiler extends ServiceObject {
   }
 
   /**
-   * Collects a profile of the type specified by the profileType field of prof.
+   * Collects a profile of the type specified by the profileType field of prof,
+   * then uploads it and sends it to the configured exporters concurrently.
    * If any problem is encountered, like a problem collecting or uploading the
    * profile, a message will be logged, and the error will otherwise be ignored.
    *
@@ -480,13 +815,34 @@ export class Profiler extends ServiceObject {
    */
   async profileAndUpload(prof: RequestProfile): Promise<void> {
     try {
-      prof = await this.profile(prof);
+      if (this.collector) {
+        prof = await this.collector(prof);
+      } else {
+        prof = await this.profile(prof);
+        prof.labels = this.profileLabels;
+      }
       this.logger.debug(`Successfully collected profile ${prof.profileType}.`);
-      prof.labels = this.profileLabels;
     } catch (err) {
       this.logger.debug(`Failed to collect profile: ${err}`);
       return;
     }
+    if (!UPLOADED_PROFILE_TYPES.has(prof.profileType || '')) {
+      this.logger.debug(
+        `Not uploading profile ${prof.profileType}, which is not accepted ` +
+          'by the profiler server.'
+      );
+      await this.exportProfile(prof);
+      return;
+    }
+    await Promise.all([this.uploadProfile(prof), this.exportProfile(prof)]);
+  }
+
+  /**
+   * Uploads a collected profile to the profiler server. If any problem is
+   * encountered, a message will be logged, and the error will otherwise be
+   * ignored.
+   */
+  private async uploadProfile(prof: RequestProfile): Promise<void> {
     const options = {
       method: 'PATCH',
       uri: this.baseApiUrl + '/' + prof.name,
@@ -511,6 +867,191 @@ export class Profiler extends ServiceObject {
     }
   }
 
+  /**
+   * Sends a collected profile to the exporters enabled by the configuration,
+   * if any. If any problem is encountered, a message will be logged, and the
+   * error will otherwise be ignored.
+   *
+   * Public to allow for testing.
+   */
+  async exportProfile(prof: RequestProfile): Promise<void> {
+    if (!this.exporter || !prof.profileBytes) {
+      return;
+    }
+    const durationMillis = prof.duration ? parseDuration(prof.duration) : 0;
+    const labels: {[key: string]: string} = {};
+    if (prof.labels && prof.labels.instance) {
+      labels.instance = prof.labels.instance;
+    }
+    try {
+      await this.exporter.export({
+        profileType: prof.profileType!,
+        profileBytes: Buffer.from(prof.profileBytes, 'base64'),
+        service: this.config.serviceContext.service,
+        version: this.config.serviceContext.version,
+        labels,
+        startMillis: Date.now() - (durationMillis || 0),
+        durationMillis: durationMillis || 0,
+      });
+      this.logger.debug(
+        `Successfully exported profile ${prof.profileType} to ` +
+          `${this.exporter.name}.`
+      );
+    } catch (err) {
+      this.logger.debug(`Failed to export profile: ${err}`);
+    }
+  }
+
+  /**
+   * Uploads the heap profiles written to heapLimitProfileDir by earlier runs
+   * of the agent for the service of this profiler as offline profiles,
+   * removing each file once it has been uploaded. Each file is first claimed,
+   * so that it is uploaded once even when several processes share the
+   * directory. Files which could not be uploaded are left in place to be
+   * retried the next time the agent starts.
+   *
+   * Public to allow for testing.
+   */
+  async uploadPendingProfiles(): Promise<void> {
+    const files = pendingProfilePaths(
+      this.config.heapLimitProfileDir,
+      this.config.serviceContext.service
+    );
+    for (const file of files) {
+      const claimed = claimPendingProfile(file);
+      if (!claimed) {
+        continue;
+      }
+      let profileBytes: string;
+      try {
+        profileBytes = fs.readFileSync(claimed).toString('base64');
+      } catch (err) {
+        this.logger.debug(`Failed to read pending profile ${file}: ${err}`);
+        releasePendingProfile(claimed, file);
+        continue;
+      }
+      const uploaded = await this.uploadOfflineProfile(
+        ProfileTypes.Heap,
+        profileBytes,
+        this.profileLabels
+      );
+      if (!uploaded) {
+        releasePendingProfile(claimed, file);
+        return;
+      }
+      try {
+        fs.unlinkSync(claimed);
+      } catch (err) {
+        this.logger.debug(`Failed to remove pending profile ${file}: ${err}`);
+      }
+    }
+  }
+
+  /**
+   * Uploads a profile which was not requested by the profiler server with
+   * the CreateOfflineProfile API.
+   *
+   * @return true if the profile was uploaded.
+   */
+  private async uploadOfflineProfile(
+    profileType: string,
+    profileBytes: string,
+    labels: OfflineLabels
+  ): Promise<boolean> {
+    const options = {
+      method: 'POST',
+      uri: '/profiles:createOffline',
+      body: {deployment: this.deployment, profileType, profileBytes, labels},
+      json: true,
+      maxRetries: 0,
+    };
+    try {
+      const [, res] = await this.request(options);
+      if (isErrorResponseStatusCode(res.statusCode)) {
+        this.logger.debug(
+          `Could not upload offline profile ${profileType}: ${
+            res.statusMessage || res.statusCode
+          }.`
+        );
+        return false;
+      }
+      this.logger.debug(
+        `Successfully uploaded offline profile ${profileType}.`
+      );
+      return true;
+    } catch (err) {
+      this.logger.debug(`Failed to upload offline profile: ${err}`);
+      return false;
+    }
+  }
+
+  /**
+   * Collects a profile of the type specified by trigger through profile(),
+   * then uploads it with a "trigger" label holding the reason for the
+   * trigger, or writes it to triggerProfileDir when that is set.
+   *
+   * Public to allow for testing.
+   */
+  async captureTriggeredProfile(trigger: Trigger): Promise<void> {
+    this.logger.debug(
+      `Capturing ${trigger.profileType} profile triggered by ${trigger.reason}.`
+    );
+    let prof: RequestProfile = {
+      name: '',
+      profileType: trigger.profileType,
+      duration: `${this.config.triggerTimeDurationMillis}ms`,
+    };
+    try {
+      prof = await this.profile(prof);
+    } catch (err) {
+      this.logger.debug(`Failed to collect triggered profile: ${err}`);
+      return;
+    }
+    if (this.config.triggerProfileDir) {
+      try {
+        const file = writeTriggeredProfile(
+          this.config.triggerProfileDir,
+          trigger,
+          Buffer.from(prof.profileBytes!, 'base64')
+        );
+        this.logger.debug(`Wrote triggered profile to ${file}.`);
+      } catch (err) {
+        this.logger.debug(`Failed to write triggered profile: ${err}`);
+      }
+      return;
+    }
+    await this.uploadOfflineProfile(
+      trigger.profileType,
+      prof.profileBytes!,
+      Object.assign({trigger: trigger.reason}, this.profileLabels)
+    );
+  }
+
+  /**
+   * Synchronously collects a heap profile and writes it to
+   * heapLimitProfileDir, so that it is available even if the process runs
+   * out of memory before the next profile would be collected.
+   */
+  private writeHeapLimitProfile(usage: HeapUsage) {
+    try {
+      const p = heapProfiler.profile(
+        this.config.ignoreHeapSamplesPath,
+        this.sourceMapper
+      );
+      const file = writePendingProfile(
+        this.config.heapLimitProfileDir,
+        p,
+        this.config.serviceContext.service
+      );
+      this.logger.warn(
+        `Heap usage of ${usage.usedBytes} bytes is near the limit of ` +
+          `${usage.limitBytes} bytes; wrote heap profile to ${file}.`
+      );
+    } catch (err) {
+      this.logger.error(`Failed to write heap profile near heap limit: ${err}`);
+    }
+  }
+
   /**
    * Collects a profile of the type specified by profileType field of prof.
    * If any problem is encountered, for example the profileType is not
@@ -520,11 +1061,22 @@ export class Profiler extends ServiceObject {
    * Public to allow for testing.
    */
   async profile(prof: RequestProfile): Promise<RequestProfile> {
+    this.checkMemoryHeadroom();
     switch (prof.profileType) {
       case ProfileTypes.Wall:
         return this.writeTimeProfile(prof);
       case ProfileTypes.Heap:
         return this.writeHeapProfile(prof);
+      case ProfileTypes.IoWait:
+        return this.writeIoWaitProfile(prof);
+      case ProfileTypes.Blocking:
+        return this.writeBlockingProfile(prof);
+      case ProfileTypes.Promise:
+        return this.writePromiseProfile(prof);
+      case ProfileTypes.Memory:
+        return this.writeMemoryProfile(prof);
+      case ProfileTypes.Code:
+        return this.writeCodeProfile(prof);
       default:
         throw new Error(`Unexpected profile type ${prof.profileType}.`);
     }
@@ -552,12 +1104,63 @@ export class Profiler extends ServiceObject {
     }
     const options = {
       durationMillis,
-      intervalMicros: this.config.timeIntervalMicros,
+      intervalMicros: this.governor.timeIntervalMicros(
+        this.config.timeIntervalMicros,
+        this.config.governorTimeIntervalMultiplier
+      ),
       sourceMapper: this.sourceMapper,
     };
 
-    const p = await timeProfiler.profile(options);
-    prof.profileBytes = await profileBytes(p);
+    if (this.loopPhaseTracker) {
+      this.loopPhaseTracker.start();
+    }
+    // The CPU time is read once profiling starts, rather than while waiting
+    // for a time profile already being collected, so that it covers the
+    // duration of the profile.
+    let cpuStartNanos = undefined as number | undefined;
+    let p: perftools.profiles.IProfile;
+    try {
+      p = await this.timeProfile(options, () => {
+        if (this.config.timeThreadCpu) {
+          cpuStartNanos = readThreadCpuNanos();
+        }
+      });
+    } finally {
+      if (this.loopPhaseTracker) {
+        this.lastLoopPhases = this.loopPhaseTracker.stop();
+      }
+    }
+    const cpuEndNanos =
+      cpuStartNanos === undefined ? undefined : readThreadCpuNanos();
+    const {profile, overhead} = excludeAgentSamples(
+      p,
+      this.config.ignoreTimeSamplesPath
+    );
+    if (overhead.samples > 0) {
+      this.logger.debug(
+        `Excluded ${overhead.samples} profiler samples from time profile.`
+      );
+    }
+    const comments: string[] = [];
+    if (this.loopPhaseTracker) {
+      comments.push(formatLoopPhases(this.lastLoopPhases!));
+    }
+    if (cpuStartNanos !== undefined && cpuEndNanos !== undefined) {
+      comments.push(
+        formatThreadCpu(
+          cpuEndNanos - cpuStartNanos,
+          Number(profile.durationNanos || 0)
+        )
+      );
+    }
+    let out = profile;
+    if (comments.length > 0) {
+      out = copyProfile(profile);
+      comments.forEach(c => addComment(out, c));
+    }
+    await this.deferWhileOverloaded();
+    prof.profileBytes = await this.encodeProfile(out);
+    this.recordProfile(ProfileTypes.Wall, prof.profileBytes);
     return prof;
   }
 
@@ -571,11 +1174,390 @@ export class Profiler extends ServiceObject {
     if (this.config.disableHeap) {
       throw Error('Cannot collect heap profile, heap profiler not enabled.');
     }
-    const p = heapProfiler.profile(
+    await this.deferWhileOverloaded();
+    let p = this.config.profileMemoryBudgetBytes
+      ? this.budgetedHeapProfile()
+      : heapProfiler.profile(
+          this.config.ignoreHeapSamplesPath,
+          this.sourceMapper
+        );
+    if (this.leakDetector) {
+      this.recordLeakTrends(p);
+    }
+    if (this.config.heapTypeLabels) {
+      const {profile, totals} = addTypeLabels(p);
+      p = profile;
+      this.lastHeapTypeTotals = totals;
+    }
+    // Stacks are ranked by live bytes rather than by the change in live
+    // bytes, which may be negative.
+    const spaceIdx = (p.sampleType || []).length - 1;
+    if (this.heapDelta) {
+      p = this.heapDelta.addDelta(p);
+    }
+    prof.profileBytes = await this.encodeProfile(p, spaceIdx);
+    this.recordProfile(ProfileTypes.Heap, prof.profileBytes);
+    return prof;
+  }
+
+  /**
+   * Collects a profile of the time spent waiting for I/O operations started
+   * during the duration of prof, converts profile to compressed, base64
+   * encoded string, and puts this string in profileBytes field of prof.
+   *
+   * Public to allow for testing.
+   */
+  async writeIoWaitProfile(prof: RequestProfile): Promise<RequestProfile> {
+    const durationMillis = prof.duration ? parseDuration(prof.duration) : 0;
+    if (!durationMillis) {
+      throw Error(
+        `Cannot collect I/O wait profile, duration "${prof.duration}" ` +
+          'cannot be parsed.'
+      );
+    }
+    const ioWait = new IoWaitProfiler(
+      this.config.ioWaitMaxFrames,
+      this.config.ioWaitMaxPending,
+      this.config.ioWaitMaxStacks,
+      this.config.ignoreTimeSamplesPath
+    );
+    ioWait.start();
+    await delay(durationMillis);
+    const p = ioWait.stop();
+    await this.deferWhileOverloaded();
+    prof.profileBytes = await this.encodeProfile(p);
+    this.recordProfile(ProfileTypes.IoWait, prof.profileBytes);
+    return prof;
+  }
+
+  /**
+   * Collects a profile of the calls to synchronous fs, child_process and zlib
+   * functions made during the duration of prof, converts profile to
+   * compressed, base64 encoded string, and puts this string in profileBytes
+   * field of prof.
+   *
+   * Public to allow for testing.
+   */
+  async writeBlockingProfile(prof: RequestProfile): Promise<RequestProfile> {
+    const durationMillis = prof.duration ? parseDuration(prof.duration) : 0;
+    if (!durationMillis) {
+      throw Error(
+        `Cannot collect blocking profile, duration "${prof.duration}" ` +
+          'cannot be parsed.'
+      );
+    }
+    const blocking = new BlockingCallProfiler(
+      this.config.blockingMaxFrames,
+      this.config.blockingMaxStacks,
+      this.config.ignoreTimeSamplesPath
+    );
+    blocking.start();
+    await delay(durationMillis);
+    const p = blocking.stop();
+    await this.deferWhileOverloaded();
+    prof.profileBytes = await this.encodeProfile(p);
+    this.recordProfile(ProfileTypes.Blocking, prof.profileBytes);
+    return prof;
+  }
+
+  /**
+   * Collects a profile of the promises created, and of the microtasks which
+   * continued them, during the duration of prof, converts profile to
+   * compressed, base64 encoded string, and puts this string in profileBytes
+   * field of prof.
+   *
+   * Public to allow for testing.
+   */
+  async writePromiseProfile(prof: RequestProfile): Promise<RequestProfile> {
+    const durationMillis = prof.duration ? parseDuration(prof.duration) : 0;
+    if (!durationMillis) {
+      throw Error(
+        `Cannot collect promise profile, duration "${prof.duration}" ` +
+          'cannot be parsed.'
+      );
+    }
+    const promises = new PromiseProfiler(
+      this.config.promiseSamplingInterval,
+      this.config.promiseMaxFrames,
+      this.config.promiseMaxPending,
+      this.config.promiseMaxStacks,
+      this.config.ignoreTimeSamplesPath
+    );
+    promises.start();
+    await delay(durationMillis);
+    const p = promises.stop();
+    await this.deferWhileOverloaded();
+    prof.profileBytes = await this.encodeProfile(p);
+    this.recordProfile(ProfileTypes.Promise, prof.profileBytes);
+    return prof;
+  }
+
+  /**
+   * Collects a profile of the resident memory of the process, broken down by
+   * V8 heap space, external memory, native memory and mapped files, converts
+   * profile to compressed, base64 encoded string, and adds profileBytes field
+   * to prof with this string.
+   *
+   * The profiler server does not accept MEMORY profiles, so they are only
+   * exported, recorded by the flight recorder and written by startLocal().
+   *
+   * Public to allow for testing.
+   */
+  async writeMemoryProfile(prof: RequestProfile): Promise<RequestProfile> {
+    await this.deferWhileOverloaded();
+    const p = memoryMapProfile(
+      readMemorySnapshot(),
+      this.config.memoryMapMaxFiles
+    );
+    prof.profileBytes = await this.encodeProfile(p);
+    this.recordProfile(ProfileTypes.Memory, prof.profileBytes);
+    return prof;
+  }
+
+  /**
+   * Collects a profile of the size of the bytecode, baseline code and
+   * optimized code of each function, read from a heap snapshot, converts
+   * profile to compressed, base64 encoded string, and adds profileBytes field
+   * to prof with this string.
+   *
+   * Taking the heap snapshot pauses the process and temporarily needs memory
+   * proportional to the size of the heap, so this profile is only collected
+   * when explicitly requested.
+   *
+   * Public to allow for testing.
+   */
+  async writeCodeProfile(prof: RequestProfile): Promise<RequestProfile> {
+    await this.deferWhileOverloaded();
+    this.checkSnapshotMemory();
+    const sizes = codeSizes(await takeHeapSnapshot());
+    const p = codeSizeProfile(sizes, this.sourceMapper);
+    prof.profileBytes = await this.encodeProfile(p);
+    this.recordProfile(ProfileTypes.Code, prof.profileBytes);
+    return prof;
+  }
+
+  /**
+   * @return heap profile whose allocation tree was fitted to
+   * profileMemoryBudgetBytes before it was serialized, so that the memory
+   * needed to build an over-budget profile is never allocated.
+   */
+  private budgetedHeapProfile(): perftools.profiles.IProfile {
+    const startTimeNanos = Date.now() * 1000 * 1000;
+    const root = heapProfiler.v8Profile();
+    // Like heapProfiler.profile(), report external memory as its own node.
+    const {external} = process.memoryUsage();
+    if (external > 0) {
+      root.children.push({
+        name: '(external)',
+        scriptName: '',
+        children: [],
+        allocations: [{sizeBytes: external, count: 1}],
+      } as AllocationProfileNode);
+    }
+    const fitted = fitTreeToBudget(root, this.config.profileMemoryBudgetBytes);
+    if (fitted.aggregatedNodes > 0) {
+      this.logger.debug(
+        `Aggregated ${fitted.aggregatedNodes} heap profile nodes to fit ` +
+          `memory budget of ${this.config.profileMemoryBudgetBytes} bytes.`
+      );
+    }
+    return serializeHeapProfile(
+      fitted.root,
+      startTimeNanos,
+      this.config.heapIntervalBytes,
       this.config.ignoreHeapSamplesPath,
       this.sourceMapper
     );
-    prof.profileBytes = await profileBytes(p);
-    return prof;
+  }
+
+  /**
+   * Records the heap profile p in the leak detector, and logs the sites
+   * whose live bytes grow fastest. Sites already logged after the previous
+   * heap profile are logged at debug level, so that a lasting trend is
+   * reported once rather than with every heap profile.
+   */
+  private recordLeakTrends(p: perftools.profiles.IProfile) {
+    this.leakDetector!.record(p);
+    const trends = this.leakDetector!.trends();
+    const logged = new Set<string>();
+    for (const t of trends.slice(0, 3)) {
+      const site = t.frames[0];
+      const name = site
+        ? `${site.name} (${site.filename}:${site.line})`
+        : '(unknown)';
+      const message =
+        `Possible memory leak at ${name}: live bytes grew ` +
+        `by ${Math.round(t.bytesPerHour)} bytes/hour over ${t.points} ` +
+        `heap profiles to ${t.latestBytes} bytes.`;
+      const key = stackKey(t.frames);
+      if (this.loggedLeakSites.has(key)) {
+        this.logger.debug(message);
+      } else {
+        this.logger.info(message);
+      }
+      logged.add(key);
+    }
+    this.loggedLeakSites = logged;
+  }
+
+  /**
+   * Collects a time profile. Only one time profile can be collected at a
+   * time, so first waits for any time profile already being collected.
+   *
+   * @param onStart - called just before the time profiler starts.
+   */
+  private async timeProfile(
+    options: Parameters<typeof timeProfiler.profile>[0],
+    onStart?: () => void
+  ): Promise<perftools.profiles.IProfile> {
+    while (this.timeProfileInProgress) {
+      await this.timeProfileInProgress;
+    }
+    if (onStart) {
+      onStart();
+    }
+    const p = timeProfiler.profile(options);
+    this.timeProfileInProgress = p.catch(() => undefined);
+    try {
+      return await p;
+    } finally {
+      this.timeProfileInProgress = undefined;
+    }
+  }
+
+  /**
+   * Adds a profile requested by the profiler server to the flight recorder.
+   */
+  private recordProfile(profileType: string, profileBytes: string) {
+    if (this.flightRecorder) {
+      this.flightRecorder.add(profileType, Buffer.from(profileBytes, 'base64'));
+    }
+  }
+
+  /**
+   * Prunes p as specified by the configuration, ranking stacks by the sample
+   * type at index valueIdx (the last sample type by default), then converts
+   * it to a compressed, base64 encoded string.
+   */
+  private async encodeProfile(
+    p: perftools.profiles.IProfile,
+    valueIdx?: number
+  ): Promise<string> {
+    return profileBytes(this.pruneProfile(p, valueIdx), this.symbols);
+  }
+
+  /**
+   * Prunes p as specified by the configuration, then converts it to a
+   * compressed, serialized profile without using the stable IDs of
+   * stableProfileIds, so that it can be decoded on its own.
+   */
+  private async serializeProfile(
+    p: perftools.profiles.IProfile
+  ): Promise<Buffer> {
+    const buffer = perftools.profiles.Profile.encode(
+      this.pruneProfile(p)
+    ).finish();
+    return (await gzip(buffer)) as Buffer;
+  }
+
+  private pruneProfile(
+    p: perftools.profiles.IProfile,
+    valueIdx?: number
+  ): perftools.profiles.IProfile {
+    p = foldRecursion(p, this.config.foldRecursionMaxCycleLength);
+    p = trimFrames(p, this.config.dropFrames, this.config.keepFrames);
+    p = pruneStacks(
+      p,
+      this.config.pruneMaxStacks,
+      this.config.pruneValueFraction,
+      valueIdx
+    );
+    const fitted = fitToBudget(
+      p,
+      this.config.profileMemoryBudgetBytes,
+      valueIdx
+    );
+    // All samples of p were aggregated when only the over budget sample is
+    // left.
+    if (fitted !== p && fitted.sample!.length === 1) {
+      this.logger.warn(
+        'Every sample of a profile exceeds the memory budget of ' +
+          `${this.config.profileMemoryBudgetBytes} bytes; the profile only ` +
+          'holds their total, attributed to "(over memory budget)".'
+      );
+    }
+    return fitted;
+  }
+
+  /**
+   * @throws error when the memory limit of the cgroup of this process leaves
+   * less than minMemoryHeadroomBytes available for collecting a profile.
+   */
+  private checkMemoryHeadroom() {
+    if (!this.config.minMemoryHeadroomBytes) {
+      return;
+    }
+    const mem = readCgroupMemory();
+    if (!mem) {
+      return;
+    }
+    const headroom = mem.limitBytes - mem.usageBytes;
+    if (headroom < this.config.minMemoryHeadroomBytes) {
+      throw new Error(
+        `Insufficient memory headroom to collect profile: ${headroom} bytes ` +
+          `available, ${this.config.minMemoryHeadroomBytes} bytes required.`
+      );
+    }
+  }
+
+  /**
+   * @throws error when the memory needed to take and parse a heap snapshot
+   * is not available in the V8 heap, exceeds profileMemoryBudgetBytes, or
+   * would leave less than minMemoryHeadroomBytes available to the cgroup of
+   * this process, so that a code size profile never exhausts the memory of
+   * the process.
+   */
+  private checkSnapshotMemory() {
+    const needed = estimateSnapshotMemory();
+    if (needed.heapBytes > needed.availableHeapBytes) {
+      throw new Error(
+        `Insufficient heap to take heap snapshot: ${needed.heapBytes} bytes ` +
+          `needed, ${needed.availableHeapBytes} bytes available.`
+      );
+    }
+    const budget = this.config.profileMemoryBudgetBytes;
+    if (budget && needed.bytes > budget) {
+      throw new Error(
+        `Heap snapshot needs ${needed.bytes} bytes, which exceeds the ` +
+          `memory budget of ${budget} bytes.`
+      );
+    }
+    if (!this.config.minMemoryHeadroomBytes) {
+      return;
+    }
+    const mem = readCgroupMemory();
+    if (!mem) {
+      return;
+    }
+    const headroom = mem.limitBytes - mem.usageBytes - needed.bytes;
+    if (headroom < this.config.minMemoryHeadroomBytes) {
+      throw new Error(
+        `Insufficient memory headroom to take heap snapshot: ${needed.bytes} ` +
+          `bytes needed, ${mem.limitBytes - mem.usageBytes} bytes available.`
+      );
+    }
+  }
+
+  /**
+   * Waits, for at most governorMaxDeferMillis, while the process is too busy
+   * for a profile to be converted and encoded on the event loop.
+   */
+  private async deferWhileOverloaded() {
+    const waited = await this.governor.waitForCapacity();
+    if (waited > 0) {
+      this.logger.debug(
+        `Deferred profile encoding for ${msToStr(waited)} due to high load.`
+      );
+    }
   }
 }
@@ -0,0 +1,186 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as asyncHooks from 'async_hooks';
+import * as v8 from 'v8';
+
+import {perftools} from '../protos/profile';
+import {Frame} from './profile-utils';
+import {captureStack, nowNanos, StackDurations} from './stack-capture';
+
+/**
+ * The parts of v8.promiseHooks, available in Node 16.14 and later, used by
+ * PromiseProfiler.
+ */
+interface PromiseHooks {
+  createHook(callbacks: {
+    init(promise: object): void;
+    before(promise: object): void;
+    after(promise: object): void;
+  }): () => void;
+}
+
+interface SampledPromise {
+  frames: Frame[];
+  beforeNanos: number;
+}
+
+/**
+ * Records the creation of promises, and the time spent running the
+ * microtasks which continue them, attributed to the JavaScript stack which
+ * created each promise.
+ *
+ * Only one in every samplingInterval promises created is recorded, and the
+ * values recorded for it are scaled by samplingInterval, so that the cost of
+ * capturing stacks is bounded. A promise created by then(), catch() or
+ * finally() is continued by the microtask which runs the callback passed to
+ * that call, so the time of that microtask is attributed to the stack which
+ * registered the callback.
+ *
+ * Promise hooks of v8 are used when available, as they are cheaper than
+ * async hooks, which are used otherwise.
+ */
+export class PromiseProfiler {
+  private stopHook: (() => void) | undefined;
+  private countdown = 0;
+  private sampledPromises = new WeakMap<object, SampledPromise>();
+  private sampledIds = new Map<number, SampledPromise>();
+  private durations: StackDurations;
+
+  /**
+   * @param samplingInterval - one in every samplingInterval promises created
+   * is recorded.
+   * @param maxFrames - maximum number of frames captured per stack.
+   * @param maxPending - maximum number of recorded promises whose microtask
+   * has not run yet which are tracked at once when async hooks are used; the
+   * oldest is no longer tracked when this is exceeded.
+   * @param maxStacks - maximum number of distinct stacks; promises created
+   * from other stacks are recorded without a stack.
+   * @param ignorePath - promises whose stack contains a frame with a file
+   * name containing ignorePath, such as those of the agent itself, are not
+   * recorded.
+   */
+  constructor(
+    readonly samplingInterval: number,
+    readonly maxFrames: number,
+    readonly maxPending: number,
+    readonly maxStacks: number,
+    readonly ignorePath: string
+  ) {
+    this.durations = new StackDurations('', maxStacks);
+  }
+
+  /**
+   * Starts recording promises.
+   */
+  start() {
+    if (this.stopHook) {
+      return;
+    }
+    this.durations.reset();
+    this.countdown = this.samplingInterval;
+    const promiseHooks = (v8 as unknown as {promiseHooks?: PromiseHooks})
+      .promiseHooks;
+    if (promiseHooks) {
+      const init = (promise: object) => {
+        const s = this.sample(init);
+        if (s) {
+          this.sampledPromises.set(promise, s);
+        }
+      };
+      this.stopHook = promiseHooks.createHook({
+        init,
+        before: (promise: object) =>
+          this.before(this.sampledPromises.get(promise)),
+        after: (promise: object) =>
+          this.after(this.sampledPromises.get(promise)),
+      });
+      return;
+    }
+
+    const init = (asyncId: number, type: string) => {
+      const s = type === 'PROMISE' ? this.sample(init) : undefined;
+      if (!s) {
+        return;
+      }
+      if (this.sampledIds.size >= this.maxPending) {
+        this.sampledIds.delete(this.sampledIds.keys().next().value);
+      }
+      this.sampledIds.set(asyncId, s);
+    };
+    const hook = asyncHooks.createHook({
+      init,
+      before: (asyncId: number) => this.before(this.sampledIds.get(asyncId)),
+      after: (asyncId: number) => {
+        this.after(this.sampledIds.get(asyncId));
+        this.sampledIds.delete(asyncId);
+      },
+    });
+    hook.enable();
+    this.stopHook = () => hook.disable();
+  }
+
+  /**
+   * Stops recording promises.
+   *
+   * @return profile of the promises recorded, with sample types
+   * promises/count, the estimated number of promises created, and
+   * microtasks/nanoseconds, the estimated time spent running the microtasks
+   * which continued them.
+   */
+  stop(): perftools.profiles.IProfile {
+    if (this.stopHook) {
+      this.stopHook();
+      this.stopHook = undefined;
+    }
+    this.sampledPromises = new WeakMap();
+    this.sampledIds.clear();
+    return this.durations.profile('promises', 'microtasks');
+  }
+
+  /**
+   * @return the promise being created by the caller of below, if it is to be
+   * recorded.
+   */
+  // eslint-disable-next-line @typescript-eslint/ban-types
+  private sample(below: Function): SampledPromise | undefined {
+    if (--this.countdown > 0) {
+      return undefined;
+    }
+    this.countdown = this.samplingInterval;
+    const frames = captureStack(this.maxFrames, below);
+    if (
+      this.ignorePath &&
+      frames.some(f => f.filename.indexOf(this.ignorePath) >= 0)
+    ) {
+      return undefined;
+    }
+    this.durations.add('', frames, 0, this.samplingInterval);
+    return {frames, beforeNanos: 0};
+  }
+
+  private before(s: SampledPromise | undefined) {
+    if (s) {
+      s.beforeNanos = nowNanos();
+    }
+  }
+
+  private after(s: SampledPromise | undefined) {
+    if (s && s.beforeNanos) {
+      const nanos = (nowNanos() - s.beforeNanos) * this.samplingInterval;
+      this.durations.add('', s.frames, nanos, 0);
+      s.beforeNanos = 0;
+    }
+  }
+}
@@ -0,0 +1,136 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+import {
+  addComment,
+  addSyntheticLocation,
+  copyProfile,
+  removeUnreferenced,
+} from './profile-utils';
+
+export const PRUNED_FRAME = '(pruned)';
+
+/**
+ * Keeps the hottest stacks of p, as measured by the sample type at index
+ * valueIdx (the last sample type by default), and folds each remaining stack
+ * into a "(pruned)" frame under its deepest caller which is also a caller in
+ * a kept stack, so that the number of stacks is bounded independently of the
+ * shape of the profiled code while the time of pruned stacks stays
+ * attributed to their callers.
+ *
+ * A stack is kept when it is one of the maxStacks hottest stacks and the
+ * hotter stacks cover less than valueFraction of the total value. Either
+ * limit is ignored when 0. There are at most as many "(pruned)" stacks under
+ * a caller as kept stacks; other pruned stacks are folded into a single
+ * "(pruned)" stack without caller.
+ *
+ * @return p when no stacks were pruned, and the pruned profile otherwise.
+ */
+export function pruneStacks(
+  p: perftools.profiles.IProfile,
+  maxStacks: number,
+  valueFraction: number,
+  valueIdx?: number
+): perftools.profiles.IProfile {
+  const samples = (p.sample || []).slice();
+  if (
+    (!maxStacks || samples.length <= maxStacks) &&
+    (!valueFraction || valueFraction >= 1)
+  ) {
+    return p;
+  }
+  const numTypes = (p.sampleType || []).length;
+  const idx = valueIdx === undefined ? numTypes - 1 : valueIdx;
+  const value = (s: perftools.profiles.ISample) =>
+    Number((s.value || [])[idx] || 0);
+  samples.sort((a, b) => value(b) - value(a));
+
+  let total = 0;
+  for (const s of samples) {
+    total += value(s);
+  }
+  const maxValue = valueFraction > 0 ? valueFraction * total : Infinity;
+
+  const kept: perftools.profiles.ISample[] = [];
+  const pruned: perftools.profiles.ISample[] = [];
+  let covered = 0;
+  for (const s of samples) {
+    if ((!maxStacks || kept.length < maxStacks) && covered < maxValue) {
+      kept.push(s);
+      covered += value(s);
+    } else {
+      pruned.push(s);
+    }
+  }
+  if (pruned.length === 0) {
+    return p;
+  }
+
+  const out = copyProfile(p);
+  const prunedLocationId = addSyntheticLocation(out, PRUNED_FRAME);
+
+  // Location IDs are ordered leaf first, so the callers of a stack are its
+  // suffixes, keyed root first.
+  const callerKey = (ids: number[], depth: number) =>
+    ids.slice(ids.length - depth).join(',');
+  const keptCallers = new Set<string>();
+  for (const s of kept) {
+    const ids = (s.locationId || []).map(Number);
+    for (let depth = 1; depth <= ids.length; depth++) {
+      keptCallers.add(callerKey(ids, depth));
+    }
+  }
+
+  const tails = new Map<string, perftools.profiles.ISample>();
+  let callerTails = 0;
+  for (const s of pruned) {
+    const ids = (s.locationId || []).map(Number);
+    let depth = 0;
+    while (
+      depth < ids.length - 1 &&
+      keptCallers.has(callerKey(ids, depth + 1))
+    ) {
+      depth++;
+    }
+    let key = callerKey(ids, depth);
+    if (key && !tails.has(key)) {
+      if (callerTails < kept.length) {
+        callerTails++;
+      } else {
+        depth = 0;
+        key = '';
+      }
+    }
+    let tail = tails.get(key);
+    if (!tail) {
+      tail = new perftools.profiles.Sample({
+        locationId: [prunedLocationId, ...ids.slice(ids.length - depth)],
+        value: new Array(numTypes).fill(0),
+      });
+      tails.set(key, tail);
+    }
+    const tailValue = tail.value!;
+    (s.value || []).forEach((v, i) => {
+      tailValue[i] = Number(tailValue[i]) + Number(v);
+    });
+  }
+  out.sample = kept.concat(Array.from(tails.values()));
+  removeUnreferenced(out);
+  addComment(
+    out,
+    `${pruned.length} stacks folded into ${tails.size} ${PRUNED_FRAME} frames`
+  );
+  return out;
+}
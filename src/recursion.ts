@@ -0,0 +1,114 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+import {
+  addString,
+  copyProfile,
+  mergeSamples,
+  removeUnreferenced,
+} from './profile-utils';
+
+export const RECURSION_DEPTH_LABEL = 'recursion_depth';
+
+/**
+ * Collapses consecutive repetitions of the same cycle of at most
+ * maxCycleLength locations into a single occurrence of that cycle.
+ *
+ * This is done with a single pass over the stack, so arbitrarily deep stacks
+ * do not overflow the JavaScript stack.
+ *
+ * @param rootFirst - location IDs ordered from the root to the leaf.
+ * @return the folded stack, ordered from the root to the leaf, and the number
+ * of repetitions which were removed.
+ */
+export function foldStack(
+  rootFirst: number[],
+  maxCycleLength: number
+): {stack: number[]; depth: number} {
+  const stack: number[] = [];
+  let depth = 0;
+  for (const id of rootFirst) {
+    stack.push(id);
+    // A new frame can complete at most one repetition per cycle length, but
+    // removing it can expose a longer repetition, so repeat until stable.
+    let folded = true;
+    while (folded) {
+      folded = false;
+      const len = stack.length;
+      for (let l = 1; l <= maxCycleLength && 2 * l <= len; l++) {
+        let repeated = true;
+        for (let i = 1; i <= l; i++) {
+          if (stack[len - i] !== stack[len - l - i]) {
+            repeated = false;
+            break;
+          }
+        }
+        if (repeated) {
+          stack.length = len - l;
+          depth++;
+          folded = true;
+          break;
+        }
+      }
+    }
+  }
+  return {stack, depth};
+}
+
+/**
+ * Folds recursive cycles of at most maxCycleLength frames in the stack of
+ * each sample of p. Folded samples are labeled with the number of
+ * repetitions removed, and samples which become identical are merged.
+ *
+ * @return p when maxCycleLength is 0 or no stack contained recursion, and
+ * the folded profile otherwise.
+ */
+export function foldRecursion(
+  p: perftools.profiles.IProfile,
+  maxCycleLength: number
+): perftools.profiles.IProfile {
+  if (!maxCycleLength) {
+    return p;
+  }
+  const out = copyProfile(p);
+  let labelKey: number | undefined;
+  const samples: perftools.profiles.ISample[] = [];
+  let foldedAny = false;
+  for (const s of p.sample || []) {
+    const rootFirst = (s.locationId || []).map(Number).reverse();
+    const {stack, depth} = foldStack(rootFirst, maxCycleLength);
+    if (depth === 0) {
+      samples.push(s);
+      continue;
+    }
+    foldedAny = true;
+    if (labelKey === undefined) {
+      labelKey = addString(out, RECURSION_DEPTH_LABEL);
+    }
+    samples.push(
+      new perftools.profiles.Sample({
+        locationId: stack.reverse(),
+        value: (s.value || []).slice(),
+        label: (s.label || []).concat([{key: labelKey, num: depth}]),
+      })
+    );
+  }
+  if (!foldedAny) {
+    return p;
+  }
+  out.sample = mergeSamples(samples);
+  removeUnreferenced(out);
+  return out;
+}
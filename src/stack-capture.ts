@@ -0,0 +1,165 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {perftools} from '../protos/profile';
+import {ProfileBuilder} from './profile-builder';
+import {Frame, stackKey} from './profile-utils';
+
+/**
+ * @return true if filename is that of a module built into Node.js, such as
+ * "fs.js", "internal/fs/utils.js" or "node:fs".
+ */
+export function isNodeInternal(filename: string): boolean {
+  return (
+    filename.startsWith('node:') ||
+    filename.startsWith('internal/') ||
+    (filename.indexOf('/') < 0 && filename.indexOf('\\') < 0)
+  );
+}
+
+/**
+ * Captures the JavaScript stack of the caller of captureStack() from V8's
+ * structured call sites, without formatting it as a string.
+ *
+ * @param maxFrames - maximum number of frames captured, before frames of
+ * Node.js internals are removed.
+ * @param below - function whose frame, and those of its callees, are
+ * omitted. Defaults to captureStack() itself.
+ * @return frames of the stack, leaf first, excluding frames of Node.js
+ * internals.
+ */
+export function captureStack(
+  maxFrames: number,
+  // eslint-disable-next-line @typescript-eslint/ban-types
+  below: Function = captureStack
+): Frame[] {
+  const prevPrepare = Error.prepareStackTrace;
+  const prevLimit = Error.stackTraceLimit;
+  const holder: {stack?: NodeJS.CallSite[]} = {};
+  let callSites: NodeJS.CallSite[] | undefined;
+  try {
+    Error.prepareStackTrace = (_, cs) => cs;
+    Error.stackTraceLimit = maxFrames;
+    Error.captureStackTrace(holder, below);
+    // The stack is prepared when first read, so it must be read before
+    // prepareStackTrace is restored.
+    callSites = holder.stack;
+  } finally {
+    Error.prepareStackTrace = prevPrepare;
+    Error.stackTraceLimit = prevLimit;
+  }
+  const frames: Frame[] = [];
+  for (const cs of callSites || []) {
+    const filename = cs.getFileName() || '';
+    if (!filename || isNodeInternal(filename)) {
+      continue;
+    }
+    frames.push({
+      name: cs.getFunctionName() || cs.getMethodName() || '(anonymous)',
+      filename,
+      line: cs.getLineNumber() || 0,
+    });
+  }
+  return frames;
+}
+
+interface StackDuration {
+  label: string;
+  frames: Frame[];
+  count: number;
+  nanos: number;
+}
+
+/**
+ * @return a monotonic time in ns.
+ */
+export function nowNanos(): number {
+  const [seconds, nanos] = process.hrtime();
+  return seconds * 1e9 + nanos;
+}
+
+/**
+ * Sums the number and duration of events, such as I/O operations, by label
+ * and captured stack, and converts the sums to a profile.
+ */
+export class StackDurations {
+  private durations = new Map<string, StackDuration>();
+  private startMillis = Date.now();
+  private startNanos = nowNanos();
+
+  /**
+   * @param labelKey - key of the label of each sample.
+   * @param maxStacks - maximum number of distinct stacks; events with other
+   * stacks are recorded without a stack.
+   */
+  constructor(readonly labelKey: string, readonly maxStacks: number) {}
+
+  /**
+   * Records count events, started from the stack of frames, which took nanos
+   * ns in total.
+   *
+   * @param label - value of the label of the events, or '' for no label.
+   */
+  add(label: string, frames: Frame[], nanos: number, count = 1) {
+    let key = `${label}|${stackKey(frames)}`;
+    let d = this.durations.get(key);
+    if (!d && this.durations.size >= this.maxStacks) {
+      key = `${label}|`;
+      d = this.durations.get(key);
+      frames = [];
+    }
+    if (d) {
+      d.count += count;
+      d.nanos += nanos;
+    } else {
+      this.durations.set(key, {label, frames, count, nanos});
+    }
+  }
+
+  /**
+   * @return profile with sample types countType/count and
+   * durationType/nanoseconds of the events recorded since the previous call,
+   * or since this was constructed or reset.
+   */
+  profile(
+    countType: string,
+    durationType: string
+  ): perftools.profiles.IProfile {
+    const builder = ProfileBuilder.create([
+      {type: countType, unit: 'count'},
+      {type: durationType, unit: 'nanoseconds'},
+    ]);
+    for (const d of this.durations.values()) {
+      builder.addSample(
+        d.frames,
+        [d.count, d.nanos],
+        d.label ? {[this.labelKey]: d.label} : {}
+      );
+    }
+    const p = builder.profile;
+    p.timeNanos = this.startMillis * 1e6;
+    p.durationNanos = nowNanos() - this.startNanos;
+    this.reset();
+    return p;
+  }
+
+  /**
+   * Discards the events recorded so far.
+   */
+  reset() {
+    this.durations.clear();
+    this.startMillis = Date.now();
+    this.startNanos = nowNanos();
+  }
+}
@@ -0,0 +1,271 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import {Writer} from 'protobufjs/minimal';
+
+import {perftools} from '../protos/profile';
+import {getString, NumberOrLong} from './profile-utils';
+
+// Tags (field number and wire type) of the repeated fields of the pprof
+// Profile message which are encoded from the cache.
+const LOCATION_TAG = (4 << 3) | 2;
+const FUNCTION_TAG = (5 << 3) | 2;
+const STRING_TAG = (6 << 3) | 2;
+
+const EMPTY_STRING = Writer.create().uint32(STRING_TAG).string('').finish();
+
+/**
+ * Counts of the entries added to a SymbolTable while encoding a profile.
+ */
+export interface SymbolTableStats {
+  newStrings: number;
+  newFunctions: number;
+  newLocations: number;
+  // True if the table was cleared because it had reached its maximum size.
+  reset: boolean;
+}
+
+/**
+ * Per-process table of the strings, functions and locations of profiles,
+ * which assigns IDs that are stable across profiles and caches the encoded
+ * form of each entry. Only entries not seen in earlier profiles need to be
+ * encoded.
+ *
+ * Because string table indices are positions in the string table of each
+ * profile, and are shared by all profiles, a profile includes the strings it
+ * references at their positions, and an empty string at the position of each
+ * other string of the table up to the last one it references. The table is
+ * cleared, and IDs are reassigned, once it holds more than maxEntries
+ * strings, functions or locations.
+ */
+export class SymbolTable {
+  private strings = new Map<string, number>();
+  private encodedStrings: Uint8Array[] = [];
+  private functions = new Map<string, number>();
+  private encodedFunctions: Uint8Array[] = [];
+  // IDs of the strings referenced by each function, indexed by function ID.
+  private functionStrings: number[][] = [];
+  private locations = new Map<string, number>();
+  private encodedLocations: Uint8Array[] = [];
+  private stats: SymbolTableStats = {
+    newStrings: 0,
+    newFunctions: 0,
+    newLocations: 0,
+    reset: false,
+  };
+
+  constructor(readonly maxEntries: number) {
+    this.clear();
+  }
+
+  private clear() {
+    this.strings.clear();
+    this.encodedStrings = [];
+    this.functions.clear();
+    this.encodedFunctions = [];
+    this.functionStrings = [];
+    this.locations.clear();
+    this.encodedLocations = [];
+    this.stringId('');
+  }
+
+  private full(): boolean {
+    return (
+      this.strings.size > this.maxEntries ||
+      this.functions.size > this.maxEntries ||
+      this.locations.size > this.maxEntries
+    );
+  }
+
+  /**
+   * @return counts of the entries added by the most recent call to encode().
+   */
+  lastStats(): SymbolTableStats {
+    return Object.assign({}, this.stats);
+  }
+
+  private stringId(s: string): number {
+    let id = this.strings.get(s);
+    if (id === undefined) {
+      id = this.strings.size;
+      this.strings.set(s, id);
+      this.encodedStrings.push(
+        Writer.create().uint32(STRING_TAG).string(s).finish()
+      );
+      this.stats.newStrings++;
+    }
+    return id;
+  }
+
+  private functionId(
+    f: perftools.profiles.IFunction,
+    name: number,
+    systemName: number,
+    filename: number
+  ): number {
+    const startLine = Number(f.startLine || 0);
+    const key = `${name},${systemName},${filename},${startLine}`;
+    let id = this.functions.get(key);
+    if (id === undefined) {
+      id = this.functions.size + 1;
+      this.functions.set(key, id);
+      const w = Writer.create();
+      perftools.profiles.Function.encode(
+        {id, name, systemName, filename, startLine},
+        w.uint32(FUNCTION_TAG).fork()
+      ).ldelim();
+      this.encodedFunctions.push(w.finish());
+      this.functionStrings.push([name, systemName, filename]);
+      this.stats.newFunctions++;
+    }
+    return id;
+  }
+
+  private locationId(
+    loc: perftools.profiles.ILocation,
+    lines: perftools.profiles.ILine[]
+  ): number {
+    const address = Number(loc.address || 0);
+    const key =
+      `${address};` + lines.map(l => `${l.functionId}:${l.line}`).join(';');
+    let id = this.locations.get(key);
+    if (id === undefined) {
+      id = this.locations.size + 1;
+      this.locations.set(key, id);
+      const w = Writer.create();
+      perftools.profiles.Location.encode(
+        {id, address, line: lines},
+        w.uint32(LOCATION_TAG).fork()
+      ).ldelim();
+      this.encodedLocations.push(w.finish());
+      this.stats.newLocations++;
+    }
+    return id;
+  }
+
+  /**
+   * Encodes p as a serialized pprof Profile message, using the IDs of this
+   * table for strings, functions and locations.
+   */
+  encode(p: perftools.profiles.IProfile): Uint8Array {
+    this.stats = {
+      newStrings: 0,
+      newFunctions: 0,
+      newLocations: 0,
+      reset: false,
+    };
+    if (this.full()) {
+      this.clear();
+      this.stats.reset = true;
+    }
+    const usedStrings = new Set<number>([0]);
+    const str = (idx: NumberOrLong) => {
+      const id = this.stringId(getString(p, idx));
+      usedStrings.add(id);
+      return id;
+    };
+    const fnStr = (idx: NumberOrLong) => this.stringId(getString(p, idx));
+
+    const functionIds = new Map<number, number>();
+    for (const f of p.function || []) {
+      functionIds.set(
+        Number(f.id),
+        this.functionId(
+          f,
+          fnStr(f.name),
+          fnStr(f.systemName),
+          fnStr(f.filename)
+        )
+      );
+    }
+    const locationIds = new Map<number, number>();
+    for (const loc of p.location || []) {
+      const lines = (loc.line || []).map(l => ({
+        functionId: functionIds.get(Number(l.functionId)) || 0,
+        line: Number(l.line || 0),
+      }));
+      locationIds.set(Number(loc.id), this.locationId(loc, lines));
+    }
+
+    const usedLocations = new Set<number>();
+    const sample = (p.sample || []).map(s => {
+      const locationId = (s.locationId || []).map(
+        id => locationIds.get(Number(id)) || 0
+      );
+      locationId.forEach(id => usedLocations.add(id));
+      return {
+        locationId,
+        value: s.value,
+        label: (s.label || []).map(l => ({
+          key: str(l.key),
+          str: l.str ? str(l.str) : undefined,
+          num: l.num,
+          numUnit: l.numUnit ? str(l.numUnit) : undefined,
+        })),
+      };
+    });
+    const valueType = (t: perftools.profiles.IValueType) => ({
+      type: str(t.type),
+      unit: str(t.unit),
+    });
+
+    const head = perftools.profiles.Profile.encode({
+      sampleType: (p.sampleType || []).map(valueType),
+      sample,
+      mapping: (p.mapping || []).map(m =>
+        Object.assign({}, m, {
+          filename: str(m.filename),
+          buildId: str(m.buildId),
+        })
+      ),
+      dropFrames: p.dropFrames ? str(p.dropFrames) : undefined,
+      keepFrames: p.keepFrames ? str(p.keepFrames) : undefined,
+      timeNanos: p.timeNanos,
+      durationNanos: p.durationNanos,
+      periodType: p.periodType ? valueType(p.periodType) : undefined,
+      period: p.period,
+      comment: (p.comment || []).map(str),
+      defaultSampleType: p.defaultSampleType
+        ? str(p.defaultSampleType)
+        : undefined,
+    }).finish();
+
+    // Repeated fields may be split across the encoded message, so cached
+    // entries can be appended after the other fields.
+    const usedFunctions = new Set<number>();
+    const parts: Uint8Array[] = [head];
+    for (const loc of p.location || []) {
+      const id = locationIds.get(Number(loc.id))!;
+      if (usedLocations.has(id)) {
+        usedLocations.delete(id);
+        parts.push(this.encodedLocations[id - 1]);
+        for (const l of loc.line || []) {
+          usedFunctions.add(functionIds.get(Number(l.functionId)) || 0);
+        }
+      }
+    }
+    for (const id of usedFunctions) {
+      if (id > 0) {
+        parts.push(this.encodedFunctions[id - 1]);
+        this.functionStrings[id - 1].forEach(s => usedStrings.add(s));
+      }
+    }
+    let lastString = 0;
+    usedStrings.forEach(id => (lastString = Math.max(lastString, id)));
+    for (let id = 0; id <= lastString; id++) {
+      parts.push(usedStrings.has(id) ? this.encodedStrings[id] : EMPTY_STRING);
+    }
+    return Buffer.concat(parts);
+  }
+}
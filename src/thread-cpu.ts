@@ -0,0 +1,51 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+
+/**
+ * @return the CPU time, in ns, consumed by the calling thread, read from
+ * its Linux schedstat file, or undefined when that cannot be read, such as
+ * on other platforms.
+ */
+export function readThreadCpuNanos(
+  file = '/proc/thread-self/schedstat'
+): number | undefined {
+  let contents: string;
+  try {
+    contents = fs.readFileSync(file, 'utf8');
+  } catch (e) {
+    return undefined;
+  }
+  const n = Number(contents.split(' ')[0]);
+  return isNaN(n) ? undefined : n;
+}
+
+/**
+ * @return description of the CPU time, cpuNanos ns, consumed by the main
+ * thread while a time profile of wallNanos ns was collected, to be added to
+ * the profile as a comment.
+ *
+ * Only the total is reported: a thread's CPU time cannot be attributed to the
+ * stacks sampled by the time profiler, but it separates profiles which were
+ * compute-bound from those which were blocked.
+ */
+export function formatThreadCpu(cpuNanos: number, wallNanos: number): string {
+  const s = `main thread CPU time: ${cpuNanos} nanoseconds`;
+  if (!(wallNanos > 0)) {
+    return s;
+  }
+  const percent = ((100 * cpuNanos) / wallNanos).toFixed(1);
+  return `${s} (${percent}% of ${wallNanos} nanoseconds wall time)`;
+}
@@ -0,0 +1,229 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as fs from 'fs';
+import * as path from 'path';
+import * as perfHooks from 'perf_hooks';
+
+import {loadMeter} from './governor';
+
+/**
+ * Measurements of the process since the previous measurement, which are
+ * compared with the thresholds of a TriggerMonitor.
+ */
+export interface TriggerMetrics {
+  // 99th percentile of event loop delay, in ms.
+  eventLoopDelayP99Millis: number;
+  // CPU time used by the process divided by elapsed time.
+  cpuUtilization: number;
+  // Change in resident set size per second.
+  rssGrowthBytesPerSecond: number;
+}
+
+/**
+ * Thresholds above which a profile is captured. A threshold of 0 disables
+ * the corresponding trigger.
+ */
+export type TriggerThresholds = TriggerMetrics;
+
+/**
+ * A threshold which was exceeded, and the type of profile to capture.
+ */
+export interface Trigger {
+  // Name of the trigger, such as "event_loop_delay".
+  reason: string;
+  profileType: 'WALL' | 'HEAP';
+}
+
+/**
+ * Measures the process since the previous measurement, or since it was
+ * created.
+ */
+interface TriggerMeter {
+  measure(): TriggerMetrics;
+  // Stops monitoring the event loop delay.
+  stop(): void;
+}
+
+function triggerMeter(): TriggerMeter {
+  // monitorEventLoopDelay() is not available before Node 11.10.
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  const monitor = (perfHooks as any).monitorEventLoopDelay;
+  const histogram =
+    typeof monitor === 'function' ? monitor({resolution: 10}) : undefined;
+  if (histogram) {
+    histogram.enable();
+  }
+  const load = loadMeter();
+  let prevRss = process.memoryUsage().rss;
+  let prevTime = Date.now();
+  const measure = () => {
+    let eventLoopDelayP99Millis = 0;
+    if (histogram) {
+      eventLoopDelayP99Millis = histogram.percentile(99) / 1e6;
+      histogram.reset();
+    }
+    const rss = process.memoryUsage().rss;
+    const now = Date.now();
+    const elapsedSeconds = (now - prevTime) / 1000;
+    const rssGrowthBytesPerSecond =
+      elapsedSeconds > 0 ? (rss - prevRss) / elapsedSeconds : 0;
+    prevRss = rss;
+    prevTime = now;
+    return {
+      eventLoopDelayP99Millis,
+      cpuUtilization: load().cpuUtilization,
+      rssGrowthBytesPerSecond,
+    };
+  };
+  const stop = () => {
+    if (histogram) {
+      histogram.disable();
+    }
+  };
+  return {measure, stop};
+}
+
+/**
+ * @return the first threshold exceeded by metrics, or undefined when no
+ * threshold was exceeded. Latency and CPU triggers capture a wall profile,
+ * and the RSS growth trigger captures a heap profile.
+ */
+export function exceededTrigger(
+  thresholds: TriggerThresholds,
+  metrics: TriggerMetrics
+): Trigger | undefined {
+  if (
+    thresholds.eventLoopDelayP99Millis > 0 &&
+    metrics.eventLoopDelayP99Millis > thresholds.eventLoopDelayP99Millis
+  ) {
+    return {reason: 'event_loop_delay', profileType: 'WALL'};
+  }
+  if (
+    thresholds.cpuUtilization > 0 &&
+    metrics.cpuUtilization > thresholds.cpuUtilization
+  ) {
+    return {reason: 'cpu', profileType: 'WALL'};
+  }
+  if (
+    thresholds.rssGrowthBytesPerSecond > 0 &&
+    metrics.rssGrowthBytesPerSecond > thresholds.rssGrowthBytesPerSecond
+  ) {
+    return {reason: 'rss_growth', profileType: 'HEAP'};
+  }
+  return undefined;
+}
+
+/**
+ * Periodically measures the process and calls onTrigger when a threshold is
+ * exceeded. onTrigger is called at most once every minIntervalMillis.
+ */
+export class TriggerMonitor {
+  private timer: NodeJS.Timeout | undefined;
+  private lastTriggerMillis: number | undefined;
+  private meter: TriggerMeter | undefined;
+
+  /**
+   * @param measure - for testing. Measures the process instead of the meter
+   * created by start().
+   */
+  constructor(
+    readonly thresholds: TriggerThresholds,
+    readonly checkIntervalMillis: number,
+    readonly minIntervalMillis: number,
+    private onTrigger: (trigger: Trigger) => void,
+    private measure?: () => TriggerMetrics
+  ) {}
+
+  enabled(): boolean {
+    return (
+      this.thresholds.eventLoopDelayP99Millis > 0 ||
+      this.thresholds.cpuUtilization > 0 ||
+      this.thresholds.rssGrowthBytesPerSecond > 0
+    );
+  }
+
+  start() {
+    if (this.timer || !this.enabled()) {
+      return;
+    }
+    // The meter is created a full interval before its first measurement, so
+    // that the measurement is not dominated by the creation of the meter.
+    if (!this.measure) {
+      this.meter = triggerMeter();
+    }
+    this.timer = setInterval(() => this.check(), this.checkIntervalMillis);
+    this.timer.unref();
+  }
+
+  stop() {
+    if (this.timer) {
+      clearInterval(this.timer);
+      this.timer = undefined;
+    }
+    if (this.meter) {
+      this.meter.stop();
+      this.meter = undefined;
+    }
+  }
+
+  /**
+   * @return the trigger for which onTrigger was called, or undefined if no
+   * threshold was exceeded, a trigger fired less than minIntervalMillis ago,
+   * or the monitor was not started.
+   *
+   * Public for testing.
+   */
+  check(nowMillis = Date.now()): Trigger | undefined {
+    const measure = this.measure || (this.meter && this.meter.measure);
+    if (!measure) {
+      return undefined;
+    }
+    const trigger = exceededTrigger(this.thresholds, measure());
+    if (
+      !trigger ||
+      (this.lastTriggerMillis !== undefined &&
+        nowMillis - this.lastTriggerMillis < this.minIntervalMillis)
+    ) {
+      return undefined;
+    }
+    this.lastTriggerMillis = nowMillis;
+    this.onTrigger(trigger);
+    return trigger;
+  }
+}
+
+/**
+ * Writes a gzipped, serialized profile captured by a trigger to a new file
+ * in dir.
+ *
+ * @return path of the new file.
+ */
+export function writeTriggeredProfile(
+  dir: string,
+  trigger: Trigger,
+  bytes: Buffer,
+  timeMillis = Date.now()
+): string {
+  if (!fs.existsSync(dir)) {
+    fs.mkdirSync(dir);
+  }
+  const time = new Date(timeMillis).toISOString().replace(/[:-]/g, '');
+  const file = path.join(
+    dir,
+    `${trigger.profileType.toLowerCase()}-${trigger.reason}-${time}.pb.gz`
+  );
+  fs.writeFileSync(file, bytes);
+  return file;
+}
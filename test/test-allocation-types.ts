@@ -0,0 +1,114 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {addTypeLabels, allocationType} from '../src/allocation-types';
+import {ProfileBuilder} from '../src/profile-builder';
+import {getString} from '../src/profile-utils';
+
+describe('allocationType', () => {
+  it('should return constructor allocating', () => {
+    assert.strictEqual(
+      allocationType([
+        {name: 'LRUCache', filename: '/app/cache.js', line: 1},
+        {name: 'Server', filename: '/app/server.js', line: 1},
+      ]),
+      'LRUCache'
+    );
+  });
+
+  it('should ignore constructors calling function allocating', () => {
+    assert.strictEqual(
+      allocationType([
+        {name: 'set', filename: '/app/cache.js', line: 5},
+        {name: 'LRUCache', filename: '/app/cache.js', line: 1},
+      ]),
+      ''
+    );
+  });
+
+  it('should return constructor allocating fields of its object', () => {
+    // Built-in constructors, such as Map, are not frames of heap profiles,
+    // so the Map allocated by "this.items = new Map()" has the type of the
+    // constructor which allocated it.
+    assert.strictEqual(
+      allocationType([{name: 'LRUCache', filename: '/app/cache.js', line: 2}]),
+      'LRUCache'
+    );
+  });
+
+  it('should return type allocated by Node.js internals', () => {
+    assert.strictEqual(
+      allocationType([
+        {name: 'allocUnsafe', filename: 'node:buffer', line: 3},
+        {name: 'Reader', filename: '/app/io.js', line: 2},
+      ]),
+      'Buffer'
+    );
+  });
+
+  it('should return empty string when leaf does not indicate type', () => {
+    assert.strictEqual(
+      allocationType([{name: 'helper', filename: '/app/a.js', line: 1}]),
+      ''
+    );
+  });
+});
+
+describe('addTypeLabels', () => {
+  const builder = ProfileBuilder.create([
+    {type: 'objects', unit: 'count'},
+    {type: 'space', unit: 'bytes'},
+  ]);
+  builder.addSample(
+    [
+      {name: 'LRUCache', filename: '/app/cache.js', line: 1},
+      {name: 'main', filename: '/app/index.js', line: 9},
+    ],
+    [2, 100]
+  );
+  builder.addSample(
+    [
+      {name: 'allocUnsafe', filename: 'node:buffer', line: 3},
+      {name: 'read', filename: '/app/io.js', line: 2},
+    ],
+    [1, 300]
+  );
+  builder.addSample(
+    [
+      {name: 'helper', filename: '/app/a.js', line: 1},
+      {name: 'Parser', filename: '/app/a.js', line: 20},
+    ],
+    [1, 50]
+  );
+
+  it('should label samples and sum live bytes by type', () => {
+    const {profile, totals} = addTypeLabels(builder.profile);
+    assert.deepStrictEqual(
+      profile.sample!.map(s =>
+        (s.label || []).map(
+          l => `${getString(profile, l.key)}=${getString(profile, l.str)}`
+        )
+      ),
+      [['type=LRUCache'], ['type=Buffer'], []]
+    );
+    assert.deepStrictEqual(totals, [
+      {type: 'Buffer', bytes: 300},
+      {type: 'LRUCache', bytes: 100},
+      {type: '(unknown)', bytes: 50},
+    ]);
+  });
+});
@@ -0,0 +1,234 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import * as path from 'path';
+import * as tmp from 'tmp';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {
+  collapsedStacks,
+  diffFunctions,
+  flameGraphHtml,
+  readStacks,
+  readStacksFile,
+  sampleTypeIndex,
+  speedscopeProfile,
+  StackReader,
+  topFunctions,
+} from '../src/analysis';
+import {main} from '../src/analyze-cli';
+import {mergeProfiles} from '../src/merge';
+import {timeProfile} from './profiles-for-tests';
+
+function encode(p: perftools.profiles.IProfile): Buffer {
+  return Buffer.from(perftools.profiles.Profile.encode(p).finish());
+}
+
+const timeStacks = readStacks(zlib.gzipSync(encode(timeProfile)));
+
+describe('readStacks', () => {
+  it('should sum samples by stack of frame names', () => {
+    assert.deepStrictEqual(timeStacks.sampleTypes, [
+      {type: 'sample', unit: 'count'},
+      {type: 'wall', unit: 'microseconds'},
+    ]);
+    assert.deepStrictEqual(timeStacks.stacks, [
+      {
+        frames: ['function2 script2', 'function1 script1'],
+        values: [1, 1000],
+      },
+      {frames: ['function1 script1'], values: [3, 3000]},
+      {
+        frames: ['function1 script1', 'function1 script2'],
+        values: [2, 2000],
+      },
+      {
+        frames: ['function1 script1', 'function1 script1'],
+        values: [1, 1000],
+      },
+    ]);
+  });
+
+  it('should read uncompressed profile', () => {
+    assert.deepStrictEqual(readStacks(encode(timeProfile)), timeStacks);
+  });
+
+  it('should read profile pushed one byte at a time', () => {
+    const bytes = encode(timeProfile);
+    const reader = new StackReader();
+    for (let i = 0; i < bytes.length; i++) {
+      reader.push(bytes.slice(i, i + 1));
+    }
+    assert.deepStrictEqual(reader.profile(), timeStacks);
+  });
+
+  it('should throw error when profile is truncated', () => {
+    const bytes = encode(timeProfile);
+    assert.throws(
+      () => readStacks(bytes.slice(0, bytes.length - 1)),
+      /truncated/
+    );
+  });
+});
+
+describe('readStacksFile', () => {
+  const dir = tmp.dirSync({unsafeCleanup: true}).name;
+
+  it('should stream gzipped profile', async () => {
+    const file = path.join(dir, 'wall.pb.gz');
+    fs.writeFileSync(file, zlib.gzipSync(encode(timeProfile)));
+    assert.deepStrictEqual(await readStacksFile(file), timeStacks);
+  });
+
+  it('should stream uncompressed profile', async () => {
+    const file = path.join(dir, 'wall.pb');
+    fs.writeFileSync(file, encode(timeProfile));
+    assert.deepStrictEqual(await readStacksFile(file), timeStacks);
+  });
+});
+
+describe('sampleTypeIndex', () => {
+  it('should default to last sample type', () => {
+    assert.strictEqual(sampleTypeIndex(timeStacks), 1);
+    assert.strictEqual(sampleTypeIndex(timeStacks, 'sample'), 0);
+  });
+
+  it('should throw when sample type is not in profile', () => {
+    assert.throws(
+      () => sampleTypeIndex(timeStacks, 'space'),
+      /Profile has no sample type space; sample types are sample, wall/
+    );
+  });
+});
+
+describe('topFunctions', () => {
+  it('should compute flat and cumulative values', () => {
+    assert.deepStrictEqual(topFunctions(timeStacks, 1), [
+      {name: 'function1 script1', flat: 5000, cum: 7000},
+      {name: 'function1 script2', flat: 2000, cum: 2000},
+      {name: 'function2 script2', flat: 0, cum: 1000},
+    ]);
+  });
+});
+
+describe('collapsedStacks', () => {
+  it('should write one line per stack', () => {
+    assert.strictEqual(
+      collapsedStacks(timeStacks, 1),
+      [
+        'function1 script1 3000',
+        'function1 script1;function1 script1 1000',
+        'function1 script1;function1 script2 2000',
+        'function2 script2;function1 script1 1000',
+        '',
+      ].join('\n')
+    );
+  });
+});
+
+describe('speedscopeProfile', () => {
+  it('should share frames between samples', () => {
+    // eslint-disable-next-line @typescript-eslint/no-explicit-any
+    const out = speedscopeProfile(timeStacks, 1, 'wall') as any;
+    assert.deepStrictEqual(out.shared.frames, [
+      {name: 'function2 script2'},
+      {name: 'function1 script1'},
+      {name: 'function1 script2'},
+    ]);
+    assert.deepStrictEqual(out.profiles[0].samples, [
+      [0, 1],
+      [1],
+      [1, 2],
+      [1, 1],
+    ]);
+    assert.deepStrictEqual(out.profiles[0].weights, [1000, 3000, 2000, 1000]);
+    assert.strictEqual(out.profiles[0].unit, 'microseconds');
+    assert.strictEqual(out.profiles[0].endValue, 7000);
+  });
+});
+
+describe('flameGraphHtml', () => {
+  it('should embed escaped title and tree', () => {
+    const html = flameGraphHtml(timeStacks, 1, '<wall>');
+    assert.ok(html.includes('<title>&#60;wall&#62;</title>'), html);
+    assert.ok(html.includes('{"n":"all","v":7000,"c":['), html);
+  });
+});
+
+describe('diffFunctions', () => {
+  it('should order functions by change in flat value', () => {
+    const doubled = readStacks(
+      encode(mergeProfiles([timeProfile, timeProfile]))
+    );
+    assert.deepStrictEqual(diffFunctions(timeStacks, doubled, 1), [
+      {name: 'function1 script1', base: 5000, other: 10000, delta: 5000},
+      {name: 'function1 script2', base: 2000, other: 4000, delta: 2000},
+    ]);
+  });
+});
+
+describe('analyze CLI', () => {
+  const dir = tmp.dirSync({unsafeCleanup: true}).name;
+  const input = path.join(dir, 'wall.pb.gz');
+  fs.writeFileSync(input, zlib.gzipSync(encode(timeProfile)));
+
+  it('should print top functions', async () => {
+    let out = '';
+    assert.strictEqual(
+      await main(['top', '-n', '1', input], s => (out += s)),
+      0
+    );
+    assert.strictEqual(
+      out,
+      [
+        'Total wall: 7000 microseconds',
+        'flat  flat%   sum%  cum    cum% function',
+        '5000 71.43% 71.43% 7000 100.00% function1 script1',
+        '',
+      ].join('\n')
+    );
+  });
+
+  it('should write output to file', async () => {
+    const output = path.join(dir, 'wall.html');
+    assert.strictEqual(await main(['flamegraph', '-o', output, input]), 0);
+    assert.ok(fs.readFileSync(output, 'utf8').startsWith('<!DOCTYPE html>'));
+  });
+
+  it('should print usage when inputs are missing', async () => {
+    const logs: string[] = [];
+    assert.strictEqual(
+      await main(['diff', input], undefined, m => logs.push(m)),
+      2
+    );
+    assert.ok(logs[0].startsWith('Usage:'));
+  });
+
+  it('should fail when input cannot be read', async () => {
+    const logs: string[] = [];
+    assert.strictEqual(
+      await main(
+        ['top', path.join(dir, 'missing')],
+        undefined,
+        m => logs.push(m)
+      ),
+      1
+    );
+    assert.ok(logs[0].startsWith('Failed to analyze'));
+  });
+});
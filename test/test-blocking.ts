@@ -0,0 +1,128 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {afterEach, describe, it} from 'mocha';
+import * as path from 'path';
+import * as tmp from 'tmp';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {BlockingCallProfiler} from '../src/blocking';
+import {getString, locationFrames} from '../src/profile-utils';
+
+function readThisFileSync() {
+  return fs.readFileSync(__filename);
+}
+
+/**
+ * @return the samples of p with the value of their "call" label and the
+ * name of the leaf function of their stacks.
+ */
+function blockingSamples(p: perftools.profiles.IProfile) {
+  const frames = locationFrames(p);
+  return (p.sample || []).map(s => {
+    const leaf = (s.locationId || [])[0];
+    return {
+      call: getString(p, s.label![0].str),
+      count: Number(s.value![0]),
+      nanos: Number(s.value![1]),
+      leaf: leaf === undefined ? '' : frames.get(Number(leaf))![0].name,
+    };
+  });
+}
+
+describe('BlockingCallProfiler', () => {
+  const readFileSync = fs.readFileSync;
+  let profiler: BlockingCallProfiler | undefined;
+  afterEach(() => {
+    if (profiler) {
+      profiler.stop();
+      profiler = undefined;
+    }
+  });
+
+  it('should record synchronous calls by stack', () => {
+    profiler = new BlockingCallProfiler(64, 100, '');
+    profiler.start();
+    readThisFileSync();
+    readThisFileSync();
+    zlib.gzipSync(Buffer.from('blocking'));
+    const p = profiler.stop();
+
+    assert.deepStrictEqual(
+      p.sampleType!.map(t => getString(p, t.type)),
+      ['blocking_calls', 'blocking']
+    );
+    const samples = blockingSamples(p);
+    const reads = samples.filter(s => s.call === 'fs.readFileSync');
+    assert.strictEqual(reads.length, 1, JSON.stringify(samples));
+    assert.strictEqual(reads[0].leaf, 'readThisFileSync');
+    assert.strictEqual(reads[0].count, 2);
+    assert.ok(reads[0].nanos > 0);
+    assert.ok(samples.some(s => s.call === 'zlib.gzipSync'));
+  });
+
+  it('should only record outermost of nested synchronous calls', () => {
+    const file = path.join(tmp.dirSync({unsafeCleanup: true}).name, 'out');
+    profiler = new BlockingCallProfiler(64, 100, '');
+    profiler.start();
+    // fs.writeFileSync calls fs.openSync, fs.writeSync and fs.closeSync.
+    fs.writeFileSync(file, Buffer.from('blocking'));
+    const samples = blockingSamples(profiler.stop());
+    assert.deepStrictEqual(
+      samples.map(s => [s.call, s.count]),
+      [['fs.writeFileSync', 1]]
+    );
+  });
+
+  it('should restore synchronous functions when stopped', () => {
+    profiler = new BlockingCallProfiler(64, 100, '');
+    profiler.start();
+    assert.notStrictEqual(fs.readFileSync, readFileSync);
+    assert.strictEqual(fs.readFileSync.name, 'readFileSync');
+    assert.strictEqual(
+      typeof fs.realpathSync.native,
+      'function',
+      'expected properties of wrapped function to be kept'
+    );
+    profiler.stop();
+    assert.strictEqual(fs.readFileSync, readFileSync);
+    readThisFileSync();
+    assert.deepStrictEqual(profiler.stop().sample, []);
+  });
+
+  it('should propagate errors of synchronous calls', () => {
+    profiler = new BlockingCallProfiler(64, 100, '');
+    profiler.start();
+    assert.throws(() => fs.readFileSync('/nonexistent/file'), /ENOENT/);
+    const samples = blockingSamples(profiler.stop());
+    assert.ok(samples.some(s => s.call === 'fs.readFileSync'));
+  });
+
+  it('should not record calls from ignored path', () => {
+    profiler = new BlockingCallProfiler(64, 100, 'test-blocking');
+    profiler.start();
+    readThisFileSync();
+    assert.deepStrictEqual(profiler.stop().sample, []);
+  });
+
+  it('should allow only one profiler to record at a time', () => {
+    profiler = new BlockingCallProfiler(64, 100, '');
+    profiler.start();
+    const other = new BlockingCallProfiler(64, 100, '');
+    assert.throws(() => other.start(), /already being collected/);
+  });
+});
@@ -0,0 +1,263 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {EventEmitter} from 'events';
+import {describe, it} from 'mocha';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {
+  attachWorker,
+  ClusterCoordinator,
+  ClusterWorker,
+  workerInstance,
+  WorkerSelection,
+} from '../src/cluster';
+import {ProfilerConfig} from '../src/config';
+import {decodeProfile} from '../src/merge';
+import {RequestProfile} from '../src/profiler';
+import {heapProfile} from './profiles-for-tests';
+
+// In-process stand-in for the cluster module in the primary, which connects
+// each worker to a fake worker process.
+class FakeCluster extends EventEmitter {
+  workers: {[id: string]: ClusterWorker} = {};
+
+  addWorker(id: number): EventEmitter & {send(message: object): boolean} {
+    // eslint-disable-next-line @typescript-eslint/no-explicit-any
+    const proc: any = new EventEmitter();
+    proc.connected = true;
+    const worker = {
+      id,
+      send: (message: object) => {
+        setImmediate(() => proc.emit('message', message));
+        return true;
+      },
+      isConnected: () => true,
+    };
+    proc.send = (message: object) => {
+      setImmediate(() => this.emit('message', worker, message));
+      return true;
+    };
+    this.workers[String(id)] = worker;
+    return proc;
+  }
+}
+
+function fakeProfiler(profile: (prof: RequestProfile) => RequestProfile) {
+  return {
+    config: {instance: 'host'} as ProfilerConfig,
+    profile: async (prof: RequestProfile) => profile(prof),
+  };
+}
+
+const requestProf: RequestProfile = {
+  name: 'projects/12345678901/test-projectId',
+  profileType: 'HEAP',
+};
+
+describe('workerInstance', () => {
+  it('should derive worker instance from host instance', () => {
+    assert.strictEqual(workerInstance('host', 2), 'host-worker-2');
+    assert.strictEqual(workerInstance(undefined, 2), 'worker-2');
+  });
+});
+
+describe('ClusterCoordinator', () => {
+  it('should select workers in rotation', () => {
+    const cluster = new FakeCluster();
+    cluster.addWorker(1);
+    cluster.addWorker(2);
+    const coordinator = new ClusterCoordinator(
+      WorkerSelection.Rotation,
+      1000,
+      cluster
+    );
+    const ids = [1, 2, 3].map(() => coordinator.selectWorker()!.id);
+    assert.deepStrictEqual(ids, [1, 2, 1]);
+  });
+
+  it('should select worker with highest CPU utilization', () => {
+    const cluster = new FakeCluster();
+    cluster.addWorker(1);
+    cluster.addWorker(2);
+    const coordinator = new ClusterCoordinator(
+      WorkerSelection.Cpu,
+      1000,
+      cluster
+    );
+    cluster.emit('message', cluster.workers['2'], {
+      type: 'cloud-profiler:load',
+      cpuUtilization: 0.8,
+    });
+    cluster.emit('message', cluster.workers['1'], {
+      type: 'cloud-profiler:load',
+      cpuUtilization: 0.1,
+    });
+    assert.strictEqual(coordinator.selectWorker()!.id, 2);
+    assert.strictEqual(coordinator.selectWorker()!.id, 2);
+  });
+
+  it('should collect profile from worker', async () => {
+    const cluster = new FakeCluster();
+    const proc = cluster.addWorker(3);
+    attachWorker(
+      fakeProfiler(prof =>
+        Object.assign({}, prof, {profileBytes: 'profile-bytes'})
+      ),
+      3,
+      proc
+    );
+    const coordinator = new ClusterCoordinator(
+      WorkerSelection.Rotation,
+      1000,
+      cluster
+    );
+    const prof = await coordinator.collect(requestProf);
+    assert.strictEqual(prof.profileBytes, 'profile-bytes');
+    assert.deepStrictEqual(prof.labels, {instance: 'host-worker-3'});
+  });
+
+  it('should reject when worker fails to collect profile', async () => {
+    const cluster = new FakeCluster();
+    const proc = cluster.addWorker(1);
+    attachWorker(
+      fakeProfiler(() => {
+        throw new Error('heap profiler not enabled');
+      }),
+      1,
+      proc
+    );
+    const coordinator = new ClusterCoordinator(
+      WorkerSelection.Rotation,
+      1000,
+      cluster
+    );
+    await assert.rejects(
+      coordinator.collect(requestProf),
+      /heap profiler not enabled/
+    );
+  });
+
+  it('should not reply once disconnected from primary', async () => {
+    // eslint-disable-next-line @typescript-eslint/no-explicit-any
+    const proc: any = new EventEmitter();
+    proc.connected = true;
+    let sent = 0;
+    proc.send = () => {
+      sent++;
+      return true;
+    };
+    attachWorker(
+      fakeProfiler(prof => {
+        // The primary disconnects while the profile is collected.
+        proc.connected = false;
+        proc.emit('disconnect');
+        return prof;
+      }),
+      1,
+      proc
+    );
+    proc.emit('message', {type: 'cloud-profiler:collect', id: 1, prof: {}});
+    await new Promise(resolve => setImmediate(resolve));
+    assert.strictEqual(sent, 0);
+  });
+
+  it('should reject when worker does not reply in time', async () => {
+    const cluster = new FakeCluster();
+    cluster.addWorker(1);
+    const coordinator = new ClusterCoordinator(
+      WorkerSelection.Rotation,
+      10,
+      cluster
+    );
+    await assert.rejects(
+      coordinator.collect(requestProf),
+      /did not return profile within 10ms/
+    );
+  });
+
+  it('should reject when there are no workers', async () => {
+    const coordinator = new ClusterCoordinator(
+      WorkerSelection.Rotation,
+      1000,
+      new FakeCluster()
+    );
+    await assert.rejects(
+      coordinator.collect(requestProf),
+      /No cluster worker is available/
+    );
+  });
+
+  it('should merge profiles collected from all workers', async () => {
+    const cluster = new FakeCluster();
+    const profileBytes = zlib
+      .gzipSync(perftools.profiles.Profile.encode(heapProfile).finish())
+      .toString('base64');
+    for (const id of [1, 2]) {
+      attachWorker(
+        fakeProfiler(prof => Object.assign({}, prof, {profileBytes})),
+        id,
+        cluster.addWorker(id)
+      );
+    }
+    cluster.addWorker(3);
+    const coordinator = new ClusterCoordinator(
+      WorkerSelection.Rotation,
+      10,
+      cluster
+    );
+    const prof = await coordinator.collectMerged(requestProf, {
+      instance: 'host',
+    });
+    assert.deepStrictEqual(prof.labels, {instance: 'host'});
+    const p = decodeProfile(Buffer.from(prof.profileBytes!, 'base64'));
+    assert.deepStrictEqual(
+      p.sample!.map(s => s.value!.map(Number)),
+      [
+        [8, 52],
+        [46, 2320],
+        [10, 10240],
+      ]
+    );
+  });
+  it('should bound samples of merged profile', async () => {
+    const cluster = new FakeCluster();
+    const profileBytes = zlib
+      .gzipSync(perftools.profiles.Profile.encode(heapProfile).finish())
+      .toString('base64');
+    for (const id of [1, 2]) {
+      attachWorker(
+        fakeProfiler(prof => Object.assign({}, prof, {profileBytes})),
+        id,
+        cluster.addWorker(id)
+      );
+    }
+    const coordinator = new ClusterCoordinator(
+      WorkerSelection.Rotation,
+      1000,
+      cluster
+    );
+    const prof = await coordinator.collectMerged(requestProf, {}, 1);
+    const p = decodeProfile(Buffer.from(prof.profileBytes!, 'base64'));
+    assert.deepStrictEqual(
+      p.sample!.map(s => s.value!.map(Number)),
+      [
+        [8, 52],
+        [56, 12560],
+      ]
+    );
+  });
+});
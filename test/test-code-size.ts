@@ -0,0 +1,350 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import delay from 'delay';
+import {describe, it} from 'mocha';
+
+import {
+  codeSizeProfile,
+  codeSizes,
+  estimateSnapshotMemory,
+  HeapSnapshot,
+  takeHeapSnapshot,
+} from '../src/code-size';
+import {getString, locationFrames} from '../src/profile-utils';
+
+type SnapshotNode = {
+  type: string;
+  name: string;
+  size: number;
+  // Type, name or index, and index of target node of each edge.
+  edges?: Array<[string, string | number, number]>;
+};
+
+/**
+ * @return heap snapshot with the nodes listed, whose closures at node
+ * indices locations[i][0] have line locations[i][1] and column
+ * locations[i][2].
+ */
+function heapSnapshot(
+  nodeList: SnapshotNode[],
+  locations: Array<[number, number, number]>
+): HeapSnapshot {
+  const nodeTypes = ['hidden', 'array', 'string', 'object', 'code', 'closure'];
+  const edgeTypes = ['context', 'element', 'property', 'internal', 'hidden'];
+  const strings: string[] = [];
+  const str = (s: string) => {
+    const idx = strings.indexOf(s);
+    return idx >= 0 ? idx : strings.push(s) - 1;
+  };
+  const nodeFields = 6;
+  const nodes: number[] = [];
+  const edges: number[] = [];
+  nodeList.forEach((n, i) => {
+    const edgeList = n.edges || [];
+    nodes.push(
+      nodeTypes.indexOf(n.type),
+      str(n.name),
+      i + 1,
+      n.size,
+      edgeList.length,
+      0
+    );
+    for (const [type, name, to] of edgeList) {
+      edges.push(
+        edgeTypes.indexOf(type),
+        typeof name === 'number' ? name : str(name),
+        to * nodeFields
+      );
+    }
+  });
+  return {
+    snapshot: {
+      meta: {
+        node_fields: [
+          'type',
+          'name',
+          'id',
+          'self_size',
+          'edge_count',
+          'trace_node_id',
+        ],
+        node_types: [
+          nodeTypes,
+          'string',
+          'number',
+          'number',
+          'number',
+          'number',
+        ],
+        edge_fields: ['type', 'name_or_index', 'to_node'],
+        edge_types: [edgeTypes, 'string_or_number', 'node'],
+        location_fields: ['object_index', 'script_id', 'line', 'column'],
+      },
+    },
+    nodes,
+    edges,
+    locations: ([] as number[]).concat(
+      ...locations.map(([n, line, column]) => [n * nodeFields, 1, line, column])
+    ),
+    strings,
+  };
+}
+
+// Nodes as they appear in heap snapshots of Node.js 20, in which code
+// objects are unnamed. Two closures of "work", with bytecode and optimized
+// code, one of "warm", with bytecode and baseline code, and one of "idle",
+// which has not been compiled and whose code is a builtin.
+const snapshot = heapSnapshot(
+  [
+    // 0, 1: closures of work.
+    {
+      type: 'closure',
+      name: 'work',
+      size: 64,
+      edges: [
+        ['internal', 'shared', 2],
+        ['internal', 'code', 6],
+      ],
+    },
+    {
+      type: 'closure',
+      name: 'work',
+      size: 64,
+      edges: [
+        ['internal', 'shared', 2],
+        ['internal', 'code', 6],
+      ],
+    },
+    // 2: shared function info of work.
+    {
+      type: 'code',
+      name: 'work',
+      size: 56,
+      edges: [
+        ['internal', 'script_or_debug_info', 3],
+        ['internal', 'function_data', 5],
+      ],
+    },
+    // 3, 4: script.
+    {
+      type: 'code',
+      name: '/app/work.js',
+      size: 144,
+      edges: [
+        ['internal', 'source', 22],
+        ['internal', 'name', 4],
+      ],
+    },
+    {type: 'string', name: '/app/work.js', size: 40},
+    // 5: bytecode of work.
+    {
+      type: 'code',
+      name: 'system / BytecodeArray',
+      size: 100,
+      edges: [
+        ['internal', 'map', 10],
+        ['hidden', 2, 11],
+      ],
+    },
+    // 6 - 9: optimized code of work, and its instructions and metadata.
+    {
+      type: 'code',
+      name: '',
+      size: 88,
+      edges: [
+        ['internal', 'relocation_info', 8],
+        ['internal', 'deoptimization_data', 7],
+        ['internal', 'map', 10],
+        ['hidden', 0, 9],
+      ],
+    },
+    {type: 'code', name: '(code deopt data)', size: 200},
+    {type: 'code', name: '(code relocation info)', size: 40},
+    {type: 'code', name: '', size: 400},
+    // 10: map shared by code objects.
+    {type: 'hidden', name: 'system / Map', size: 72},
+    // 11: source positions of the bytecode of work.
+    {type: 'code', name: '(source position table)', size: 20},
+    // 12 - 17: closure of warm, whose script is referenced through debug
+    // info, and its bytecode and baseline code.
+    {
+      type: 'closure',
+      name: 'warm',
+      size: 64,
+      edges: [
+        ['internal', 'shared', 13],
+        ['internal', 'code', 15],
+      ],
+    },
+    {
+      type: 'code',
+      name: 'warm',
+      size: 56,
+      edges: [
+        ['internal', 'script_or_debug_info', 23],
+        ['internal', 'function_data', 15],
+      ],
+    },
+    {type: 'code', name: 'system / BytecodeArray', size: 60},
+    {
+      type: 'code',
+      name: '',
+      size: 88,
+      edges: [
+        ['internal', 'interpreter_data', 14],
+        ['internal', 'bytecode_offset_table', 16],
+        ['internal', 'map', 10],
+        ['hidden', 0, 17],
+      ],
+    },
+    {type: 'code', name: '(bytecode offset table)', size: 24},
+    {type: 'code', name: '(code for warm)', size: 128},
+    // 18 - 21: closure of idle.
+    {
+      type: 'closure',
+      name: 'idle',
+      size: 64,
+      edges: [
+        ['internal', 'shared', 19],
+        ['internal', 'code', 21],
+      ],
+    },
+    {
+      type: 'code',
+      name: 'idle',
+      size: 56,
+      edges: [
+        ['internal', 'script_or_debug_info', 3],
+        ['internal', 'function_data', 20],
+      ],
+    },
+    {
+      type: 'code',
+      name: 'system / UncompiledDataWithoutPreparseData',
+      size: 16,
+    },
+    {
+      type: 'code',
+      name: '(InterpreterEntryTrampoline builtin handle)',
+      size: 88,
+      edges: [['internal', 'map', 10]],
+    },
+    // 22: source of the script.
+    {type: 'string', name: 'function work() {}', size: 40},
+    // 23: debug info of warm.
+    {
+      type: 'hidden',
+      name: 'system / DebugInfo',
+      size: 72,
+      edges: [
+        ['internal', 'map', 10],
+        ['hidden', 0, 13],
+        ['hidden', 1, 3],
+      ],
+    },
+  ],
+  [
+    [0, 9, 4],
+    [1, 9, 4],
+    [12, 19, 0],
+    [18, 29, 0],
+  ]
+);
+
+// A function run often enough to be optimized before the heap snapshot of
+// this process is taken.
+function sumOfSquares(values: number[]): number {
+  let sum = 0;
+  for (const v of values) {
+    sum += v * v;
+  }
+  return sum;
+}
+
+describe('codeSizes', () => {
+  it('should sum code of each function once', () => {
+    assert.deepStrictEqual(codeSizes(snapshot), [
+      {
+        name: 'work',
+        filename: '/app/work.js',
+        line: 9,
+        column: 4,
+        bytecodeBytes: 120,
+        baselineBytes: 0,
+        optimizedBytes: 728,
+      },
+      {
+        name: 'warm',
+        filename: '/app/work.js',
+        line: 19,
+        column: 0,
+        bytecodeBytes: 60,
+        baselineBytes: 240,
+        optimizedBytes: 0,
+      },
+    ]);
+  });
+
+  it('should read heap snapshot of this process', async () => {
+    const values = Array.from({length: 100}, (_, i) => i);
+    let total = 0;
+    // Optimized code is compiled concurrently, and installed while the
+    // event loop runs.
+    for (let round = 0; round < 10; round++) {
+      for (let i = 0; i < 10000; i++) {
+        total += sumOfSquares(values);
+      }
+      await delay(10);
+    }
+    assert.ok(total > 0);
+
+    const sizes = codeSizes(await takeHeapSnapshot());
+    assert.ok(sizes.some(s => s.bytecodeBytes > 0));
+    const hot = sizes.find(s => s.name === 'sumOfSquares');
+    assert.ok(hot, 'expected code of sumOfSquares');
+    assert.strictEqual(hot!.filename, __filename);
+    assert.ok(hot!.optimizedBytes > 0, JSON.stringify(hot));
+  });
+});
+
+describe('codeSizeProfile', () => {
+  it('should add one sample per function', () => {
+    const p = codeSizeProfile(codeSizes(snapshot));
+    assert.deepStrictEqual(
+      p.sampleType!.map(t => getString(p, t.type)),
+      ['bytecode', 'baseline', 'optimized', 'code']
+    );
+    assert.strictEqual(p.sample!.length, 2);
+    assert.deepStrictEqual(p.sample![0].value, [120, 0, 728, 848]);
+    const frames = locationFrames(p).get(Number(p.sample![0].locationId![0]));
+    assert.deepStrictEqual(frames, [
+      {name: 'work', filename: '/app/work.js', line: 10},
+    ]);
+  });
+});
+
+describe('estimateSnapshotMemory', () => {
+  it('should grow with the bytes used by the V8 heap', () => {
+    const needed = estimateSnapshotMemory({
+      used_heap_size: 100e6,
+      heap_size_limit: 2000e6,
+    });
+    assert.ok(needed.bytes > 100e6);
+    assert.ok(needed.heapBytes > 100e6);
+    assert.ok(needed.heapBytes <= needed.bytes);
+    assert.strictEqual(needed.availableHeapBytes, 1900e6);
+  });
+});
@@ -0,0 +1,252 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as childProcess from 'child_process';
+import delay from 'delay';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import * as net from 'net';
+import * as path from 'path';
+import * as tmp from 'tmp';
+
+import {defaultConfig, ProfilerConfig} from '../src/config';
+import {
+  connectToDaemon,
+  encodeFrame,
+  FrameDecoder,
+  MAX_FRAME_BYTES,
+  ProfilerDaemon,
+} from '../src/daemon';
+import {ProfileCollector, Profiler, RequestProfile} from '../src/profiler';
+
+const config = Object.assign({}, defaultConfig, {
+  projectId: 'test-projectId',
+  serviceContext: {service: 'test-service', version: 'v1'},
+  instance: 'host',
+  logLevel: 0,
+}) as ProfilerConfig;
+
+describe('FrameDecoder', () => {
+  it('should decode messages split across chunks', () => {
+    const bytes = Buffer.concat([
+      encodeFrame({a: 1}),
+      encodeFrame({b: 'two'}),
+    ]);
+    const decoder = new FrameDecoder();
+    assert.deepStrictEqual(decoder.push(bytes.slice(0, 3)), []);
+    assert.deepStrictEqual(decoder.push(bytes.slice(3, 12)), [{a: 1}]);
+    assert.deepStrictEqual(decoder.push(bytes.slice(12)), [{b: 'two'}]);
+  });
+
+  it('should decode message pushed one byte at a time', () => {
+    const message = {data: 'x'.repeat(1000)};
+    const bytes = encodeFrame(message);
+    const decoder = new FrameDecoder();
+    for (let i = 0; i < bytes.length - 1; i++) {
+      assert.deepStrictEqual(decoder.push(bytes.slice(i, i + 1)), []);
+    }
+    assert.deepStrictEqual(decoder.push(bytes.slice(bytes.length - 1)), [
+      message,
+    ]);
+  });
+
+  it('should reject frame larger than maximum size', () => {
+    const header = Buffer.alloc(4);
+    header.writeUInt32BE(MAX_FRAME_BYTES + 1, 0);
+    assert.throws(() => new FrameDecoder().push(header), /exceeds maximum/);
+  });
+});
+
+describe('ProfilerDaemon', () => {
+  it('should collect profiles from connected process', async () => {
+    const socketPath = path.join(
+      tmp.dirSync({unsafeCleanup: true}).name,
+      'daemon.sock'
+    );
+    const groupConfigs: ProfilerConfig[] = [];
+    let collector: ProfileCollector | undefined;
+    const daemon = new ProfilerDaemon(config, c => {
+      groupConfigs.push(c);
+      return {
+        useCollector: (f: ProfileCollector) => (collector = f),
+        runLoop: () => {},
+      } as unknown as Profiler;
+    });
+    await daemon.listen(socketPath);
+
+    const client = {
+      config,
+      profile: async (prof: RequestProfile) =>
+        Object.assign({}, prof, {profileBytes: 'client-bytes'}),
+    } as unknown as Profiler;
+    connectToDaemon(client, socketPath);
+    while (!collector) {
+      await delay(10);
+    }
+    // Let the daemon register the connection of the client.
+    await delay(10);
+
+    try {
+      assert.deepStrictEqual(groupConfigs[0].serviceContext, {
+        service: 'test-service',
+        version: 'v1',
+      });
+      const prof = await collector({name: 'profile', profileType: 'HEAP'});
+      assert.strictEqual(prof.profileBytes, 'client-bytes');
+      assert.deepStrictEqual(prof.labels, {
+        instance: `host-worker-${process.pid}`,
+      });
+    } finally {
+      daemon.close();
+    }
+  });
+
+  it('should stop profiling group when its last process disconnects', async () => {
+    const socketPath = path.join(
+      tmp.dirSync({unsafeCleanup: true}).name,
+      'daemon.sock'
+    );
+    let started = 0;
+    let stopped = 0;
+    const daemon = new ProfilerDaemon(
+      config,
+      () =>
+        ({
+          useCollector: () => {},
+          runLoop: () => started++,
+          stop: () => stopped++,
+        } as unknown as Profiler)
+    );
+    await daemon.listen(socketPath);
+    const hello = encodeFrame({
+      type: 'cloud-profiler:hello',
+      service: 'test-service',
+      version: 'v1',
+    });
+    const connect = async () => {
+      const socket = net.createConnection(socketPath);
+      socket.write(hello);
+      await delay(20);
+      return socket;
+    };
+
+    try {
+      const first = await connect();
+      const second = await connect();
+      assert.strictEqual(started, 1);
+      first.destroy();
+      await delay(20);
+      assert.strictEqual(stopped, 0);
+      second.destroy();
+      await delay(20);
+      assert.strictEqual(stopped, 1);
+
+      (await connect()).destroy();
+      await delay(20);
+      assert.strictEqual(started, 2);
+    } finally {
+      daemon.close();
+    }
+  });
+
+  it('should restrict socket to the user running the daemon', async () => {
+    const socketPath = path.join(
+      tmp.dirSync({unsafeCleanup: true}).name,
+      'daemon.sock'
+    );
+    const daemon = new ProfilerDaemon(config);
+    await daemon.listen(socketPath);
+    try {
+      assert.strictEqual(fs.statSync(socketPath).mode & 0o777, 0o600);
+    } finally {
+      daemon.close();
+    }
+  });
+
+  it('should replace socket left by a daemon which exited', async () => {
+    const socketPath = path.join(
+      tmp.dirSync({unsafeCleanup: true}).name,
+      'daemon.sock'
+    );
+    // A process which exits while listening leaves its socket behind.
+    childProcess.execFileSync(process.execPath, [
+      '-e',
+      `require('net').createServer().listen(${JSON.stringify(socketPath)}, ` +
+        '() => process.exit(0));',
+    ]);
+    assert.ok(fs.lstatSync(socketPath).isSocket());
+    const daemon = new ProfilerDaemon(config);
+    await daemon.listen(socketPath);
+    daemon.close();
+  });
+
+  it('should not replace file which is not a socket', async () => {
+    const socketPath = path.join(
+      tmp.dirSync({unsafeCleanup: true}).name,
+      'daemon.sock'
+    );
+    fs.writeFileSync(socketPath, 'data');
+    await assert.rejects(
+      new ProfilerDaemon(config).listen(socketPath),
+      /is not a socket/
+    );
+    assert.strictEqual(fs.readFileSync(socketPath, 'utf8'), 'data');
+  });
+
+  it('should not replace socket of a listening daemon', async () => {
+    const socketPath = path.join(
+      tmp.dirSync({unsafeCleanup: true}).name,
+      'daemon.sock'
+    );
+    const daemon = new ProfilerDaemon(config);
+    await daemon.listen(socketPath);
+    try {
+      await assert.rejects(
+        new ProfilerDaemon(config).listen(socketPath),
+        /already listening/
+      );
+    } finally {
+      daemon.close();
+    }
+  });
+
+  it('should close connection of process with invalid service', async () => {
+    const socketPath = path.join(
+      tmp.dirSync({unsafeCleanup: true}).name,
+      'daemon.sock'
+    );
+    let started = 0;
+    const daemon = new ProfilerDaemon(
+      config,
+      () =>
+        ({
+          useCollector: () => {},
+          runLoop: () => started++,
+        } as unknown as Profiler)
+    );
+    await daemon.listen(socketPath);
+    try {
+      const socket = net.createConnection(socketPath);
+      const closed = new Promise(resolve => socket.on('close', resolve));
+      socket.write(
+        encodeFrame({type: 'cloud-profiler:hello', service: '../Other'})
+      );
+      await closed;
+      assert.strictEqual(started, 0);
+    } finally {
+      daemon.close();
+    }
+  });
+});
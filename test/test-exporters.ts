@@ -0,0 +1,187 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {afterEach, describe, it} from 'mocha';
+import * as nock from 'nock';
+import * as path from 'path';
+import * as tmp from 'tmp';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {
+  createExporter,
+  ExportedProfile,
+  ExporterOptions,
+  FanOutExporter,
+  FileExporter,
+  OtlpExporter,
+  ProfileExporter,
+  PyroscopeExporter,
+} from '../src/exporters';
+import {timeProfile} from './profiles-for-tests';
+
+const pprofBytes = Buffer.from(
+  perftools.profiles.Profile.encode(timeProfile).finish()
+);
+
+const exported: ExportedProfile = {
+  profileType: 'WALL',
+  profileBytes: zlib.gzipSync(pprofBytes),
+  service: 'test-service',
+  version: '1.0',
+  labels: {instance: 'test-instance'},
+  startMillis: Date.UTC(2021, 0, 2, 3, 4, 5),
+  durationMillis: 10 * 1000,
+};
+
+class FailingExporter implements ProfileExporter {
+  readonly name = 'failing';
+  async export(): Promise<void> {
+    throw new Error('backend unavailable');
+  }
+}
+
+describe('FileExporter', () => {
+  it('should write profile to new file', async () => {
+    const dir = path.join(tmp.dirSync({unsafeCleanup: true}).name, 'out');
+    await new FileExporter(dir).export(exported);
+    const file = path.join(dir, 'test-service-wall-20210102T030405.000Z.pb.gz');
+    assert.deepStrictEqual(fs.readFileSync(file), exported.profileBytes);
+  });
+});
+
+describe('OtlpExporter', () => {
+  afterEach(() => {
+    nock.cleanAll();
+  });
+
+  it('should send profile as original payload', async () => {
+    // eslint-disable-next-line @typescript-eslint/no-explicit-any
+    let body: any;
+    const collector = nock('http://localhost:4318', {
+      reqheaders: {'x-api-key': 'secret'},
+    })
+      .post('/v1development/profiles', b => {
+        body = b;
+        return true;
+      })
+      .reply(200, {});
+    await new OtlpExporter('http://localhost:4318/', {
+      'x-api-key': 'secret',
+    }).export(exported);
+    assert.ok(collector.isDone(), 'expected call to collector');
+
+    const resource = body.resourceProfiles[0].resource;
+    assert.deepStrictEqual(resource.attributes, [
+      {key: 'service.name', value: {stringValue: 'test-service'}},
+      {key: 'service.version', value: {stringValue: '1.0'}},
+      {key: 'service.instance.id', value: {stringValue: 'test-instance'}},
+    ]);
+    const profile = body.resourceProfiles[0].scopeProfiles[0].profiles[0];
+    assert.strictEqual(profile.originalPayloadFormat, 'pprof');
+    assert.deepStrictEqual(
+      Buffer.from(profile.originalPayload, 'base64'),
+      pprofBytes
+    );
+    assert.strictEqual(profile.durationNanos, '10000000000');
+  });
+
+  it('should reject when collector responds with error', async () => {
+    nock('http://localhost:4318')
+      .post('/v1development/profiles')
+      .reply(503);
+    await assert.rejects(
+      new OtlpExporter('http://localhost:4318').export(exported),
+      /responded with status 503/
+    );
+  });
+});
+
+describe('PyroscopeExporter', () => {
+  afterEach(() => {
+    nock.cleanAll();
+  });
+
+  it('should send profile to ingest API', async () => {
+    let body = '';
+    const server = nock('http://localhost:4040', {
+      reqheaders: {
+        authorization: 'Bearer token',
+        'content-type': /^multipart\/form-data; boundary=/,
+      },
+    })
+      .post('/ingest')
+      .query({
+        name: 'test-service{version=1.0,instance=test-instance}',
+        from: '1609556645',
+        until: '1609556655',
+        format: 'pprof',
+        spyName: 'nodespy',
+      })
+      .reply(200, (uri, b) => {
+        // nock passes binary request bodies hex-encoded.
+        body = Buffer.from(b as string, 'hex').toString('latin1');
+        return '';
+      });
+    await new PyroscopeExporter('http://localhost:4040', 'token').export(
+      exported
+    );
+    assert.ok(server.isDone(), 'expected call to ingest API');
+    assert.ok(body.includes('name="profile"'), body);
+    assert.ok(body.includes('name="sample_type_config"'), body);
+  });
+});
+
+describe('FanOutExporter', () => {
+  it('should export to all exporters when one fails', async () => {
+    const dir = tmp.dirSync({unsafeCleanup: true}).name;
+    const exporter = new FanOutExporter([
+      new FailingExporter(),
+      new FileExporter(dir),
+    ]);
+    await assert.rejects(
+      exporter.export(exported),
+      /Failed to export profile to failing: Error: backend unavailable/
+    );
+    assert.strictEqual(fs.readdirSync(dir).length, 1);
+  });
+});
+
+describe('createExporter', () => {
+  const options: ExporterOptions = {
+    exportProfileDir: '',
+    otlpProfilesEndpoint: '',
+    otlpHeaders: {},
+    pyroscopeServerAddress: '',
+    pyroscopeAuthToken: '',
+    exporters: [],
+  };
+
+  it('should return undefined when no exporter is enabled', () => {
+    assert.strictEqual(createExporter(options), undefined);
+  });
+
+  it('should fan out to all enabled exporters', () => {
+    const exporter = createExporter(
+      Object.assign({}, options, {
+        exportProfileDir: '/tmp/profiles',
+        pyroscopeServerAddress: 'http://localhost:4040',
+        exporters: [new FailingExporter()],
+      })
+    );
+    assert.strictEqual(exporter!.name, 'file,pyroscope,failing');
+  });
+});
@@ -0,0 +1,122 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {excludeAgentSamples, trimFrames} from '../src/filter';
+import {ProfileBuilder} from '../src/profile-builder';
+import {getString, locationFrames} from '../src/profile-utils';
+import {timeProfile} from './profiles-for-tests';
+
+describe('excludeAgentSamples', () => {
+  it('should return profile unchanged when no samples match', () => {
+    const {profile, overhead} = excludeAgentSamples(
+      timeProfile,
+      '@google-cloud/profiler'
+    );
+    assert.strictEqual(profile, timeProfile);
+    assert.deepStrictEqual(overhead, {samples: 0, values: [0, 0]});
+  });
+
+  it('should remove samples with matching frames and report overhead', () => {
+    const {profile, overhead} = excludeAgentSamples(timeProfile, 'script2');
+    assert.deepStrictEqual(overhead, {samples: 2, values: [3, 3000]});
+    assert.deepStrictEqual(profile.sample!.map(s => s.locationId), [
+      [2],
+      [4, 2],
+    ]);
+    assert.deepStrictEqual(profile.location!.map(l => l.id), [2, 4]);
+    assert.deepStrictEqual(profile.function!.map(f => f.id), [2]);
+    assert.deepStrictEqual(
+      profile.comment!.map(c => getString(profile, c)),
+      ['agent overhead: 2 samples, sample/count=3, wall/microseconds=3000']
+    );
+    // The input profile must not be modified.
+    assert.strictEqual(timeProfile.sample!.length, 4);
+  });
+
+  it('should remove agent frames which call back into user code', () => {
+    const agent = '/app/node_modules/@google-cloud/profiler/build/src/a.js';
+    const main = {name: 'main', filename: '/app/main.js', line: 1};
+    const wrap = {name: 'wrap', filename: agent, line: 2};
+    const builder = ProfileBuilder.create([
+      {type: 'sample', unit: 'count'},
+      {type: 'wall', unit: 'microseconds'},
+    ]);
+    builder.addSample(
+      [{name: 'callback', filename: '/app/main.js', line: 5}, wrap, main],
+      [1, 1000]
+    );
+    builder.addSample(
+      [{name: 'callback', filename: '/app/main.js', line: 5}, main],
+      [2, 2000]
+    );
+    builder.addSample(
+      [{name: 'gzipSync', filename: 'node:zlib', line: 3}, wrap, main],
+      [4, 4000]
+    );
+
+    const {profile, overhead} = excludeAgentSamples(
+      builder.profile,
+      '@google-cloud/profiler'
+    );
+    assert.deepStrictEqual(overhead, {samples: 1, values: [4, 4000]});
+    const frames = locationFrames(profile);
+    assert.deepStrictEqual(
+      profile.sample!.map(s => ({
+        stack: s.locationId!.map(id => frames.get(Number(id))![0].name),
+        value: s.value!.map(Number),
+      })),
+      [{stack: ['callback', 'main'], value: [3, 3000]}]
+    );
+    assert.deepStrictEqual(
+      profile.function!.map(f => getString(profile, f.name)),
+      ['callback', 'main']
+    );
+  });
+});
+
+describe('trimFrames', () => {
+  it('should return profile unchanged when dropFrames is empty', () => {
+    assert.strictEqual(trimFrames(timeProfile, '', 'function1'), timeProfile);
+  });
+
+  it('should drop matching frames and the frames they call', () => {
+    const profile = trimFrames(timeProfile, 'function2', '');
+    assert.deepStrictEqual(
+      profile.sample!.map(s => ({
+        locationId: s.locationId,
+        value: s.value!.map(Number),
+      })),
+      [
+        {locationId: [2], value: [4, 4000]},
+        {locationId: [3, 2], value: [2, 2000]},
+        {locationId: [4, 2], value: [1, 1000]},
+      ]
+    );
+    assert.deepStrictEqual(profile.location!.map(l => l.id), [2, 3, 4]);
+    assert.strictEqual(getString(profile, profile.dropFrames), 'function2');
+    assert.strictEqual(profile.keepFrames, timeProfile.keepFrames);
+  });
+
+  it('should not drop frames matching keepFrames', () => {
+    const profile = trimFrames(timeProfile, 'function.*', 'function2');
+    assert.deepStrictEqual(
+      profile.sample!.map(s => s.locationId),
+      timeProfile.sample!.map(s => s.locationId)
+    );
+    assert.strictEqual(getString(profile, profile.keepFrames), 'function2');
+  });
+});
@@ -0,0 +1,69 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import * as path from 'path';
+import * as tmp from 'tmp';
+
+import {FlightRecorder} from '../src/flight-recorder';
+
+describe('FlightRecorder', () => {
+  it('should keep at most maxProfiles profiles', () => {
+    const recorder = new FlightRecorder(2, 1024);
+    recorder.add('HEAP', Buffer.from('a'), 1);
+    recorder.add('WALL', Buffer.from('b'), 2);
+    recorder.add('HEAP', Buffer.from('c'), 3);
+    assert.deepStrictEqual(
+      recorder.profiles().map(p => p.timeMillis),
+      [2, 3]
+    );
+    assert.strictEqual(recorder.bytes(), 2);
+  });
+
+  it('should keep at most maxBytes bytes', () => {
+    const recorder = new FlightRecorder(10, 5);
+    recorder.add('HEAP', Buffer.from('aaa'), 1);
+    recorder.add('WALL', Buffer.from('bbb'), 2);
+    assert.deepStrictEqual(
+      recorder.profiles().map(p => p.timeMillis),
+      [2]
+    );
+    assert.strictEqual(recorder.bytes(), 3);
+  });
+
+  it('should not add profile larger than maxBytes', () => {
+    const recorder = new FlightRecorder(10, 5);
+    recorder.add('HEAP', Buffer.from('aaa'), 1);
+    recorder.add('WALL', Buffer.from('bbbbbb'), 2);
+    assert.deepStrictEqual(
+      recorder.profiles().map(p => p.timeMillis),
+      [1]
+    );
+  });
+
+  it('should write each profile to a file', () => {
+    const dir = path.join(tmp.dirSync({unsafeCleanup: true}).name, 'dump');
+    const recorder = new FlightRecorder(10, 1024);
+    recorder.add('HEAP', Buffer.from('heap'), 0);
+    recorder.add('WALL', Buffer.from('wall'), 1000);
+    const files = recorder.dump(dir);
+    assert.strictEqual(files.length, 2);
+    assert.ok(path.basename(files[0]).startsWith('heap-19700101T000000'));
+    assert.ok(path.basename(files[1]).startsWith('wall-19700101T000001'));
+    assert.strictEqual(fs.readFileSync(files[0]).toString(), 'heap');
+    assert.strictEqual(fs.readFileSync(files[1]).toString(), 'wall');
+  });
+});
@@ -0,0 +1,67 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {Load, LoadGovernor} from '../src/governor';
+
+function loads(...values: Load[]): () => Load {
+  return () => values.shift() || {eventLoopUtilization: 0, cpuUtilization: 0};
+}
+
+const busy = {eventLoopUtilization: 0.99, cpuUtilization: 0.5};
+const idle = {eventLoopUtilization: 0.1, cpuUtilization: 0.1};
+
+describe('LoadGovernor', () => {
+  it('should never defer when disabled', async () => {
+    const governor = new LoadGovernor(0, 0, 1000, 1, loads(busy, busy));
+    assert.strictEqual(governor.overloaded(), false);
+    assert.strictEqual(await governor.waitForCapacity(), 0);
+    assert.strictEqual(governor.timeIntervalMicros(1000, 2), 1000);
+    assert.deepStrictEqual(governor.stats(), {
+      deferrals: 0,
+      deferredMillis: 0,
+      reducedSamplingRate: 0,
+    });
+  });
+
+  it('should defer until load drops', async () => {
+    const governor = new LoadGovernor(
+      0.9,
+      0,
+      1000,
+      1,
+      loads(busy, busy, idle)
+    );
+    await governor.waitForCapacity();
+    const stats = governor.stats();
+    assert.strictEqual(stats.deferrals, 1);
+    assert.ok(stats.deferredMillis < 1000);
+  });
+
+  it('should not defer longer than maxDeferMillis', async () => {
+    const governor = new LoadGovernor(0, 0.2, 20, 5, () => busy);
+    const waited = await governor.waitForCapacity();
+    assert.ok(waited >= 20, `waited ${waited}ms`);
+    assert.ok(waited < 1000, `waited ${waited}ms`);
+  });
+
+  it('should reduce sampling rate when overloaded', () => {
+    const governor = new LoadGovernor(0.9, 0, 1000, 1, loads(busy, idle));
+    assert.strictEqual(governor.timeIntervalMicros(1000, 2), 2000);
+    assert.strictEqual(governor.timeIntervalMicros(1000, 2), 1000);
+    assert.strictEqual(governor.stats().reducedSamplingRate, 1);
+  });
+});
@@ -0,0 +1,68 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {perftools} from '../protos/profile';
+import {HeapDeltaTracker} from '../src/heap-delta';
+import {getString} from '../src/profile-utils';
+import {heapProfile} from './profiles-for-tests';
+
+function deltas(p: perftools.profiles.IProfile): number[] {
+  return p.sample!.map(s => Number(s.value![2]));
+}
+
+describe('HeapDeltaTracker', () => {
+  it('should add space_delta sample type', () => {
+    const tracker = new HeapDeltaTracker(100);
+    const p = tracker.addDelta(heapProfile);
+    const sampleType = p.sampleType![2];
+    assert.strictEqual(getString(p, sampleType.type), 'space_delta');
+    assert.strictEqual(getString(p, sampleType.unit), 'bytes');
+    // Without a previous profile, the delta is the live bytes of each stack,
+    // reported on the first sample of the stack.
+    assert.deepStrictEqual(deltas(p), [26, 0, 1160, 0, 5120]);
+  });
+
+  it('should report growth since previous profile', () => {
+    const tracker = new HeapDeltaTracker(100);
+    tracker.addDelta(heapProfile);
+    assert.deepStrictEqual(deltas(tracker.addDelta(heapProfile)), [
+      0, 0, 0, 0, 0,
+    ]);
+  });
+
+  it('should report stacks no longer present with negative deltas', () => {
+    const tracker = new HeapDeltaTracker(100);
+    tracker.addDelta(heapProfile);
+    const smaller = Object.assign({}, heapProfile, {
+      sample: heapProfile.sample!.slice(0, 4),
+    });
+    const p = tracker.addDelta(smaller);
+    assert.deepStrictEqual(deltas(p), [0, 0, 0, 0, -5120]);
+    assert.deepStrictEqual(p.sample![4].locationId, [4, 2, 1]);
+    assert.deepStrictEqual(p.sample![4].value, [0, 0, -5120]);
+  });
+
+  it('should retain at most maxStacks stacks', () => {
+    const tracker = new HeapDeltaTracker(1);
+    tracker.addDelta(heapProfile);
+    // Only the largest stack was retained, so the others are reported as
+    // new.
+    assert.deepStrictEqual(deltas(tracker.addDelta(heapProfile)), [
+      26, 0, 1160, 0, 0,
+    ]);
+  });
+});
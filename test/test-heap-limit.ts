@@ -0,0 +1,117 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import * as tmp from 'tmp';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {
+  claimPendingProfile,
+  HeapLimitWatcher,
+  HeapUsage,
+  MAX_PENDING_PROFILES,
+  pendingProfilePaths,
+  releasePendingProfile,
+  writePendingProfile,
+} from '../src/heap-limit';
+import {decodedHeapProfile, heapProfile} from './profiles-for-tests';
+
+describe('HeapLimitWatcher', () => {
+  it('should call onNearLimit once while above threshold', () => {
+    const calls: HeapUsage[] = [];
+    let usedBytes = 80;
+    const watcher = new HeapLimitWatcher(
+      0.9,
+      1000,
+      usage => calls.push(usage),
+      () => ({usedBytes, limitBytes: 100})
+    );
+    assert.strictEqual(watcher.check(), false);
+    usedBytes = 95;
+    assert.strictEqual(watcher.check(), true);
+    assert.strictEqual(watcher.check(), false);
+    assert.deepStrictEqual(calls, [{usedBytes: 95, limitBytes: 100}]);
+  });
+
+  it('should call onNearLimit again after usage drops', () => {
+    let calls = 0;
+    let usedBytes = 95;
+    const watcher = new HeapLimitWatcher(
+      0.9,
+      1000,
+      () => calls++,
+      () => ({usedBytes, limitBytes: 100})
+    );
+    watcher.check();
+    usedBytes = 50;
+    watcher.check();
+    usedBytes = 95;
+    watcher.check();
+    assert.strictEqual(calls, 2);
+  });
+});
+
+describe('writePendingProfile', () => {
+  it('should write gzipped profile', () => {
+    const dir = tmp.dirSync({unsafeCleanup: true}).name;
+    const file = writePendingProfile(dir, heapProfile);
+    assert.deepStrictEqual(pendingProfilePaths(dir), [file]);
+    const decoded = perftools.profiles.Profile.decode(
+      zlib.gunzipSync(fs.readFileSync(file))
+    );
+    assert.deepStrictEqual(decoded, decodedHeapProfile);
+  });
+
+  it('should keep at most MAX_PENDING_PROFILES profiles', () => {
+    const dir = tmp.dirSync({unsafeCleanup: true}).name;
+    const files: string[] = [];
+    for (let i = 0; i < MAX_PENDING_PROFILES + 2; i++) {
+      files.push(writePendingProfile(dir, heapProfile, '', 1000 + i));
+    }
+    assert.deepStrictEqual(pendingProfilePaths(dir), files.slice(2));
+  });
+});
+
+describe('pendingProfilePaths', () => {
+  it('should return empty array when directory does not exist', () => {
+    assert.deepStrictEqual(pendingProfilePaths('/nonexistent-dir'), []);
+  });
+
+  it('should return profiles of service', () => {
+    const dir = tmp.dirSync({unsafeCleanup: true}).name;
+    const untagged = writePendingProfile(dir, heapProfile, '', 1000);
+    const own = writePendingProfile(dir, heapProfile, 'my-service', 1001);
+    writePendingProfile(dir, heapProfile, 'other-service', 1002);
+    assert.deepStrictEqual(pendingProfilePaths(dir, 'my-service'), [
+      untagged,
+      own,
+    ]);
+  });
+});
+
+describe('claimPendingProfile', () => {
+  it('should claim each profile once', () => {
+    const dir = tmp.dirSync({unsafeCleanup: true}).name;
+    const file = writePendingProfile(dir, heapProfile);
+    const claimed = claimPendingProfile(file);
+    assert.ok(claimed);
+    assert.strictEqual(claimPendingProfile(file), undefined);
+    assert.deepStrictEqual(pendingProfilePaths(dir), []);
+    releasePendingProfile(claimed!, file);
+    assert.deepStrictEqual(pendingProfilePaths(dir), [file]);
+  });
+});
@@ -55,13 +55,78 @@ describe('createProfiler', () => {
     heapIntervalBytes: 512 * 1024,
     heapMaxStackDepth: 64,
     ignoreHeapSamplesPath: '@google-cloud/profiler',
+    ignoreTimeSamplesPath: '@google-cloud/profiler',
+    governorMaxEventLoopUtilization: 0,
+    governorMaxCpuUtilization: 0,
+    governorMaxDeferMillis: 10 * 1000,
+    governorCheckIntervalMillis: 500,
+    governorTimeIntervalMultiplier: 2,
+    dropFrames: '',
+    keepFrames: '',
+    foldRecursionMaxCycleLength: 0,
+    pruneMaxStacks: 0,
+    pruneValueFraction: 0,
+    profileMemoryBudgetBytes: 0,
+    minMemoryHeadroomBytes: 0,
+    heapDelta: false,
+    heapDeltaMaxStacks: 10 * 1000,
+    leakDetection: false,
+    leakDetectionMaxSites: 1000,
+    leakDetectionMaxPoints: 24,
+    leakDetectionMinPoints: 4,
+    heapLimitProfileDir: '',
+    heapLimitThreshold: 0.9,
+    heapLimitCheckIntervalMillis: 1000,
+    flightRecorderPeriodMillis: 0,
+    flightRecorderTimeDurationMillis: 10 * 1000,
+    flightRecorderMaxProfiles: 60,
+    flightRecorderMaxBytes: 16 * 1024 * 1024,
+    flightRecorderDumpDir: '',
+    flightRecorderDumpSignal: 'SIGUSR2',
+    triggerEventLoopDelayMillis: 0,
+    triggerCpuUtilization: 0,
+    triggerRssGrowthBytesPerSecond: 0,
+    triggerCheckIntervalMillis: 1000,
+    triggerMinIntervalMillis: 10 * 60 * 1000,
+    triggerTimeDurationMillis: 10 * 1000,
+    triggerProfileDir: '',
+    clusterMode: false,
+    clusterWorkerSelection: 'rotation',
+    clusterWorkerTimeoutMillis: 60 * 1000,
+    clusterMergeProfiles: false,
+    clusterMergeMaxSamples: 10000,
+    daemonSocketPath: '',
+    daemonSocketMode: 0o600,
+    exportProfileDir: '',
+    otlpProfilesEndpoint: '',
+    otlpHeaders: {},
+    pyroscopeServerAddress: '',
+    pyroscopeAuthToken: '',
+    exporters: [],
+    ioWaitMaxFrames: 64,
+    ioWaitMaxPending: 10 * 1000,
+    ioWaitMaxStacks: 5000,
+    blockingMaxFrames: 64,
+    blockingMaxStacks: 5000,
+    promiseSamplingInterval: 1000,
+    promiseMaxFrames: 32,
+    promiseMaxPending: 10 * 1000,
+    promiseMaxStacks: 5000,
+    timeLoopPhases: false,
+    timeThreadCpu: false,
+    memoryMapMaxFiles: 20,
+    heapTypeLabels: false,
+    stableProfileIds: false,
+    stableProfileIdsMaxEntries: 100 * 1000,
     initialBackoffMillis: 1000 * 60,
     backoffCapMillis: 60 * 60 * 1000,
     backoffMultiplier: 1.3,
     serverBackoffCapMillis: 2147483647,
     localProfilingPeriodMillis: 1000,
     localTimeDurationMillis: 1000,
+    localAdditionalProfileTypes: [],
     localLogPeriodMillis: 10000,
+    localProfileDir: '',
     apiEndpoint: 'cloudprofiler.googleapis.com',
   };
   const disableSourceMapParams = {
@@ -342,6 +407,54 @@ describe('createProfiler', () => {
     }
   });
 
+  it('should reject when dropFrames is not a valid regular expression', async () => {
+    instanceMetadataStub = sinon.stub(gcpMetadata, 'instance');
+    instanceMetadataStub.throwsException('cannot access metadata');
+    projectMetadataStub = sinon.stub(gcpMetadata, 'project');
+    projectMetadataStub.throwsException('cannot access metadata');
+    const config = Object.assign(
+      {
+        serviceContext: {version: '', service: 'fake-service'},
+        dropFrames: 'express(',
+      },
+      disableSourceMapParams
+    );
+
+    try {
+      await createProfiler(config);
+      assert.fail('expected an error because invalid dropFrames was specified');
+    } catch (e) {
+      assert.ok(
+        e.message.startsWith('dropFrames is not a valid regular expression'),
+        e.message
+      );
+    }
+  });
+
+  it('should reject unknown clusterWorkerSelection', async () => {
+    instanceMetadataStub = sinon.stub(gcpMetadata, 'instance');
+    instanceMetadataStub.throwsException('cannot access metadata');
+    projectMetadataStub = sinon.stub(gcpMetadata, 'project');
+    projectMetadataStub.throwsException('cannot access metadata');
+    const config = Object.assign(
+      {
+        serviceContext: {version: '', service: 'fake-service'},
+        clusterWorkerSelection: 'random',
+      },
+      disableSourceMapParams
+    );
+
+    try {
+      await createProfiler(config);
+      assert.fail('expected an error because of clusterWorkerSelection');
+    } catch (e) {
+      assert.ok(
+        e.message.startsWith('clusterWorkerSelection must be one of'),
+        e.message
+      );
+    }
+  });
+
   it('should set apiEndpoint to non-default value', async () => {
     instanceMetadataStub = sinon.stub(gcpMetadata, 'instance');
     instanceMetadataStub.throwsException('cannot access metadata');
@@ -0,0 +1,95 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import {promisify} from 'util';
+
+import {perftools} from '../protos/profile';
+import {IoWaitProfiler} from '../src/io-wait';
+import {getString, locationFrames} from '../src/profile-utils';
+
+const readFile = promisify(fs.readFile);
+
+function readThisFile() {
+  return readFile(__filename);
+}
+
+/**
+ * @return the samples of p with the value of their "io" label and the names
+ * of the functions of their stacks, leaf first.
+ */
+function ioSamples(p: perftools.profiles.IProfile) {
+  const frames = locationFrames(p);
+  return (p.sample || []).map(s => ({
+    io: getString(p, s.label![0].str),
+    count: Number(s.value![0]),
+    waitNanos: Number(s.value![1]),
+    functions: (s.locationId || []).map(id =>
+      frames.get(Number(id))!.map(f => f.name).join('/')
+    ),
+  }));
+}
+
+describe('IoWaitProfiler', () => {
+  it('should attribute fs wait to initiating stack', async () => {
+    const profiler = new IoWaitProfiler(64, 100, 100, '');
+    profiler.start();
+    await readThisFile();
+    await readThisFile();
+    const p = profiler.stop();
+
+    assert.deepStrictEqual(
+      p.sampleType!.map(t => getString(p, t.type)),
+      ['io_operations', 'io_wait']
+    );
+    const fromTest = ioSamples(p).filter(
+      s => s.io === 'fs' && s.functions[0] === 'readThisFile'
+    );
+    assert.strictEqual(fromTest.length, 1, JSON.stringify(ioSamples(p)));
+    assert.ok(fromTest[0].count >= 2);
+    assert.ok(fromTest[0].waitNanos > 0);
+    assert.ok(Number(p.durationNanos) > 0);
+  });
+
+  it('should not record operations from ignored path', async () => {
+    const profiler = new IoWaitProfiler(64, 100, 100, 'test-io-wait');
+    profiler.start();
+    await readThisFile();
+    const p = profiler.stop();
+    assert.ok(
+      ioSamples(p).every(s => s.functions[0] !== 'readThisFile'),
+      JSON.stringify(ioSamples(p))
+    );
+  });
+
+  it('should record operations without stack beyond maxStacks', async () => {
+    const profiler = new IoWaitProfiler(64, 100, 0, '');
+    profiler.start();
+    await readThisFile();
+    const p = profiler.stop();
+    const samples = ioSamples(p).filter(s => s.io === 'fs');
+    assert.strictEqual(samples.length, 1);
+    assert.deepStrictEqual(samples[0].functions, []);
+  });
+
+  it('should not record operations after stop', async () => {
+    const profiler = new IoWaitProfiler(64, 100, 100, '');
+    profiler.start();
+    profiler.stop();
+    await readThisFile();
+    assert.deepStrictEqual(profiler.stop().sample, []);
+  });
+});
@@ -0,0 +1,114 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {perftools} from '../protos/profile';
+import {LeakDetector, slope} from '../src/leak-detector';
+import {getString} from '../src/profile-utils';
+import {heapProfile} from './profiles-for-tests';
+
+const HOUR = 60 * 60 * 1000;
+
+// Returns a copy of heapProfile in which the live bytes of the last sample,
+// allocated at function2, are replaced by bytes.
+function withFunction2Bytes(bytes: number): perftools.profiles.IProfile {
+  const samples = heapProfile.sample!.slice();
+  const last = samples[samples.length - 1];
+  samples[samples.length - 1] = {
+    locationId: last.locationId,
+    value: [last.value![0], bytes],
+  };
+  return Object.assign({}, heapProfile, {sample: samples});
+}
+
+describe('slope', () => {
+  it('should compute slope of least-squares fit', () => {
+    assert.strictEqual(slope([0, 1, 2, 3], [1, 3, 5, 7]), 2);
+  });
+
+  it('should return 0 when all x values are equal', () => {
+    assert.strictEqual(slope([1, 1], [1, 5]), 0);
+  });
+});
+
+describe('LeakDetector', () => {
+  it('should report site with monotonically growing live bytes', () => {
+    const detector = new LeakDetector(100, 10, 3);
+    [1000, 2000, 3000, 4000].forEach((bytes, i) => {
+      detector.record(withFunction2Bytes(bytes), i * HOUR);
+    });
+    const trends = detector.trends();
+    assert.strictEqual(trends.length, 1);
+    assert.strictEqual(trends[0].frames[0].name, 'function2');
+    assert.strictEqual(trends[0].bytesPerHour, 1000);
+    assert.strictEqual(trends[0].latestBytes, 4000);
+    assert.strictEqual(trends[0].points, 4);
+  });
+
+  it('should not report site before minPoints profiles', () => {
+    const detector = new LeakDetector(100, 10, 3);
+    detector.record(withFunction2Bytes(1000), 0);
+    detector.record(withFunction2Bytes(2000), HOUR);
+    assert.deepStrictEqual(detector.trends(), []);
+  });
+
+  it('should not report site whose live bytes decreased', () => {
+    const detector = new LeakDetector(100, 10, 3);
+    [1000, 3000, 2000, 4000].forEach((bytes, i) => {
+      detector.record(withFunction2Bytes(bytes), i * HOUR);
+    });
+    assert.deepStrictEqual(detector.trends(), []);
+  });
+
+  it('should keep only the latest maxPoints profiles', () => {
+    const detector = new LeakDetector(100, 3, 3);
+    [3000, 1000, 2000, 3000].forEach((bytes, i) => {
+      detector.record(withFunction2Bytes(bytes), i * HOUR);
+    });
+    const trends = detector.trends();
+    assert.strictEqual(trends.length, 1);
+    assert.strictEqual(trends[0].points, 3);
+  });
+
+  it('should track only the maxSites largest sites', () => {
+    const detector = new LeakDetector(1, 10, 2);
+    detector.record(withFunction2Bytes(1), 0);
+    detector.record(withFunction2Bytes(2), HOUR);
+    // The growing site is smaller than the other sites, so is not tracked.
+    assert.deepStrictEqual(detector.trends(), []);
+  });
+
+  it('should build trend profile', () => {
+    const detector = new LeakDetector(100, 10, 2);
+    detector.record(withFunction2Bytes(1000), 0);
+    detector.record(withFunction2Bytes(3000), HOUR);
+    const p = detector.trendProfile();
+    assert.deepStrictEqual(
+      p.sampleType!.map(t => getString(p, t.type)),
+      ['space_growth', 'space']
+    );
+    assert.strictEqual(p.sample!.length, 1);
+    assert.deepStrictEqual(p.sample![0].value, [2000, 3000]);
+    const names = p.sample![0].locationId!.map(id => {
+      const loc = p.location!.find(l => Number(l.id) === Number(id))!;
+      const fn = p.function!.find(
+        f => Number(f.id) === Number(loc.line![0].functionId)
+      )!;
+      return getString(p, fn.name);
+    });
+    assert.deepStrictEqual(names, ['function2', 'function1', 'main']);
+  });
+});
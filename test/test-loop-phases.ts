@@ -0,0 +1,86 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {afterEach, describe, it} from 'mocha';
+
+import {formatLoopPhases, LoopPhaseTracker} from '../src/loop-phases';
+
+/**
+ * Runs the event loop for at least millis ms.
+ */
+function busyWait(millis: number) {
+  const end = Date.now() + millis;
+  while (Date.now() < end) {
+    // Spin.
+  }
+}
+
+describe('LoopPhaseTracker', () => {
+  let tracker: LoopPhaseTracker | undefined;
+  afterEach(() => {
+    if (tracker) {
+      tracker.stop();
+      tracker = undefined;
+    }
+  });
+
+  it('should attribute callbacks to loop phases', async () => {
+    tracker = new LoopPhaseTracker();
+    tracker.start();
+    await new Promise<void>(resolve =>
+      setTimeout(() => {
+        busyWait(5);
+        resolve();
+      }, 1)
+    );
+    await new Promise<void>(resolve =>
+      setImmediate(() => {
+        busyWait(5);
+        resolve();
+      })
+    );
+    await Promise.resolve().then(() => busyWait(5));
+    const times = tracker.stop();
+
+    for (const phase of ['timers', 'check', 'microtasks']) {
+      assert.ok(
+        times.phaseNanos[phase] >= 4e6,
+        `${phase}: ${JSON.stringify(times)}`
+      );
+    }
+    assert.ok(times.durationNanos >= 15e6);
+  });
+
+  it('should record nothing after stopping', async () => {
+    tracker = new LoopPhaseTracker();
+    tracker.start();
+    tracker.stop();
+    await new Promise(resolve => setTimeout(resolve, 1));
+    assert.deepStrictEqual(tracker.stop(), {phaseNanos: {}, durationNanos: 0});
+  });
+});
+
+describe('formatLoopPhases', () => {
+  it('should list each phase and time outside callbacks', () => {
+    assert.strictEqual(
+      formatLoopPhases({
+        phaseNanos: {timers: 1.2e6, poll: 30e6, microtasks: 4.5e6},
+        durationNanos: 1e9,
+      }),
+      'loop phases: timers=1.200ms, poll=30.000ms, check=0.000ms, ' +
+        'microtasks=4.500ms, outside callbacks=964.300ms'
+    );
+  });
+});
@@ -0,0 +1,142 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import * as path from 'path';
+import * as tmp from 'tmp';
+
+import {
+  estimateProfileBytes,
+  estimateTreeBytes,
+  fitToBudget,
+  fitTreeToBudget,
+  readCgroupMemory,
+} from '../src/memory-budget';
+import {getString, locationFunctions} from '../src/profile-utils';
+import {AllocationProfileNode} from '../src/v8-types';
+import {heapProfile} from './profiles-for-tests';
+
+describe('readCgroupMemory', () => {
+  it('should read cgroup v2 limit and usage', () => {
+    const root = tmp.dirSync({unsafeCleanup: true}).name;
+    fs.writeFileSync(path.join(root, 'memory.max'), '1048576\n');
+    fs.writeFileSync(path.join(root, 'memory.current'), '1024\n');
+    assert.deepStrictEqual(readCgroupMemory(root), {
+      limitBytes: 1048576,
+      usageBytes: 1024,
+    });
+  });
+
+  it('should read cgroup v1 limit and usage', () => {
+    const root = tmp.dirSync({unsafeCleanup: true}).name;
+    const v1 = path.join(root, 'memory');
+    fs.mkdirSync(v1);
+    fs.writeFileSync(path.join(v1, 'memory.limit_in_bytes'), '4096');
+    fs.writeFileSync(path.join(v1, 'memory.usage_in_bytes'), '10');
+    assert.deepStrictEqual(readCgroupMemory(root), {
+      limitBytes: 4096,
+      usageBytes: 10,
+    });
+  });
+
+  it('should return undefined when there is no limit', () => {
+    const root = tmp.dirSync({unsafeCleanup: true}).name;
+    fs.writeFileSync(path.join(root, 'memory.max'), 'max\n');
+    fs.writeFileSync(path.join(root, 'memory.current'), '1024\n');
+    assert.strictEqual(readCgroupMemory(root), undefined);
+  });
+});
+
+describe('fitToBudget', () => {
+  it('should return profile unchanged when within budget', () => {
+    const budget = estimateProfileBytes(heapProfile);
+    assert.strictEqual(fitToBudget(heapProfile, budget), heapProfile);
+    assert.strictEqual(fitToBudget(heapProfile, 0), heapProfile);
+  });
+
+  it('should aggregate smallest samples when over budget', () => {
+    const budget = estimateProfileBytes(heapProfile) / 2;
+    const pruned = fitToBudget(heapProfile, budget);
+    assert.ok(pruned.sample!.length < heapProfile.sample!.length);
+
+    const sum = (p: typeof heapProfile) =>
+      p.sample!.reduce((total, s) => total + Number(s.value![1]), 0);
+    assert.strictEqual(sum(pruned), sum(heapProfile));
+
+    const last = pruned.sample![pruned.sample!.length - 1];
+    const fns = locationFunctions(pruned).get(Number(last.locationId![0]))!;
+    assert.strictEqual(getString(pruned, fns[0].name), '(over memory budget)');
+    // The largest sample is kept.
+    assert.deepStrictEqual(pruned.sample![0].value, [5, 5 * 1024]);
+  });
+});
+
+describe('fitTreeToBudget', () => {
+  const node = (
+    name: string,
+    sizeBytes: number,
+    children: AllocationProfileNode[] = []
+  ): AllocationProfileNode => ({
+    name,
+    scriptName: 'script.js',
+    children,
+    allocations: [{sizeBytes, count: 1}],
+  });
+  const tree = () =>
+    node('(root)', 0, [
+      node('big', 1024, [node('bigChild', 2048)]),
+      node('small1', 8),
+      node('small2', 16, [node('small2Child', 8)]),
+    ]);
+  const totalBytes = (root: AllocationProfileNode): number =>
+    root.allocations.reduce((t, a) => t + a.sizeBytes * a.count, 0) +
+    (root.children as AllocationProfileNode[]).reduce(
+      (t, c) => t + totalBytes(c),
+      0
+    );
+
+  it('should return tree unchanged when within budget', () => {
+    const root = tree();
+    const budget = estimateTreeBytes(root);
+    assert.deepStrictEqual(fitTreeToBudget(root, budget), {
+      root,
+      aggregatedNodes: 0,
+    });
+    assert.strictEqual(fitTreeToBudget(root, 0).root, root);
+  });
+
+  it('should keep heaviest nodes when over budget', () => {
+    const root = tree();
+    const budget = estimateTreeBytes(root) * 0.7;
+    const fitted = fitTreeToBudget(root, budget);
+    assert.notStrictEqual(fitted.root, root);
+    assert.ok(fitted.aggregatedNodes > 0);
+    assert.ok(estimateTreeBytes(fitted.root) < estimateTreeBytes(root));
+    assert.strictEqual(totalBytes(fitted.root), totalBytes(root));
+
+    const children = fitted.root.children as AllocationProfileNode[];
+    assert.deepStrictEqual(
+      children.map(c => c.name),
+      ['(over memory budget)', 'big']
+    );
+    assert.deepStrictEqual(
+      children[1].children.map(c => c.name),
+      ['bigChild']
+    );
+    // The input tree is not modified.
+    assert.strictEqual(root.children.length, 3);
+  });
+});
@@ -0,0 +1,115 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {perftools} from '../protos/profile';
+import {
+  memoryMapProfile,
+  parseSmaps,
+  readMemorySnapshot,
+} from '../src/memory-map';
+import {getString, locationFrames} from '../src/profile-utils';
+
+const SMAPS = `
+00400000-00452000 r-xp 00000000 08:02 173521      /usr/bin/node
+Size:                328 kB
+Rss:                 300 kB
+01e9c000-01ebd000 rw-p 00000000 00:00 0           [heap]
+Rss:                 100 kB
+7f0000000000-7f0000100000 rw-p 00000000 00:00 0
+Rss:                 500 kB
+7f0000200000-7f0000210000 r-xp 00000000 08:02 1234 /lib/libc with space.so
+Rss:                  10 kB
+7ffc00000000-7ffc00021000 rw-p 00000000 00:00 0   [stack]
+Rss:                   8 kB
+`.trim();
+
+/**
+ * @return the stacks of the samples of p, root first, joined by ";", mapped
+ * to their values.
+ */
+function stackValues(p: perftools.profiles.IProfile) {
+  const frames = locationFrames(p);
+  const values: {[stack: string]: number} = {};
+  for (const s of p.sample || []) {
+    const names = (s.locationId || []).map(
+      id => frames.get(Number(id))![0].name
+    );
+    values[names.reverse().join(';')] = Number(s.value![0]);
+  }
+  return values;
+}
+
+describe('parseSmaps', () => {
+  it('should read path and resident size of each mapping', () => {
+    assert.deepStrictEqual(parseSmaps(SMAPS), [
+      {pathname: '/usr/bin/node', rssBytes: 300 * 1024},
+      {pathname: '[heap]', rssBytes: 100 * 1024},
+      {pathname: '', rssBytes: 500 * 1024},
+      {pathname: '/lib/libc with space.so', rssBytes: 10 * 1024},
+      {pathname: '[stack]', rssBytes: 8 * 1024},
+    ]);
+  });
+});
+
+describe('memoryMapProfile', () => {
+  const heapSpaces = [
+    {name: 'old_space', usedBytes: 200 * 1024, physicalBytes: 300 * 1024},
+  ];
+
+  it('should break resident memory down by category', () => {
+    const p = memoryMapProfile(
+      {
+        rssBytes: 918 * 1024,
+        externalBytes: 60 * 1024,
+        heapSpaces,
+        code: {code_and_metadata: 1000},
+        mappings: parseSmaps(SMAPS),
+      },
+      1
+    );
+    assert.deepStrictEqual(stackValues(p), {
+      'V8 heap;old_space;used': 200 * 1024,
+      'V8 heap;old_space;unused': 100 * 1024,
+      external: 60 * 1024,
+      'native;malloc heap': 40 * 1024,
+      'native;stack': 8 * 1024,
+      'native;anonymous': 200 * 1024,
+      'file-backed;/usr/bin/node': 300 * 1024,
+      'file-backed;(other files)': 10 * 1024,
+    });
+    assert.deepStrictEqual(
+      (p.comment || []).map(c => getString(p, c)),
+      ['V8 code statistics, in bytes: code_and_metadata=1000']
+    );
+  });
+
+  it('should attribute rest of resident size when mappings are missing', () => {
+    const p = memoryMapProfile(
+      {rssBytes: 1000 * 1024, externalBytes: 60 * 1024, heapSpaces},
+      1
+    );
+    assert.strictEqual(stackValues(p)['native;unattributed'], 640 * 1024);
+  });
+});
+
+describe('readMemorySnapshot', () => {
+  it('should read V8 heap spaces', () => {
+    const snapshot = readMemorySnapshot();
+    assert.ok(snapshot.heapSpaces.some(s => s.name === 'old_space'));
+    assert.ok(snapshot.rssBytes > 0);
+  });
+});
@@ -0,0 +1,136 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import * as path from 'path';
+import * as tmp from 'tmp';
+import * as zlib from 'zlib';
+
+import {perftools} from '../protos/profile';
+import {main} from '../src/merge-cli';
+import {
+  decodeProfile,
+  MERGE_OVERFLOW_FRAME,
+  mergeProfiles,
+  ProfileMerger,
+} from '../src/merge';
+import {getString, locationFunctions} from '../src/profile-utils';
+import {heapProfile, timeProfile} from './profiles-for-tests';
+
+function values(p: perftools.profiles.IProfile): number[][] {
+  return p.sample!.map(s => s.value!.map(Number));
+}
+
+describe('ProfileMerger', () => {
+  it('should sum values of equal samples', () => {
+    const p = mergeProfiles([timeProfile, timeProfile]);
+    assert.deepStrictEqual(values(p), [
+      [2, 2000],
+      [6, 6000],
+      [4, 4000],
+      [2, 2000],
+    ]);
+    assert.strictEqual(p.function!.length, 3);
+    assert.strictEqual(p.location!.length, 4);
+    assert.deepStrictEqual(
+      p.sampleType!.map(t => getString(p, t.type)),
+      ['sample', 'wall']
+    );
+  });
+
+  it('should merge duplicate samples within a profile', () => {
+    const p = mergeProfiles([heapProfile]);
+    assert.deepStrictEqual(values(p), [
+      [4, 26],
+      [23, 1160],
+      [5, 5120],
+    ]);
+  });
+
+  it('should not store a string more than once', () => {
+    const p = mergeProfiles([timeProfile, timeProfile]);
+    assert.strictEqual(
+      new Set(p.stringTable).size,
+      p.stringTable!.length,
+      p.stringTable!.join(',')
+    );
+  });
+
+  it('should reject profiles with different sample types', () => {
+    const merger = new ProfileMerger();
+    merger.add(timeProfile);
+    assert.throws(() => merger.add(heapProfile), /Cannot merge profile/);
+  });
+
+  it('should aggregate samples beyond maxSamples', () => {
+    const merger = new ProfileMerger(2);
+    merger.add(timeProfile);
+    const p = merger.profile();
+    assert.deepStrictEqual(values(p), [
+      [1, 1000],
+      [3, 3000],
+      [3, 3000],
+    ]);
+    const fns = locationFunctions(p).get(Number(p.sample![2].locationId![0]))!;
+    assert.strictEqual(getString(p, fns[0].name), MERGE_OVERFLOW_FRAME);
+  });
+
+  it('should span time range of merged profiles', () => {
+    const merger = new ProfileMerger();
+    merger.add(Object.assign({}, timeProfile, {timeNanos: 2e9}));
+    merger.add(Object.assign({}, timeProfile, {timeNanos: 1e9}));
+    const p = merger.profile();
+    assert.strictEqual(Number(p.timeNanos), 1e9);
+    assert.strictEqual(Number(p.durationNanos), 11e9);
+  });
+});
+
+describe('decodeProfile', () => {
+  it('should decode gzipped and uncompressed profiles', () => {
+    const buffer = Buffer.from(
+      perftools.profiles.Profile.encode(timeProfile).finish()
+    );
+    const expected = perftools.profiles.Profile.decode(buffer);
+    assert.deepStrictEqual(decodeProfile(buffer), expected);
+    assert.deepStrictEqual(decodeProfile(zlib.gzipSync(buffer)), expected);
+  });
+});
+
+describe('merge CLI', () => {
+  it('should merge profile files', () => {
+    const dir = tmp.dirSync({unsafeCleanup: true}).name;
+    const input = path.join(dir, 'wall.pb.gz');
+    const output = path.join(dir, 'merged.pb.gz');
+    fs.writeFileSync(
+      input,
+      zlib.gzipSync(perftools.profiles.Profile.encode(timeProfile).finish())
+    );
+    const logs: string[] = [];
+    assert.strictEqual(
+      main(['-o', output, input, input], m => logs.push(m)),
+      0
+    );
+    const p = decodeProfile(fs.readFileSync(output));
+    assert.deepStrictEqual(values(p)[1], [6, 6000]);
+    assert.deepStrictEqual(logs, [`Merged 2 profiles into ${output}.`]);
+  });
+
+  it('should print usage when output is not specified', () => {
+    const logs: string[] = [];
+    assert.strictEqual(main(['in.pb.gz'], m => logs.push(m)), 2);
+    assert.ok(logs[0].startsWith('Usage:'));
+  });
+});
@@ -20,15 +20,21 @@ import {
 import * as assert from 'assert';
 import {describe, it, beforeEach, afterEach, before, after} from 'mocha';
 import * as extend from 'extend';
+import * as fs from 'fs';
 import * as nock from 'nock';
 import {heap as heapProfiler, time as timeProfiler} from 'pprof';
 import * as sinon from 'sinon';
+import * as tmp from 'tmp';
 import {promisify} from 'util';
 import * as zlib from 'zlib';
 
 import {perftools} from '../protos/profile';
 import {ProfilerConfig} from '../src/config';
+import {ExportedProfile} from '../src/exporters';
+import {writePendingProfile} from '../src/heap-limit';
+import {LeakDetector} from '../src/leak-detector';
 import {parseBackoffDuration, Profiler, Retryer} from '../src/profiler';
+import * as threadCpu from '../src/thread-cpu';
 
 import {
   decodedHeapProfile,
@@ -60,13 +66,78 @@ const testConfig: ProfilerConfig = {
   heapIntervalBytes: 512 * 1024,
   heapMaxStackDepth: 64,
   ignoreHeapSamplesPath: '@google-cloud/profiler',
+  ignoreTimeSamplesPath: '@google-cloud/profiler',
+  governorMaxEventLoopUtilization: 0,
+  governorMaxCpuUtilization: 0,
+  governorMaxDeferMillis: 10 * 1000,
+  governorCheckIntervalMillis: 500,
+  governorTimeIntervalMultiplier: 2,
+  dropFrames: '',
+  keepFrames: '',
+  foldRecursionMaxCycleLength: 0,
+  pruneMaxStacks: 0,
+  pruneValueFraction: 0,
+  profileMemoryBudgetBytes: 0,
+  minMemoryHeadroomBytes: 0,
+  heapDelta: false,
+  heapDeltaMaxStacks: 10 * 1000,
+  leakDetection: false,
+  leakDetectionMaxSites: 1000,
+  leakDetectionMaxPoints: 24,
+  leakDetectionMinPoints: 4,
+  heapLimitProfileDir: '',
+  heapLimitThreshold: 0.9,
+  heapLimitCheckIntervalMillis: 1000,
+  flightRecorderPeriodMillis: 0,
+  flightRecorderTimeDurationMillis: 10 * 1000,
+  flightRecorderMaxProfiles: 60,
+  flightRecorderMaxBytes: 16 * 1024 * 1024,
+  flightRecorderDumpDir: '',
+  flightRecorderDumpSignal: 'SIGUSR2',
+  triggerEventLoopDelayMillis: 0,
+  triggerCpuUtilization: 0,
+  triggerRssGrowthBytesPerSecond: 0,
+  triggerCheckIntervalMillis: 1000,
+  triggerMinIntervalMillis: 10 * 60 * 1000,
+  triggerTimeDurationMillis: 10 * 1000,
+  triggerProfileDir: '',
+  clusterMode: false,
+  clusterWorkerSelection: 'rotation',
+  clusterWorkerTimeoutMillis: 60 * 1000,
+  clusterMergeProfiles: false,
+  clusterMergeMaxSamples: 10000,
+  daemonSocketPath: '',
+  daemonSocketMode: 0o600,
+  exportProfileDir: '',
+  otlpProfilesEndpoint: '',
+  otlpHeaders: {},
+  pyroscopeServerAddress: '',
+  pyroscopeAuthToken: '',
+  exporters: [],
+  ioWaitMaxFrames: 64,
+  ioWaitMaxPending: 10 * 1000,
+  ioWaitMaxStacks: 5000,
+  blockingMaxFrames: 64,
+  blockingMaxStacks: 5000,
+  promiseSamplingInterval: 1000,
+  promiseMaxFrames: 32,
+  promiseMaxPending: 10 * 1000,
+  promiseMaxStacks: 5000,
+  timeLoopPhases: false,
+  timeThreadCpu: false,
+  memoryMapMaxFiles: 20,
+  heapTypeLabels: false,
+  stableProfileIds: false,
+  stableProfileIdsMaxEntries: 100 * 1000,
   initialBackoffMillis: 1000,
   backoffCapMillis: parseDuration('1h')!,
   backoffMultiplier: 1.3,
   serverBackoffCapMillis: parseDuration('7d')!,
   localProfilingPeriodMillis: 1000,
   localTimeDurationMillis: 1000,
+  localAdditionalProfileTypes: [],
   localLogPeriodMillis: 1000,
+  localProfileDir: '',
   sourceMapSearchPath: [],
   disableSourceMaps: true,
   apiEndpoint: API,
@@ -136,6 +207,26 @@ describe('Profiler', () => {
       const outProfile = perftools.profiles.Profile.decode(unzippedBytes);
       assert.deepStrictEqual(decodedTimeProfile, outProfile);
     });
+    it('should add loop phase times to WALL profile when timeLoopPhases is enabled.', async () => {
+      const profiler = new Profiler({...testConfig, timeLoopPhases: true});
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'WALL',
+        duration: '10s',
+      };
+      const prof = await profiler.profile(requestProf);
+      const outProfile = perftools.profiles.Profile.decode(
+        zlib.gunzipSync(Buffer.from(prof.profileBytes!, 'base64'))
+      );
+      const comments = outProfile.comment.map(
+        c => outProfile.stringTable[Number(c)]
+      );
+      assert.ok(
+        comments.some(c => c.startsWith('loop phases: timers=')),
+        JSON.stringify(comments)
+      );
+      assert.ok(profiler.loopPhaseTimes());
+    });
     it('should return expected profile when profile type is HEAP.', async () => {
       const profiler = new Profiler(testConfig);
       const requestProf = {
@@ -151,6 +242,117 @@ describe('Profiler', () => {
       const outProfile = perftools.profiles.Profile.decode(unzippedBytes);
       assert.deepStrictEqual(decodedHeapProfile, outProfile);
     });
+    it('should return I/O wait profile when profile type is IO_WAIT.', async () => {
+      const profiler = new Profiler(testConfig);
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'IO_WAIT',
+        duration: '100ms',
+      };
+      const profiling = profiler.profile(requestProf);
+      await promisify(fs.readFile)(__filename);
+      const prof = await profiling;
+      const outProfile = perftools.profiles.Profile.decode(
+        zlib.gunzipSync(Buffer.from(prof.profileBytes!, 'base64'))
+      );
+      assert.deepStrictEqual(
+        outProfile.sampleType.map(t => outProfile.stringTable[Number(t.type)]),
+        ['io_operations', 'io_wait']
+      );
+      assert.ok(outProfile.sample.length > 0, 'expected fs operation');
+    });
+    it('should return blocking profile when profile type is BLOCKING.', async () => {
+      const profiler = new Profiler(testConfig);
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'BLOCKING',
+        duration: '10ms',
+      };
+      const profiling = profiler.profile(requestProf);
+      fs.readFileSync(__filename);
+      const prof = await profiling;
+      const outProfile = perftools.profiles.Profile.decode(
+        zlib.gunzipSync(Buffer.from(prof.profileBytes!, 'base64'))
+      );
+      assert.deepStrictEqual(
+        outProfile.sampleType.map(t => outProfile.stringTable[Number(t.type)]),
+        ['blocking_calls', 'blocking']
+      );
+      assert.ok(outProfile.sample.length > 0, 'expected fs call');
+    });
+    it('should return promise profile when profile type is PROMISE.', async () => {
+      const profiler = new Profiler({
+        ...testConfig,
+        promiseSamplingInterval: 1,
+      });
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'PROMISE',
+        duration: '10ms',
+      };
+      const prof = await profiler.profile(requestProf);
+      const outProfile = perftools.profiles.Profile.decode(
+        zlib.gunzipSync(Buffer.from(prof.profileBytes!, 'base64'))
+      );
+      assert.deepStrictEqual(
+        outProfile.sampleType.map(t => outProfile.stringTable[Number(t.type)]),
+        ['promises', 'microtasks']
+      );
+    });
+    it('should sum live bytes by type when heapTypeLabels is enabled.', async () => {
+      const profiler = new Profiler({...testConfig, heapTypeLabels: true});
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'HEAP',
+      };
+      await profiler.profile(requestProf);
+      assert.ok(profiler.heapTypeTotals().length > 0);
+    });
+    it('should return memory profile when profile type is MEMORY.', async () => {
+      const profiler = new Profiler(testConfig);
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'MEMORY',
+      };
+      const prof = await profiler.profile(requestProf);
+      const outProfile = perftools.profiles.Profile.decode(
+        zlib.gunzipSync(Buffer.from(prof.profileBytes!, 'base64'))
+      );
+      assert.deepStrictEqual(
+        outProfile.sampleType.map(t => outProfile.stringTable[Number(t.type)]),
+        ['space']
+      );
+      assert.ok(outProfile.stringTable.includes('V8 heap'));
+    });
+    it('should return code size profile when profile type is CODE.', async () => {
+      const profiler = new Profiler(testConfig);
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'CODE',
+      };
+      const prof = await profiler.profile(requestProf);
+      const outProfile = perftools.profiles.Profile.decode(
+        zlib.gunzipSync(Buffer.from(prof.profileBytes!, 'base64'))
+      );
+      assert.deepStrictEqual(
+        outProfile.sampleType.map(t => outProfile.stringTable[Number(t.type)]),
+        ['bytecode', 'baseline', 'optimized', 'code']
+      );
+    });
+    it('should not take heap snapshot exceeding memory budget.', async () => {
+      const profiler = new Profiler({
+        ...testConfig,
+        profileMemoryBudgetBytes: 1024,
+      });
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'CODE',
+      };
+      await assert.rejects(
+        profiler.profile(requestProf),
+        /exceeds the memory budget of 1024 bytes/
+      );
+    });
     it('should throw error when unexpected profile type is requested.', async () => {
       const profiler = new Profiler(testConfig);
       const requestProf = {
@@ -199,6 +401,48 @@ describe('Profiler', () => {
         assert.deepStrictEqual(decodedTimeProfile, outProfile);
       }
     );
+    it('should measure CPU time only while profiling', async () => {
+      // CPU time is consumed only at the end of each time profile, so that
+      // reading it before a profile waits for another shows a larger time.
+      let cpuNanos = 0;
+      const readCpu = sinon
+        .stub(threadCpu, 'readThreadCpuNanos')
+        .callsFake(() => cpuNanos);
+      const profile = timeProfiler.profile as unknown as sinon.SinonStub;
+      profile.callsFake(async () => {
+        await new Promise(resolve => setTimeout(resolve, 10));
+        cpuNanos += 1000;
+        return timeProfile;
+      });
+      try {
+        const profiler = new Profiler({...testConfig, timeThreadCpu: true});
+        const requestProf = {
+          name: 'projects/12345678901/test-projectId',
+          profileType: 'WALL',
+          duration: '10s',
+        };
+        const profs = await Promise.all([
+          profiler.writeTimeProfile({...requestProf}),
+          profiler.writeTimeProfile({...requestProf}),
+        ]);
+        for (const prof of profs) {
+          const outProfile = perftools.profiles.Profile.decode(
+            zlib.gunzipSync(Buffer.from(prof.profileBytes!, 'base64'))
+          );
+          const comments = outProfile.comment.map(
+            c => outProfile.stringTable[Number(c)]
+          );
+          assert.ok(
+            comments.some(c =>
+              c.startsWith('main thread CPU time: 1000 nanoseconds')
+            ),
+            JSON.stringify(comments)
+          );
+        }
+      } finally {
+        readCpu.restore();
+      }
+    });
     it('should throw error when time profiling is not enabled.', async () => {
       const config = extend(true, {}, testConfig);
       config.disableTime = true;
@@ -251,6 +495,37 @@ describe('Profiler', () => {
         assert.deepStrictEqual(decodedHeapProfile, outProfile);
       }
     );
+    it('should log each leak trend once while it lasts', async () => {
+      const profiler = new Profiler({...testConfig, leakDetection: true});
+      const trend = {
+        frames: [{name: 'grow', filename: '/app/a.js', line: 1}],
+        bytesPerHour: 1000,
+        latestBytes: 5000,
+        points: 4,
+      };
+      const trends = sinon
+        .stub(LeakDetector.prototype, 'trends')
+        .returns([trend]);
+      const info = sinon.stub(profiler['logger'], 'info');
+      try {
+        const requestProf = {
+          name: 'projects/12345678901/test-projectId',
+          profileType: 'HEAP',
+        };
+        await profiler.writeHeapProfile(requestProf);
+        await profiler.writeHeapProfile(requestProf);
+        assert.strictEqual(info.callCount, 1);
+        assert.ok(info.firstCall.args[0].includes('grow (/app/a.js:1)'));
+        trends.returns([]);
+        await profiler.writeHeapProfile(requestProf);
+        trends.returns([trend]);
+        await profiler.writeHeapProfile(requestProf);
+        assert.strictEqual(info.callCount, 2);
+      } finally {
+        trends.restore();
+        info.restore();
+      }
+    });
     it('should throw error when heap profiling is not enabled.', async () => {
       const config = extend(true, {}, testConfig);
       config.disableHeap = true;
@@ -446,6 +721,251 @@ describe('Profiler', () => {
       await profiler.profileAndUpload(requestProf);
       assert.strictEqual(apiMock.isDone(), true, 'completed call to test API');
     });
+    it('should export profile while uploading it.', async () => {
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'HEAP',
+      };
+      requestStub = sinon
+        .stub(common.ServiceObject.prototype, 'request')
+        .onCall(0)
+        .callsArgWith(1, null, {}, {statusCode: 200});
+      const exported: ExportedProfile[] = [];
+      const config = extend(true, {}, testConfig);
+      config.exporters = [
+        {
+          name: 'test',
+          export: async (p: ExportedProfile) => {
+            exported.push(p);
+          },
+        },
+      ];
+      const profiler = new Profiler(config);
+      await profiler.profileAndUpload(requestProf);
+
+      assert.strictEqual(requestStub.callCount, 1);
+      assert.strictEqual(exported.length, 1);
+      assert.strictEqual(exported[0].profileType, 'HEAP');
+      assert.strictEqual(exported[0].service, 'test-service');
+      assert.deepStrictEqual(exported[0].labels, {instance: 'test-instance'});
+      const outProfile = perftools.profiles.Profile.decode(
+        zlib.gunzipSync(exported[0].profileBytes)
+      );
+      assert.deepStrictEqual(decodedHeapProfile, outProfile);
+    });
+  });
+  describe('useCollector', () => {
+    it('should upload profile returned by collector', async () => {
+      const requestProf = {
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'HEAP',
+      };
+      nockOauth2();
+      const apiMock = nock(FULL_API)
+        .patch(
+          '/' + requestProf.name,
+          // eslint-disable-next-line @typescript-eslint/no-explicit-any
+          (body: any) =>
+            body.profileBytes === 'worker-bytes' &&
+            body.labels.instance === 'test-instance-worker-1'
+        )
+        .once()
+        .reply(200);
+      const profiler = new Profiler(testConfig);
+      profiler.useCollector(async prof =>
+        Object.assign({}, prof, {
+          profileBytes: 'worker-bytes',
+          labels: {instance: 'test-instance-worker-1'},
+        })
+      );
+      await profiler.profileAndUpload(requestProf);
+      assert.ok(apiMock.isDone(), 'expected call to upload profile');
+    });
+    it('should export but not upload MEMORY profile', async () => {
+      const exported: ExportedProfile[] = [];
+      const config = extend(true, {}, testConfig);
+      config.exporters = [
+        {
+          name: 'test',
+          export: async (p: ExportedProfile) => {
+            exported.push(p);
+          },
+        },
+      ];
+      const profiler = new Profiler(config);
+      profiler.useCollector(async prof =>
+        Object.assign({}, prof, {profileBytes: 'memory-bytes'})
+      );
+      const request = sinon.stub(common.ServiceObject.prototype, 'request');
+      try {
+        await profiler.profileAndUpload({
+          name: 'projects/12345678901/test-projectId',
+          profileType: 'MEMORY',
+        });
+      } finally {
+        request.restore();
+      }
+      assert.strictEqual(request.called, false);
+      assert.strictEqual(exported.length, 1);
+      assert.strictEqual(exported[0].profileType, 'MEMORY');
+    });
+  });
+  describe('recordFlightProfiles', () => {
+    it('should record heap and wall profiles', async () => {
+      const config = extend(true, {}, testConfig);
+      config.flightRecorderPeriodMillis = 60 * 1000;
+      const profiler = new Profiler(config);
+      await profiler.recordFlightProfiles();
+      const dir = tmp.dirSync({unsafeCleanup: true}).name;
+      const files = profiler.dumpFlightRecorder(dir);
+      assert.strictEqual(files.length, 2);
+      const decoded = await Promise.all(
+        files.map(async f => {
+          const unzipped = (await promisify(zlib.gunzip)(
+            fs.readFileSync(f)
+          )) as Uint8Array;
+          return perftools.profiles.Profile.decode(unzipped);
+        })
+      );
+      assert.deepStrictEqual(decoded, [decodedHeapProfile, decodedTimeProfile]);
+    });
+    it('should record profiles requested by the server', async () => {
+      const config = extend(true, {}, testConfig);
+      config.flightRecorderPeriodMillis = 60 * 1000;
+      const profiler = new Profiler(config);
+      await profiler.writeHeapProfile({
+        name: 'projects/12345678901/test-projectId',
+        profileType: 'HEAP',
+      });
+      const dir = tmp.dirSync({unsafeCleanup: true}).name;
+      assert.strictEqual(profiler.dumpFlightRecorder(dir).length, 1);
+    });
+    it('should throw error when flight recorder is not enabled', () => {
+      const profiler = new Profiler(testConfig);
+      assert.throws(
+        () => profiler.dumpFlightRecorder(),
+        /Flight recorder is not enabled./
+      );
+    });
+  });
+  describe('uploadPendingProfiles', () => {
+    it('should upload and remove pending heap profiles', async () => {
+      const config = extend(true, {}, testConfig);
+      config.heapLimitProfileDir = tmp.dirSync({unsafeCleanup: true}).name;
+      const file = writePendingProfile(config.heapLimitProfileDir, heapProfile);
+      nockOauth2();
+      const apiMock = nock(FULL_API)
+        .post(
+          '/projects/' + testConfig.projectId + '/profiles:createOffline',
+          // eslint-disable-next-line @typescript-eslint/no-explicit-any
+          (body: any) =>
+            body.profileType === 'HEAP' &&
+            body.profileBytes === fs.readFileSync(file).toString('base64')
+        )
+        .once()
+        .reply(200);
+      const profiler = new Profiler(config);
+      await profiler.uploadPendingProfiles();
+      assert.ok(apiMock.isDone(), 'expected call to create offline profile');
+      assert.strictEqual(fs.existsSync(file), false);
+    });
+    it('should keep pending heap profile when upload fails', async () => {
+      const config = extend(true, {}, testConfig);
+      config.heapLimitProfileDir = tmp.dirSync({unsafeCleanup: true}).name;
+      const file = writePendingProfile(config.heapLimitProfileDir, heapProfile);
+      nockOauth2();
+      nock(FULL_API)
+        .post('/projects/' + testConfig.projectId + '/profiles:createOffline')
+        .once()
+        .reply(500);
+      const profiler = new Profiler(config);
+      await profiler.uploadPendingProfiles();
+      assert.strictEqual(fs.existsSync(file), true);
+    });
+    it('should skip pending heap profiles of other services', async () => {
+      const config = extend(true, {}, testConfig);
+      config.heapLimitProfileDir = tmp.dirSync({unsafeCleanup: true}).name;
+      const file = writePendingProfile(
+        config.heapLimitProfileDir,
+        heapProfile,
+        'other-service'
+      );
+      const profiler = new Profiler(config);
+      await profiler.uploadPendingProfiles();
+      assert.strictEqual(fs.existsSync(file), true);
+    });
+  });
+  describe('startInProcess', () => {
+    it('should not upload pending profiles or poll the server', async () => {
+      const config = extend(true, {}, testConfig);
+      config.heapLimitProfileDir = tmp.dirSync({unsafeCleanup: true}).name;
+      const file = writePendingProfile(config.heapLimitProfileDir, heapProfile);
+      const profiler = new Profiler(config);
+      const runLoop = sinon.stub(profiler, 'runLoop');
+      await profiler.startInProcess();
+      profiler.stop();
+      assert.strictEqual(fs.existsSync(file), true);
+      assert.strictEqual(runLoop.called, false);
+    });
+  });
+  describe('start', () => {
+    it('should upload pending profiles before polling the server', async () => {
+      const config = extend(true, {}, testConfig);
+      config.heapLimitProfileDir = tmp.dirSync({unsafeCleanup: true}).name;
+      const file = writePendingProfile(config.heapLimitProfileDir, heapProfile);
+      nockOauth2();
+      const apiMock = nock(FULL_API)
+        .post('/projects/' + testConfig.projectId + '/profiles:createOffline')
+        .once()
+        .reply(200);
+      const profiler = new Profiler(config);
+      const runLoop = sinon.stub(profiler, 'runLoop');
+      await profiler.start();
+      profiler.stop();
+      assert.ok(apiMock.isDone(), 'expected call to create offline profile');
+      assert.strictEqual(fs.existsSync(file), false);
+      assert.ok(runLoop.calledOnce);
+    });
+  });
+  describe('captureTriggeredProfile', () => {
+    it('should upload profile labeled with trigger reason', async () => {
+      nockOauth2();
+      const apiMock = nock(FULL_API)
+        .post(
+          '/projects/' + testConfig.projectId + '/profiles:createOffline',
+          // eslint-disable-next-line @typescript-eslint/no-explicit-any
+          (body: any) =>
+            body.profileType === 'WALL' &&
+            body.labels.trigger === 'cpu' &&
+            body.labels.instance === testConfig.instance
+        )
+        .once()
+        .reply(200);
+      const profiler = new Profiler(testConfig);
+      await profiler.captureTriggeredProfile({
+        reason: 'cpu',
+        profileType: 'WALL',
+      });
+      assert.ok(apiMock.isDone(), 'expected call to create offline profile');
+    });
+    it('should write profile to triggerProfileDir when set', async () => {
+      const config = extend(true, {}, testConfig);
+      config.triggerProfileDir = tmp.dirSync({unsafeCleanup: true}).name;
+      const profiler = new Profiler(config);
+      await profiler.captureTriggeredProfile({
+        reason: 'rss_growth',
+        profileType: 'HEAP',
+      });
+      const files = fs.readdirSync(config.triggerProfileDir);
+      assert.strictEqual(files.length, 1);
+      const unzipped = (await promisify(zlib.gunzip)(
+        fs.readFileSync(`${config.triggerProfileDir}/${files[0]}`)
+      )) as Uint8Array;
+      assert.deepStrictEqual(
+        perftools.profiles.Profile.decode(unzipped),
+        decodedHeapProfile
+      );
+    });
   });
   describe('createProfile', () => {
     let requestStub:
@@ -0,0 +1,98 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {afterEach, describe, it} from 'mocha';
+
+import {perftools} from '../protos/profile';
+import {getString, locationFrames} from '../src/profile-utils';
+import {PromiseProfiler} from '../src/promise-profile';
+
+function chainPromises(n: number): Promise<number> {
+  let p = Promise.resolve(0);
+  for (let i = 0; i < n; i++) {
+    p = p.then(v => v + 1);
+  }
+  return p;
+}
+
+/**
+ * @return the samples of p with the name of the leaf function of their
+ * stacks.
+ */
+function promiseSamples(p: perftools.profiles.IProfile) {
+  const frames = locationFrames(p);
+  return (p.sample || []).map(s => {
+    const leaf = (s.locationId || [])[0];
+    return {
+      count: Number(s.value![0]),
+      nanos: Number(s.value![1]),
+      leaf: leaf === undefined ? '' : frames.get(Number(leaf))![0].name,
+    };
+  });
+}
+
+describe('PromiseProfiler', () => {
+  let profiler: PromiseProfiler | undefined;
+  afterEach(() => {
+    if (profiler) {
+      profiler.stop();
+      profiler = undefined;
+    }
+  });
+
+  it('should record promises and microtasks by creating stack', async () => {
+    profiler = new PromiseProfiler(1, 64, 100, 100, '');
+    profiler.start();
+    await chainPromises(10);
+    const p = profiler.stop();
+
+    assert.deepStrictEqual(
+      p.sampleType!.map(t => getString(p, t.type)),
+      ['promises', 'microtasks']
+    );
+    const samples = promiseSamples(p);
+    const chained = samples.filter(s => s.leaf === 'chainPromises');
+    assert.strictEqual(chained.length, 1, JSON.stringify(samples));
+    assert.ok(chained[0].count >= 11, `count ${chained[0].count}`);
+    assert.ok(chained[0].nanos > 0);
+  });
+
+  it('should scale sampled promises by sampling interval', async () => {
+    profiler = new PromiseProfiler(10, 64, 100, 100, '');
+    profiler.start();
+    await chainPromises(100);
+    const samples = promiseSamples(profiler.stop());
+    assert.ok(samples.length > 0);
+    for (const s of samples) {
+      assert.strictEqual(s.count % 10, 0, JSON.stringify(samples));
+    }
+  });
+
+  it('should not record promises created after stopping', async () => {
+    profiler = new PromiseProfiler(1, 64, 100, 100, '');
+    profiler.start();
+    profiler.stop();
+    await chainPromises(10);
+    assert.deepStrictEqual(profiler.stop().sample, []);
+  });
+
+  it('should not record promises from ignored path', async () => {
+    profiler = new PromiseProfiler(1, 64, 100, 100, 'test-promise-profile');
+    profiler.start();
+    await chainPromises(10);
+    const samples = promiseSamples(profiler.stop());
+    assert.ok(!samples.some(s => s.leaf === 'chainPromises'));
+  });
+});
@@ -0,0 +1,145 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {ProfileBuilder} from '../src/profile-builder';
+import {getString, locationFunctions} from '../src/profile-utils';
+import {pruneStacks} from '../src/prune';
+import {timeProfile} from './profiles-for-tests';
+
+describe('pruneStacks', () => {
+  it('should return profile unchanged when pruning is disabled', () => {
+    assert.strictEqual(pruneStacks(timeProfile, 0, 0), timeProfile);
+    assert.strictEqual(pruneStacks(timeProfile, 4, 0), timeProfile);
+  });
+
+  const expectedSamples = [
+    {locationId: [2], value: [3, 3000]},
+    {locationId: [3, 2], value: [2, 2000]},
+    {locationId: [5], value: [1, 1000]},
+    {locationId: [5, 2], value: [1, 1000]},
+  ];
+
+  function checkPruned(pruned: typeof timeProfile) {
+    assert.deepStrictEqual(
+      pruned.sample!.map(s => ({
+        locationId: s.locationId!.map(Number),
+        value: s.value!.map(Number),
+      })),
+      expectedSamples
+    );
+    assert.deepStrictEqual(pruned.location!.map(l => l.id), [2, 3, 5]);
+    const fns = locationFunctions(pruned).get(5)!;
+    assert.strictEqual(getString(pruned, fns[0].name), '(pruned)');
+  }
+
+  it('should keep the hottest maxStacks stacks', () => {
+    checkPruned(pruneStacks(timeProfile, 2, 0));
+  });
+
+  it('should keep the stacks covering valueFraction of the value', () => {
+    checkPruned(pruneStacks(timeProfile, 0, 0.5));
+  });
+
+  it('should rank stacks by the sample type at valueIdx', () => {
+    const builder = ProfileBuilder.create([
+      {type: 'space', unit: 'bytes'},
+      {type: 'space_delta', unit: 'bytes'},
+    ]);
+    const large = {name: 'large', filename: '/app/a.js', line: 1};
+    const small = {name: 'small', filename: '/app/a.js', line: 2};
+    builder.addSample([large], [1000, -10]);
+    builder.addSample([small], [10, 10]);
+    const pruned = pruneStacks(builder.profile, 1, 0, 0);
+    const fns = locationFunctions(pruned);
+    const kept = fns.get(Number(pruned.sample![0].locationId![0]))!;
+    assert.strictEqual(getString(pruned, kept[0].name), 'large');
+    assert.deepStrictEqual(pruned.sample![1].value!.map(Number), [10, 10]);
+  });
+
+  it('should bound the number of stacks by maxStacks + 1', () => {
+    const builder = ProfileBuilder.create([
+      {type: 'sample', unit: 'count'},
+      {type: 'wall', unit: 'microseconds'},
+    ]);
+    for (let i = 1; i <= 100; i++) {
+      builder.addSample(
+        [
+          {name: `leaf${i}`, filename: '/app/main.js', line: i},
+          {name: `caller${i}`, filename: '/app/main.js', line: 1000 + i},
+        ],
+        [i, i * 1000]
+      );
+    }
+    const pruned = pruneStacks(builder.profile, 10, 0);
+    assert.strictEqual(pruned.sample!.length, 11);
+    const tail = pruned.sample![10];
+    assert.strictEqual(tail.locationId!.length, 1);
+    assert.deepStrictEqual(tail.value!.map(Number), [90 * 45.5, 90 * 45500]);
+  });
+
+  it('should fold pruned stacks under their deepest kept caller', () => {
+    const builder = ProfileBuilder.create([
+      {type: 'sample', unit: 'count'},
+      {type: 'wall', unit: 'microseconds'},
+    ]);
+    const main = {name: 'main', filename: '/app/main.js', line: 1};
+    const handle = {name: 'handle', filename: '/app/main.js', line: 2};
+    const frame = (name: string) => ({name, filename: '/app/b.js', line: 3});
+    builder.addSample([frame('hot'), handle, main], [10, 10000]);
+    builder.addSample([frame('d'), frame('other')], [5, 5000]);
+    builder.addSample([frame('c'), main], [4, 4000]);
+    builder.addSample([frame('b'), handle, main], [3, 3000]);
+    builder.addSample([frame('a'), handle, main], [2, 2000]);
+    builder.addSample([frame('x'), frame('y')], [1, 1000]);
+    const pruned = pruneStacks(builder.profile, 2, 0);
+    const fns = locationFunctions(pruned);
+    assert.deepStrictEqual(
+      pruned.sample!.map(s => ({
+        stack: s.locationId!.map(id =>
+          getString(pruned, fns.get(Number(id))![0].name)
+        ),
+        value: s.value!.map(Number),
+      })),
+      [
+        {stack: ['hot', 'handle', 'main'], value: [10, 10000]},
+        {stack: ['d', 'other'], value: [5, 5000]},
+        {stack: ['(pruned)', 'main'], value: [4, 4000]},
+        {stack: ['(pruned)', 'handle', 'main'], value: [5, 5000]},
+        {stack: ['(pruned)'], value: [1, 1000]},
+      ]
+    );
+  });
+
+  it('should fold pruned stacks at the root beyond maxStacks callers', () => {
+    const builder = ProfileBuilder.create([
+      {type: 'sample', unit: 'count'},
+      {type: 'wall', unit: 'microseconds'},
+    ]);
+    const main = {name: 'main', filename: '/app/main.js', line: 1};
+    const handle = {name: 'handle', filename: '/app/main.js', line: 2};
+    const frame = (name: string) => ({name, filename: '/app/b.js', line: 3});
+    builder.addSample([frame('hot'), handle, main], [10, 10000]);
+    builder.addSample([frame('a'), handle, main], [2, 2000]);
+    builder.addSample([frame('b'), main], [1, 1000]);
+    const pruned = pruneStacks(builder.profile, 1, 0);
+    assert.deepStrictEqual(
+      pruned.sample!.map(s => s.locationId!.length),
+      [3, 3, 1]
+    );
+    assert.deepStrictEqual(pruned.sample![2].value!.map(Number), [1, 1000]);
+  });
+});
@@ -0,0 +1,85 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {perftools} from '../protos/profile';
+import {getString} from '../src/profile-utils';
+import {foldRecursion, foldStack} from '../src/recursion';
+import {timeProfile} from './profiles-for-tests';
+
+describe('foldStack', () => {
+  it('should fold direct recursion', () => {
+    assert.deepStrictEqual(foldStack([1, 2, 2, 2, 2, 3], 1), {
+      stack: [1, 2, 3],
+      depth: 3,
+    });
+  });
+
+  it('should fold mutual recursion', () => {
+    assert.deepStrictEqual(foldStack([1, 2, 3, 2, 3, 2, 3, 4], 2), {
+      stack: [1, 2, 3, 4],
+      depth: 2,
+    });
+  });
+
+  it('should not fold cycles longer than maxCycleLength', () => {
+    assert.deepStrictEqual(foldStack([1, 2, 3, 2, 3, 4], 1), {
+      stack: [1, 2, 3, 2, 3, 4],
+      depth: 0,
+    });
+  });
+
+  it('should fold very deep stacks', () => {
+    const deep = [1].concat(new Array(100000).fill(2));
+    assert.deepStrictEqual(foldStack(deep, 4), {stack: [1, 2], depth: 99999});
+  });
+});
+
+describe('foldRecursion', () => {
+  it('should return profile unchanged when disabled', () => {
+    assert.strictEqual(foldRecursion(timeProfile, 0), timeProfile);
+  });
+
+  it('should return profile unchanged when there is no recursion', () => {
+    assert.strictEqual(foldRecursion(timeProfile, 4), timeProfile);
+  });
+
+  it('should fold stacks and label folded samples', () => {
+    const recursive = Object.assign({}, timeProfile, {
+      sample: [
+        new perftools.profiles.Sample({
+          locationId: [1, 1, 1, 2],
+          value: [1, 1000],
+        }),
+        new perftools.profiles.Sample({
+          locationId: [1, 1, 2],
+          value: [2, 2000],
+        }),
+      ],
+    });
+    const folded = foldRecursion(recursive, 1);
+    assert.strictEqual(folded.sample!.length, 2);
+    const [deeper, shallower] = folded.sample!;
+    assert.deepStrictEqual(deeper.locationId, [1, 2]);
+    assert.strictEqual(
+      getString(folded, deeper.label![0].key),
+      'recursion_depth'
+    );
+    assert.strictEqual(deeper.label![0].num, 2);
+    assert.deepStrictEqual(shallower.locationId, [1, 2]);
+    assert.strictEqual(shallower.label![0].num, 1);
+  });
+});
@@ -0,0 +1,60 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {captureStack} from '../src/stack-capture';
+
+function outer() {
+  return inner();
+}
+
+function inner() {
+  return captureStack(10);
+}
+
+describe('captureStack', () => {
+  it('should capture frames of caller, leaf first', () => {
+    const frames = outer();
+    assert.deepStrictEqual(
+      frames.slice(0, 2).map(f => f.name),
+      ['inner', 'outer']
+    );
+    assert.strictEqual(frames[0].filename, __filename);
+    assert.ok(frames[0].line > 0);
+  });
+
+  it('should omit frames of below and its callees', () => {
+    function wrapper() {
+      return captureStack(10, wrapper);
+    }
+    function caller() {
+      return wrapper();
+    }
+    assert.strictEqual(caller()[0].name, 'caller');
+  });
+
+  it('should limit number of frames', () => {
+    assert.ok(outer().length <= 10);
+    assert.strictEqual(captureStack(1).length, 1);
+  });
+
+  it('should restore stack trace settings', () => {
+    const limit = Error.stackTraceLimit;
+    outer();
+    assert.strictEqual(Error.stackTraceLimit, limit);
+    assert.strictEqual(typeof new Error().stack, 'string');
+  });
+});
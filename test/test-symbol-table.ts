@@ -0,0 +1,92 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import {describe, it} from 'mocha';
+
+import {perftools} from '../protos/profile';
+import {getString, locationFunctions} from '../src/profile-utils';
+import {SymbolTable} from '../src/symbol-table';
+import {heapProfile, timeProfile} from './profiles-for-tests';
+
+// Returns a description of each sample of p which does not depend on the IDs
+// used in p.
+function describeSamples(p: perftools.profiles.IProfile): string[] {
+  const fns = locationFunctions(p);
+  return p.sample!.map(s => {
+    const stack = s.locationId!.map(id =>
+      fns
+        .get(Number(id))!
+        .map(f => `${getString(p, f.name)}@${getString(p, f.filename)}`)
+        .join('|')
+    );
+    return `${stack.join(';')}=${s.value!.map(Number).join(',')}`;
+  });
+}
+
+describe('SymbolTable', () => {
+  it('should encode profiles equivalent to the original', () => {
+    const symbols = new SymbolTable(1000);
+    for (const p of [timeProfile, heapProfile]) {
+      const decoded = perftools.profiles.Profile.decode(symbols.encode(p));
+      assert.deepStrictEqual(describeSamples(decoded), describeSamples(p));
+      assert.strictEqual(Number(decoded.period), Number(p.period));
+    }
+  });
+
+  it('should keep IDs stable and only add new entries once', () => {
+    const symbols = new SymbolTable(1000);
+    const first = perftools.profiles.Profile.decode(
+      symbols.encode(timeProfile)
+    );
+    assert.deepStrictEqual(symbols.lastStats(), {
+      newStrings: 8,
+      newFunctions: 3,
+      newLocations: 4,
+      reset: false,
+    });
+    const second = perftools.profiles.Profile.decode(
+      symbols.encode(timeProfile)
+    );
+    assert.deepStrictEqual(symbols.lastStats(), {
+      newStrings: 0,
+      newFunctions: 0,
+      newLocations: 0,
+      reset: false,
+    });
+    assert.deepStrictEqual(second, first);
+  });
+
+  it('should only include the strings referenced by a profile', () => {
+    const symbols = new SymbolTable(1000);
+    symbols.encode(heapProfile);
+    const decoded = perftools.profiles.Profile.decode(
+      symbols.encode(timeProfile)
+    );
+    assert.deepStrictEqual(
+      describeSamples(decoded),
+      describeSamples(timeProfile)
+    );
+    const used = new Set(decoded.stringTable.filter(s => s !== ''));
+    const expected = new Set(timeProfile.stringTable!.filter(s => s !== ''));
+    assert.deepStrictEqual(used, expected);
+  });
+
+  it('should reset once maxEntries is exceeded', () => {
+    const symbols = new SymbolTable(2);
+    symbols.encode(timeProfile);
+    symbols.encode(timeProfile);
+    assert.strictEqual(symbols.lastStats().reset, true);
+  });
+});
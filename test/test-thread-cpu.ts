@@ -0,0 +1,55 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import * as path from 'path';
+import * as tmp from 'tmp';
+
+import {formatThreadCpu, readThreadCpuNanos} from '../src/thread-cpu';
+
+describe('readThreadCpuNanos', () => {
+  const dir = tmp.dirSync({unsafeCleanup: true}).name;
+
+  it('should read CPU time from schedstat file', () => {
+    const file = path.join(dir, 'schedstat');
+    fs.writeFileSync(file, '123456789 2000 30\n');
+    assert.strictEqual(readThreadCpuNanos(file), 123456789);
+  });
+
+  it('should return undefined when file cannot be read', () => {
+    assert.strictEqual(
+      readThreadCpuNanos(path.join(dir, 'missing')),
+      undefined
+    );
+  });
+});
+
+describe('formatThreadCpu', () => {
+  it('should report CPU time as share of wall time', () => {
+    assert.strictEqual(
+      formatThreadCpu(2.5e9, 10e9),
+      'main thread CPU time: 2500000000 nanoseconds ' +
+        '(25.0% of 10000000000 nanoseconds wall time)'
+    );
+  });
+
+  it('should report only CPU time when wall time is unknown', () => {
+    assert.strictEqual(
+      formatThreadCpu(1000, 0),
+      'main thread CPU time: 1000 nanoseconds'
+    );
+  });
+});
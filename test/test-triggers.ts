@@ -0,0 +1,159 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import * as assert from 'assert';
+import * as fs from 'fs';
+import {describe, it} from 'mocha';
+import * as path from 'path';
+import * as tmp from 'tmp';
+
+import {
+  exceededTrigger,
+  Trigger,
+  TriggerMetrics,
+  TriggerMonitor,
+  writeTriggeredProfile,
+} from '../src/triggers';
+
+const noLoad: TriggerMetrics = {
+  eventLoopDelayP99Millis: 1,
+  cpuUtilization: 0.1,
+  rssGrowthBytesPerSecond: 0,
+};
+
+const thresholds: TriggerMetrics = {
+  eventLoopDelayP99Millis: 100,
+  cpuUtilization: 0.9,
+  rssGrowthBytesPerSecond: 1024 * 1024,
+};
+
+describe('exceededTrigger', () => {
+  it('should return undefined when no threshold is exceeded', () => {
+    assert.strictEqual(exceededTrigger(thresholds, noLoad), undefined);
+  });
+
+  it('should capture wall profile on event loop delay', () => {
+    const metrics = Object.assign({}, noLoad, {eventLoopDelayP99Millis: 200});
+    assert.deepStrictEqual(exceededTrigger(thresholds, metrics), {
+      reason: 'event_loop_delay',
+      profileType: 'WALL',
+    });
+  });
+
+  it('should capture wall profile on CPU utilization', () => {
+    const metrics = Object.assign({}, noLoad, {cpuUtilization: 0.95});
+    assert.deepStrictEqual(exceededTrigger(thresholds, metrics), {
+      reason: 'cpu',
+      profileType: 'WALL',
+    });
+  });
+
+  it('should capture heap profile on RSS growth', () => {
+    const metrics = Object.assign({}, noLoad, {
+      rssGrowthBytesPerSecond: 2 * 1024 * 1024,
+    });
+    assert.deepStrictEqual(exceededTrigger(thresholds, metrics), {
+      reason: 'rss_growth',
+      profileType: 'HEAP',
+    });
+  });
+
+  it('should ignore thresholds of 0', () => {
+    const disabled = {
+      eventLoopDelayP99Millis: 0,
+      cpuUtilization: 0,
+      rssGrowthBytesPerSecond: 0,
+    };
+    const metrics = {
+      eventLoopDelayP99Millis: 1000,
+      cpuUtilization: 1,
+      rssGrowthBytesPerSecond: 1e9,
+    };
+    assert.strictEqual(exceededTrigger(disabled, metrics), undefined);
+  });
+});
+
+describe('TriggerMonitor', () => {
+  it('should trigger at most once per minIntervalMillis', () => {
+    const triggers: Trigger[] = [];
+    const busy = Object.assign({}, noLoad, {cpuUtilization: 1});
+    const monitor = new TriggerMonitor(
+      thresholds,
+      1000,
+      60 * 1000,
+      t => triggers.push(t),
+      () => busy
+    );
+    assert.ok(monitor.check(0));
+    assert.strictEqual(monitor.check(30 * 1000), undefined);
+    assert.ok(monitor.check(60 * 1000));
+    assert.strictEqual(triggers.length, 2);
+  });
+
+  it('should not trigger when thresholds are not exceeded', () => {
+    let triggered = false;
+    const monitor = new TriggerMonitor(
+      thresholds,
+      1000,
+      0,
+      () => (triggered = true),
+      () => noLoad
+    );
+    assert.strictEqual(monitor.check(), undefined);
+    assert.strictEqual(triggered, false);
+  });
+  it('should only measure the process while started', () => {
+    const triggers: Trigger[] = [];
+    const monitor = new TriggerMonitor(
+      {
+        eventLoopDelayP99Millis: 0,
+        cpuUtilization: 1e-9,
+        rssGrowthBytesPerSecond: 0,
+      },
+      60 * 1000,
+      0,
+      t => triggers.push(t)
+    );
+    assert.strictEqual(monitor.check(), undefined);
+    monitor.start();
+    const start = Date.now();
+    while (Date.now() - start < 20) {
+      // Use CPU time so that utilization is above the threshold.
+    }
+    assert.deepStrictEqual(monitor.check(), {
+      reason: 'cpu',
+      profileType: 'WALL',
+    });
+    monitor.stop();
+    assert.strictEqual(monitor.check(), undefined);
+    assert.strictEqual(triggers.length, 1);
+  });
+});
+
+describe('writeTriggeredProfile', () => {
+  it('should write profile named after trigger', () => {
+    const dir = tmp.dirSync({unsafeCleanup: true}).name;
+    const file = writeTriggeredProfile(
+      dir,
+      {reason: 'cpu', profileType: 'WALL'},
+      Buffer.from('profile'),
+      0
+    );
+    assert.strictEqual(
+      path.basename(file),
+      'wall-cpu-19700101T000000.000Z.pb.gz'
+    );
+    assert.strictEqual(fs.readFileSync(file).toString(), 'profile');
+  });
+});